@@ -35,6 +35,11 @@
   openocd -c "interface remote_bitbang; remote_bitbang_host raspberrypi; remote_bitbang_port 7777" \
 	  -f target/stm32f1x.cfg
 
+  The server answers the protocol version query 'V' with '2'. With
+  "remote_bitbang_protocol 2" added to the above, OpenOCD then sends whole
+  scans as packed bit vectors in 'S' requests instead of one character per
+  TCK edge.
+
   Or if you want to test UNIX sockets, run both on Raspberry Pi:
   socat UNIX-LISTEN:/tmp/remotebitbang-socket,fork EXEC:"sudo ./remote_bitbang_sysfsgpio tck 11 tms 25 tdo 9 tdi 10"
   openocd -c "interface remote_bitbang; remote_bitbang_host /tmp/remotebitbang-socket" -f target/stm32f1x.cfg
@@ -293,6 +298,63 @@ static void cleanup_all_fds(void)
 	cleanup_fd(srst_fd, srst_gpio);
 }
 
+/* most bits accepted in one protocol v2 shift request */
+#define SHIFT_MAX_BITS (1024 * 1024)
+
+/*
+ * Protocol v2 shift request: a flags byte (bit 0: return TDO), the number
+ * of bits as 32 bit little endian value, then the TMS and the TDI bits,
+ * packed LSB first. All bits are clocked in one go; TDO is sampled before
+ * each rising edge and sent back packed the same way if requested.
+ */
+static int process_shift(void)
+{
+	unsigned char header[5];
+	if (fread(header, 1, sizeof(header), stdin) != sizeof(header))
+		return -1;
+
+	int want_tdo = header[0] & 1;
+	unsigned long bits = header[1] | (header[2] << 8) |
+		((unsigned long)header[3] << 16) | ((unsigned long)header[4] << 24);
+	if (bits > SHIFT_MAX_BITS) {
+		LOG_ERROR("shift request of %lu bits is too long", bits);
+		return -1;
+	}
+
+	size_t bytes = (bits + 7) / 8;
+	unsigned char *tms = malloc(bytes);
+	unsigned char *tdi = malloc(bytes);
+	unsigned char *tdo = calloc(bytes, 1);
+	int ret = -1;
+
+	if (!tms || !tdi || !tdo)
+		goto out;
+	if (fread(tms, 1, bytes, stdin) != bytes || fread(tdi, 1, bytes, stdin) != bytes)
+		goto out;
+
+	int tms_bit = 0;
+	for (unsigned long i = 0; i < bits; i++) {
+		tms_bit = (tms[i / 8] >> (i % 8)) & 1;
+		int tdi_bit = (tdi[i / 8] >> (i % 8)) & 1;
+
+		sysfsgpio_write(0, tms_bit, tdi_bit);
+		if (want_tdo && sysfsgpio_read() == '1')
+			tdo[i / 8] |= 1 << (i % 8);
+		sysfsgpio_write(1, tms_bit, tdi_bit);
+	}
+	sysfsgpio_write(0, tms_bit, 0);
+
+	if (want_tdo && fwrite(tdo, 1, bytes, stdout) != bytes)
+		goto out;
+
+	ret = 0;
+out:
+	free(tms);
+	free(tdi);
+	free(tdo);
+	return ret;
+}
+
 static void process_remote_protocol(void)
 {
 	int c;
@@ -313,7 +375,14 @@ static void process_remote_protocol(void)
 					(d & 1));
 		} else if (c == 'R')
 			putchar(sysfsgpio_read());
-		else
+		else if (c == 'V') /* Protocol version query */
+			putchar('2');
+		else if (c == 'S') { /* Shift (protocol v2) */
+			if (process_shift() < 0) {
+				LOG_ERROR("Bad shift request");
+				break;
+			}
+		} else
 			LOG_ERROR("Unknown command '%c' received", c);
 	}
 }
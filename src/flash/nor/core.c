@@ -26,6 +26,7 @@
 #include <flash/nor/core.h>
 #include <flash/nor/imp.h>
 #include <target/image.h>
+#include <target/memory_cache.h>
 
 /**
  * @file
@@ -36,10 +37,17 @@
 
 static struct flash_bank *flash_banks;
 
+/* flash_write_unlock() buffers, erases and programs this much of a run at a
+ * time, rounded up to the next sector boundary */
+#define FLASH_WRITE_CHUNK_SIZE	(256 * 1024)
+
 int flash_driver_erase(struct flash_bank *bank, int first, int last)
 {
 	int retval;
 
+	/* the flash content changes behind the target's back */
+	memory_cache_invalidate_range(bank->target, bank->base, bank->size);
+
 	retval = bank->driver->erase(bank, first, last);
 	if (retval != ERROR_OK)
 		LOG_ERROR("failed erasing sectors %d to %d", first, last);
@@ -90,6 +98,8 @@ int flash_driver_write(struct flash_bank *bank,
 {
 	int retval;
 
+	memory_cache_invalidate_range(bank->target, bank->base + offset, count);
+
 	retval = bank->driver->write(bank, buffer, offset, count);
 	if (retval != ERROR_OK) {
 		LOG_ERROR(
@@ -559,8 +569,119 @@ static int compare_section(const void *a, const void *b)
 		return -1;
 }
 
+/* Size of the next chunk of a run starting at bank offset @a offset. Chunks
+ * end on sector boundaries, so erasing one never touches the next one. */
+static uint32_t flash_write_chunk_size(struct flash_bank *bank,
+	uint32_t offset, uint32_t remaining)
+{
+	if (remaining <= FLASH_WRITE_CHUNK_SIZE)
+		return remaining;
+
+	for (int i = 0; i < bank->num_sectors; i++) {
+		uint32_t end = bank->sectors[i].offset + bank->sectors[i].size;
+		if (end >= offset + FLASH_WRITE_CHUNK_SIZE)
+			return MIN(end - offset, remaining);
+	}
+
+	return remaining;
+}
+
+static int flash_write_range(struct target *target, struct flash_bank *bank,
+	uint8_t *buffer, uint32_t address, uint32_t size, int erase, bool unlock)
+{
+	int retval = ERROR_OK;
+
+	if (unlock)
+		retval = flash_unlock_address_range(target, address, size);
+	if (retval == ERROR_OK) {
+		if (erase) {
+			/* calculate and erase sectors */
+			retval = flash_erase_address_range(target,
+					true, address, size);
+		}
+	}
+
+	if (retval == ERROR_OK) {
+		/* write flash sectors */
+		retval = flash_driver_write(bank, buffer, address - bank->base, size);
+	}
+
+	return retval;
+}
+
+/* Whether flash at @a address already holds @a buffer, checked by CRC on the
+ * target side so the data needn't be read back. */
+static bool flash_range_matches(struct target *target, const uint8_t *buffer,
+	uint32_t address, uint32_t size)
+{
+	uint32_t host_crc, target_crc;
+
+	if (image_calculate_checksum((uint8_t *)buffer, size, &host_crc) != ERROR_OK)
+		return false;
+
+	if (target_checksum_memory(target, address, size, &target_crc) != ERROR_OK) {
+		LOG_DEBUG("no checksum for 0x%8.8" PRIx32 ", programming it", address);
+		return false;
+	}
+
+	return host_crc == target_crc;
+}
+
+/* Like flash_write_range(), but leave sectors alone which already hold the
+ * data. Only runs of differing sectors are erased and written. */
+static int flash_write_range_diff(struct target *target, struct flash_bank *bank,
+	uint8_t *buffer, uint32_t address, uint32_t size, int erase, bool unlock,
+	uint32_t *skipped)
+{
+	/* most of the time nothing changed at all */
+	if (flash_range_matches(target, buffer, address, size)) {
+		*skipped += size;
+		return ERROR_OK;
+	}
+
+	uint32_t offset = 0, changed = 0;
+	bool pending = false;
+	int retval;
+
+	while (offset < size) {
+		uint32_t bank_offset = address - bank->base + offset;
+		uint32_t piece = size - offset;
+
+		/* compare up to the end of the sector */
+		for (int i = 0; i < bank->num_sectors; i++) {
+			uint32_t end = bank->sectors[i].offset + bank->sectors[i].size;
+			if (end > bank_offset) {
+				piece = MIN(end - bank_offset, piece);
+				break;
+			}
+		}
+
+		if (flash_range_matches(target, buffer + offset, address + offset, piece)) {
+			if (pending) {
+				retval = flash_write_range(target, bank, buffer + changed,
+						address + changed, offset - changed, erase, unlock);
+				if (retval != ERROR_OK)
+					return retval;
+				pending = false;
+			}
+			*skipped += piece;
+		} else if (!pending) {
+			changed = offset;
+			pending = true;
+		}
+
+		offset += piece;
+	}
+
+	if (pending)
+		return flash_write_range(target, bank, buffer + changed,
+				address + changed, size - changed, erase, unlock);
+
+	return ERROR_OK;
+}
+
 int flash_write_unlock(struct target *target, struct image *image,
-	uint32_t *written, int erase, bool unlock)
+	uint32_t *written, int erase, bool unlock, bool skip_unchanged)
 {
 	int retval = ERROR_OK;
 
@@ -568,6 +689,9 @@ int flash_write_unlock(struct target *target, struct image *image,
 	uint32_t section_offset;
 	struct flash_bank *c;
 	int *padding;
+	uint8_t *buffer = NULL;
+	uint32_t buffer_alloc = 0;
+	uint32_t skipped = 0, total = 0;
 
 	section = 0;
 	section_offset = 0;
@@ -599,7 +723,6 @@ int flash_write_unlock(struct target *target, struct image *image,
 	/* loop until we reach end of the image */
 	while (section < image->num_sections) {
 		uint32_t buffer_size;
-		uint8_t *buffer;
 		int section_last;
 		uint32_t run_address = sections[section]->base_address + section_offset;
 		uint32_t run_size = sections[section]->size - section_offset;
@@ -694,84 +817,109 @@ int flash_write_unlock(struct target *target, struct image *image,
 			run_size += delta;
 		}
 
-		/* allocate buffer */
-		buffer = malloc(run_size);
-		if (buffer == NULL) {
-			LOG_ERROR("Out of memory for flash bank buffer");
-			retval = ERROR_FAIL;
-			goto done;
-		}
-		buffer_size = 0;
-
-		/* read sections to the buffer */
-		while (buffer_size < run_size) {
-			size_t size_read;
-
-			size_read = run_size - buffer_size;
-			if (size_read > sections[section]->size - section_offset)
-				size_read = sections[section]->size - section_offset;
+		/* Program the run in chunks, so the buffer stays bounded however
+		 * large the image is. Each chunk is unlocked and erased right
+		 * before it is written.
+		 */
+		uint32_t run_offset = 0;
+		while (run_offset < run_size) {
+			uint32_t chunk_address = run_address + run_offset;
+			uint32_t chunk_size = flash_write_chunk_size(c,
+					chunk_address - c->base, run_size - run_offset);
 
-			/* KLUDGE!
-			 *
-			 * #¤%#"%¤% we have to figure out the section # from the sorted
-			 * list of pointers to sections to invoke image_read_section()...
-			 */
-			intptr_t diff = (intptr_t)sections[section] - (intptr_t)image->sections;
-			int t_section_num = diff / sizeof(struct imagesection);
-
-			LOG_DEBUG("image_read_section: section = %d, t_section_num = %d, "
-					"section_offset = %d, buffer_size = %d, size_read = %d",
-				(int)section, (int)t_section_num, (int)section_offset,
-				(int)buffer_size, (int)size_read);
-			retval = image_read_section(image, t_section_num, section_offset,
-					size_read, buffer + buffer_size, &size_read);
-			if (retval != ERROR_OK || size_read == 0) {
+			if (chunk_size > buffer_alloc) {
 				free(buffer);
-				goto done;
+				buffer = malloc(chunk_size);
+				if (buffer == NULL) {
+					LOG_ERROR("Out of memory for flash bank buffer");
+					buffer_alloc = 0;
+					retval = ERROR_FAIL;
+					goto done;
+				}
+				buffer_alloc = chunk_size;
 			}
+			buffer_size = 0;
+
+			/* read sections to the buffer */
+			while (buffer_size < chunk_size) {
+				size_t size_read;
+
+				/* pad the gap after a completely read section */
+				if (section_offset >= sections[section]->size) {
+					if (padding[section] > 0) {
+						size_read = MIN((uint32_t)padding[section], chunk_size - buffer_size);
+						memset(buffer + buffer_size, c->default_padded_value, size_read);
+						padding[section] -= size_read;
+						buffer_size += size_read;
+					}
+
+					if (padding[section] <= 0) {
+						section++;
+						section_offset = 0;
+					}
+					continue;
+				}
 
-			/* see if we need to pad the section */
-			while (padding[section]--)
-				(buffer + buffer_size)[size_read++] = c->default_padded_value;
-
-			buffer_size += size_read;
-			section_offset += size_read;
-
-			if (section_offset >= sections[section]->size) {
-				section++;
-				section_offset = 0;
+				size_read = chunk_size - buffer_size;
+				if (size_read > sections[section]->size - section_offset)
+					size_read = sections[section]->size - section_offset;
+
+				/* KLUDGE!
+				 *
+				 * #¤%#"%¤% we have to figure out the section # from the sorted
+				 * list of pointers to sections to invoke image_read_section()...
+				 */
+				intptr_t diff = (intptr_t)sections[section] - (intptr_t)image->sections;
+				int t_section_num = diff / sizeof(struct imagesection);
+
+				LOG_DEBUG("image_read_section: section = %d, t_section_num = %d, "
+						"section_offset = %d, buffer_size = %d, size_read = %d",
+					(int)section, (int)t_section_num, (int)section_offset,
+					(int)buffer_size, (int)size_read);
+				retval = image_read_section(image, t_section_num, section_offset,
+						size_read, buffer + buffer_size, &size_read);
+				if (retval != ERROR_OK || size_read == 0)
+					goto done;
+
+				buffer_size += size_read;
+				section_offset += size_read;
+
+				if (section_offset >= sections[section]->size && padding[section] <= 0) {
+					section++;
+					section_offset = 0;
+				}
 			}
-		}
 
-		retval = ERROR_OK;
+			if (skip_unchanged)
+				retval = flash_write_range_diff(target, c, buffer, chunk_address,
+						chunk_size, erase, unlock, &skipped);
+			else
+				retval = flash_write_range(target, c, buffer, chunk_address,
+						chunk_size, erase, unlock);
 
-		if (unlock)
-			retval = flash_unlock_address_range(target, run_address, run_size);
-		if (retval == ERROR_OK) {
-			if (erase) {
-				/* calculate and erase sectors */
-				retval = flash_erase_address_range(target,
-						true, run_address, run_size);
+			if (retval != ERROR_OK) {
+				/* abort operation */
+				goto done;
 			}
-		}
 
-		if (retval == ERROR_OK) {
-			/* write flash sectors */
-			retval = flash_driver_write(c, buffer, run_address - c->base, run_size);
-		}
-
-		free(buffer);
-
-		if (retval != ERROR_OK) {
-			/* abort operation */
-			goto done;
+			run_offset += chunk_size;
 		}
 
 		if (written != NULL)
 			*written += run_size;	/* add run size to total written counter */
+		total += run_size;
+	}
+
+	if (skip_unchanged) {
+		/* only count what actually went to the flash */
+		if (written != NULL)
+			*written -= skipped;
+		LOG_INFO("%" PRIu32 " of %" PRIu32 " bytes unchanged, not programmed",
+			skipped, total);
 	}
 
 done:
+	free(buffer);
 	free(sections);
 	free(padding);
 
@@ -781,7 +929,7 @@ done:
 int flash_write(struct target *target, struct image *image,
 	uint32_t *written, int erase)
 {
-	return flash_write_unlock(target, image, written, erase, false);
+	return flash_write_unlock(target, image, written, erase, false, false);
 }
 
 struct flash_sector *alloc_block_array(uint32_t offset, uint32_t size, int num_blocks)
@@ -44,6 +44,6 @@ int flash_driver_read(struct flash_bank *bank,
 
 /* write (optional verify) an image to flash memory of the given target */
 int flash_write_unlock(struct target *target, struct image *image,
-		uint32_t *written, int erase, bool unlock);
+		uint32_t *written, int erase, bool unlock, bool skip_unchanged);
 
 #endif /* OPENOCD_FLASH_NOR_IMP_H */
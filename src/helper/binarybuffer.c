@@ -26,6 +26,10 @@
 #include "log.h"
 #include "binarybuffer.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 static const unsigned char bit_reverse_table256[] = {
 	0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0, 0x10, 0x90, 0x50, 0xD0, 0x30, 0xB0, 0x70, 0xF0,
 	0x08, 0x88, 0x48, 0xC8, 0x28, 0xA8, 0x68, 0xE8, 0x18, 0x98, 0x58, 0xD8, 0x38, 0xB8, 0x78, 0xF8,
@@ -374,6 +378,71 @@ void bit_copy_discard(struct bit_copy_queue *q)
 	}
 }
 
+#ifdef __SSE2__
+/* Converts 32 hex characters into 16 bytes. Returns false, leaving @a bin
+ * untouched, if any of the characters is not a hex digit. */
+static inline bool unhexify_block_sse2(uint8_t *bin, const char *hex)
+{
+	__m128i in[2] = {
+		_mm_loadu_si128((const __m128i *)hex),
+		_mm_loadu_si128((const __m128i *)(hex + 16)),
+	};
+	__m128i val[2];
+
+	for (int k = 0; k < 2; k++) {
+		/* '0'..'9' */
+		__m128i digit = _mm_sub_epi8(in[k], _mm_set1_epi8('0'));
+		__m128i is_digit = _mm_and_si128(
+				_mm_cmpgt_epi8(in[k], _mm_set1_epi8('0' - 1)),
+				_mm_cmplt_epi8(in[k], _mm_set1_epi8('9' + 1)));
+		/* 'a'..'f' and 'A'..'F' */
+		__m128i lower = _mm_or_si128(in[k], _mm_set1_epi8(0x20));
+		__m128i alpha = _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10));
+		__m128i is_alpha = _mm_and_si128(
+				_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+				_mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+		if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff)
+			return false;
+
+		val[k] = _mm_or_si128(_mm_and_si128(is_digit, digit),
+				_mm_and_si128(is_alpha, alpha));
+	}
+
+	/* combine the nibble pairs, first character is the high nibble */
+	for (int k = 0; k < 2; k++) {
+		__m128i hi = _mm_and_si128(val[k], _mm_set1_epi16(0x00ff));
+		__m128i lo = _mm_srli_epi16(val[k], 8);
+		val[k] = _mm_or_si128(_mm_slli_epi16(hi, 4), lo);
+	}
+
+	_mm_storeu_si128((__m128i *)bin, _mm_packus_epi16(val[0], val[1]));
+
+	return true;
+}
+
+/* Converts 16 bytes into 32 lower case hex characters. All of @a bin is
+ * read before @a hex is written. */
+static inline void hexify_block_sse2(char *hex, const uint8_t *bin)
+{
+	__m128i in = _mm_loadu_si128((const __m128i *)bin);
+	__m128i mask = _mm_set1_epi8(0x0f);
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+	__m128i lo = _mm_and_si128(in, mask);
+
+	/* nibble + '0', plus the distance to 'a' for values above 9 */
+	__m128i nine = _mm_set1_epi8(9);
+	__m128i adjust = _mm_set1_epi8('a' - '0' - 10);
+	hi = _mm_add_epi8(_mm_add_epi8(hi, _mm_set1_epi8('0')),
+			_mm_and_si128(_mm_cmpgt_epi8(hi, nine), adjust));
+	lo = _mm_add_epi8(_mm_add_epi8(lo, _mm_set1_epi8('0')),
+			_mm_and_si128(_mm_cmpgt_epi8(lo, nine), adjust));
+
+	_mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *)(hex + 16), _mm_unpackhi_epi8(hi, lo));
+}
+#endif
+
 /**
  * Convert a string of hexadecimal pairs into its binary
  * representation.
@@ -388,7 +457,7 @@ void bit_copy_discard(struct bit_copy_queue *q)
  */
 size_t unhexify(uint8_t *bin, const char *hex, size_t count)
 {
-	size_t i;
+	size_t i = 0;
 	char tmp;
 
 	if (!bin || !hex)
@@ -396,7 +465,14 @@ size_t unhexify(uint8_t *bin, const char *hex, size_t count)
 
 	memset(bin, 0, count);
 
-	for (i = 0; i < 2 * count; i++) {
+#ifdef __SSE2__
+	/* never look past the end of the string, it may be shorter */
+	size_t avail = strnlen(hex, 2 * count);
+	while (i + 32 <= avail && unhexify_block_sse2(bin + i / 2, hex + i))
+		i += 32;
+#endif
+
+	for (; i < 2 * count; i++) {
 		if (hex[i] >= 'a' && hex[i] <= 'f')
 			tmp = hex[i] - 'a' + 10;
 		else if (hex[i] >= 'A' && hex[i] <= 'F')
@@ -415,6 +491,10 @@ size_t unhexify(uint8_t *bin, const char *hex, size_t count)
 /**
  * Convert binary data into a string of hexadecimal pairs.
  *
+ * The conversion runs front to back and every input byte is read before
+ * the characters it expands to are written, so @p bin may overlap @p hex
+ * as long as it starts at least @p count characters into it.
+ *
  * @param[out] hex Buffer to store string of hexadecimal pairs. The buffer size
  *                 must be at least @p length.
  * @param[in] bin Buffer with binary data to convert into hexadecimal pairs.
@@ -426,13 +506,20 @@ size_t unhexify(uint8_t *bin, const char *hex, size_t count)
  */
 size_t hexify(char *hex, const uint8_t *bin, size_t count, size_t length)
 {
-	size_t i;
+	size_t i = 0;
 	uint8_t tmp;
 
 	if (!length)
 		return 0;
 
-	for (i = 0; i < length - 1 && i < 2 * count; i++) {
+#ifdef __SSE2__
+	while (i + 32 < length && i + 32 <= 2 * count) {
+		hexify_block_sse2(hex + i, bin + i / 2);
+		i += 32;
+	}
+#endif
+
+	for (; i < length - 1 && i < 2 * count; i++) {
 		tmp = (bin[i / 2] >> (4 * ((i + 1) % 2))) & 0x0f;
 		hex[i] = hex_digits[tmp];
 	}
@@ -30,16 +30,28 @@
 #include "configuration.h"
 #include "fileio.h"
 
+#if defined(HAVE_SYS_MMAN_H) && !defined(_WIN32)
+#include <sys/mman.h>
+#define FILEIO_USE_MMAP
+#endif
+
 struct fileio {
 	char *url;
 	size_t size;
 	enum fileio_type type;
 	enum fileio_access access;
 	FILE *file;
+	void *map;
 };
 
 static inline int fileio_close_local(struct fileio *fileio)
 {
+#ifdef FILEIO_USE_MMAP
+	if (fileio->map)
+		munmap(fileio->map, fileio->size);
+	fileio->map = NULL;
+#endif
+
 	int retval = fclose(fileio->file);
 	if (retval != 0) {
 		if (retval == EBADF)
@@ -127,6 +139,7 @@ int fileio_open(struct fileio **fileio, const char *url,
 	tmp->type = type;
 	tmp->access = access_type;
 	tmp->url = strdup(url);
+	tmp->map = NULL;
 
 	retval = fileio_open_local(tmp);
 
@@ -167,6 +180,55 @@ int fileio_seek(struct fileio *fileio, size_t position)
 	return ERROR_OK;
 }
 
+int fileio_tell(struct fileio *fileio, size_t *position)
+{
+	long retval = ftell(fileio->file);
+
+	if (retval < 0) {
+		LOG_ERROR("couldn't get position in file %s: %s", fileio->url, strerror(errno));
+		return ERROR_FILEIO_OPERATION_FAILED;
+	}
+
+	*position = retval;
+
+	return ERROR_OK;
+}
+
+/**
+ * Map the whole file read-only into memory, so that callers can access its
+ * content without copying it through a buffer first. The mapping stays valid
+ * until the file is closed. Only files opened for reading can be mapped.
+ *
+ * @returns ERROR_FILEIO_OPERATION_NOT_SUPPORTED if the host or the file does
+ * not support mapping, in which case the caller should use fileio_read().
+ */
+int fileio_map(struct fileio *fileio, const uint8_t **data)
+{
+#ifdef FILEIO_USE_MMAP
+	if (!fileio->map) {
+		if (fileio->access != FILEIO_READ || fileio->size == 0)
+			return ERROR_FILEIO_OPERATION_NOT_SUPPORTED;
+
+		void *map = mmap(NULL, fileio->size, PROT_READ, MAP_PRIVATE,
+				fileno(fileio->file), 0);
+		if (map == MAP_FAILED) {
+			LOG_DEBUG("couldn't map %s: %s", fileio->url, strerror(errno));
+			return ERROR_FILEIO_OPERATION_NOT_SUPPORTED;
+		}
+#ifdef MADV_SEQUENTIAL
+		madvise(map, fileio->size, MADV_SEQUENTIAL);
+#endif
+		fileio->map = map;
+	}
+
+	*data = fileio->map;
+
+	return ERROR_OK;
+#else
+	return ERROR_FILEIO_OPERATION_NOT_SUPPORTED;
+#endif
+}
+
 static int fileio_local_read(struct fileio *fileio, size_t size, void *buffer,
 		size_t *size_read)
 {
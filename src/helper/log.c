@@ -31,6 +31,7 @@
 #include "time_support.h"
 
 #include <stdarg.h>
+#include <limits.h>
 
 #ifdef _DEBUG_FREE_SPACE_
 #ifdef HAVE_MALLOC_H
@@ -41,6 +42,7 @@
 #endif
 
 int debug_level = -1;
+bool log_filter_active;
 
 static FILE *log_output;
 static struct log_callback *log_callbacks;
@@ -60,7 +62,39 @@ static const char * const log_strings[5] = {
 
 static int count;
 
+/* Messages are formatted into this buffer and written out in one go when
+ * the server loop goes idle, when it fills up, or right away for errors,
+ * warnings and user output. */
+#define LOG_BUF_SIZE	(64 * 1024)
+static char log_buf[LOG_BUF_SIZE];
+static size_t log_buf_len;
+
+/* messages shorter than this are formatted without a heap allocation */
+#define LOG_LINE_SIZE	512
+
+/* Per source file or directory log levels, set with "log_filter".  The
+ * level that applies to a __FILE__ string is cached by pointer so the
+ * patterns are only matched once per file. */
+struct log_filter {
+	char *pattern;
+	int level;
+};
+
+#define LOG_FILTER_NONE		INT_MIN
+#define LOG_FILTER_CACHE_SIZE	512
+#define LOG_FILTER_CACHE_PROBE	8
+
+struct log_filter_cache_entry {
+	const char *file;
+	int level;
+};
+
+static struct log_filter *log_filters;
+static unsigned int log_filter_count;
+static struct log_filter_cache_entry log_filter_cache[LOG_FILTER_CACHE_SIZE];
+
 static struct store_log_forward *log_head;
+static struct store_log_forward *log_tail;
 static int log_forward_count;
 
 struct store_log_forward {
@@ -92,15 +126,109 @@ static void log_forward(const char *file, unsigned line, const char *function, c
 		log->next = NULL;
 		if (log_head == NULL)
 			log_head = log;
-		else {
-			/* append to tail */
-			struct store_log_forward *t;
-			t = log_head;
-			while (t->next != NULL)
-				t = t->next;
-			t->next = log;
+		else
+			log_tail->next = log;
+		log_tail = log;
+	}
+}
+
+void log_flush(void)
+{
+	if (log_buf_len && log_output) {
+		fwrite(log_buf, 1, log_buf_len, log_output);
+		fflush(log_output);
+	}
+	log_buf_len = 0;
+}
+
+static void log_write(const char *format, ...)
+	__attribute__ ((format (PRINTF_ATTRIBUTE_FORMAT, 1, 2)));
+
+static void log_write(const char *format, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(log_buf + log_buf_len, LOG_BUF_SIZE - log_buf_len, format, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+
+	if ((size_t)len < LOG_BUF_SIZE - log_buf_len) {
+		log_buf_len += len;
+		return;
+	}
+
+	/* did not fit; make room, and write oversized messages directly */
+	log_flush();
+	va_start(ap, format);
+	if ((size_t)len < LOG_BUF_SIZE)
+		log_buf_len = vsnprintf(log_buf, LOG_BUF_SIZE, format, ap);
+	else if (log_output)
+		vfprintf(log_output, format, ap);
+	va_end(ap);
+}
+
+static bool log_filter_match(const char *file, const char *pattern)
+{
+	size_t len = strlen(pattern);
+	const char *p = file;
+
+	/* match whole path components, anywhere in the path */
+	for (;;) {
+		if (!strncmp(p, pattern, len) && (p[len] == '\0' || p[len] == '/'))
+			return true;
+		p = strchr(p, '/');
+		if (!p)
+			return false;
+		p++;
+	}
+}
+
+static int log_filter_lookup(const char *file)
+{
+	int level = LOG_FILTER_NONE;
+	size_t best = 0;
+
+	/* the longest matching pattern wins */
+	for (unsigned int i = 0; i < log_filter_count; i++) {
+		size_t len = strlen(log_filters[i].pattern);
+		if (len > best && log_filter_match(file, log_filters[i].pattern)) {
+			level = log_filters[i].level;
+			best = len;
 		}
 	}
+
+	return level;
+}
+
+/* the level messages from the given source file are logged at */
+static int log_level_for(const char *file)
+{
+	if (!log_filter_active)
+		return debug_level;
+
+	unsigned int hash = ((uintptr_t)file >> 3) % LOG_FILTER_CACHE_SIZE;
+	struct log_filter_cache_entry *entry = NULL;
+	for (unsigned int i = 0; i < LOG_FILTER_CACHE_PROBE; i++) {
+		struct log_filter_cache_entry *e =
+			&log_filter_cache[(hash + i) % LOG_FILTER_CACHE_SIZE];
+		if (e->file == file) {
+			entry = e;
+			break;
+		}
+		if (!e->file && !entry)
+			entry = e;
+	}
+	if (!entry)
+		entry = &log_filter_cache[hash];
+	if (entry->file != file) {
+		entry->file = file;
+		entry->level = log_filter_lookup(file);
+	}
+
+	return entry->level == LOG_FILTER_NONE ? debug_level : entry->level;
 }
 
 /* The log_puts() serves to somewhat different goals:
@@ -122,8 +250,8 @@ static void log_puts(enum log_levels level,
 	char *f;
 	if (level == LOG_LVL_OUTPUT) {
 		/* do not prepend any headers, just print out what we were given and return */
-		fputs(string, log_output);
-		fflush(log_output);
+		log_write("%s", string);
+		log_flush();
 		return;
 	}
 
@@ -132,14 +260,14 @@ static void log_puts(enum log_levels level,
 		file = f + 1;
 
 	if (strlen(string) > 0) {
-		if (debug_level >= LOG_LVL_DEBUG) {
+		if (debug_level >= LOG_LVL_DEBUG || log_filter_active) {
 			/* print with count and time information */
 			int64_t t = timeval_ms() - start;
 #ifdef _DEBUG_FREE_SPACE_
 			struct mallinfo info;
 			info = mallinfo();
 #endif
-			fprintf(log_output, "%s%d %" PRId64 " %s:%d %s()"
+			log_write("%s%d %" PRId64 " %s:%d %s()"
 #ifdef _DEBUG_FREE_SPACE_
 				" %d"
 #endif
@@ -151,7 +279,7 @@ static void log_puts(enum log_levels level,
 		} else {
 			/* if we are using gdb through pipes then we do not want any output
 			 * to the pipe otherwise we get repeated strings */
-			fprintf(log_output, "%s%s",
+			log_write("%s%s",
 				(level > LOG_LVL_USER) ? log_strings[level + 1] : "", string);
 		}
 	} else {
@@ -159,7 +287,9 @@ static void log_puts(enum log_levels level,
 		 *nothing. */
 	}
 
-	fflush(log_output);
+	/* Debug and info output can wait for the server loop to go idle */
+	if (level <= LOG_LVL_WARNING)
+		log_flush();
 
 	/* Never forward LOG_LVL_DEBUG, too verbose and they can be found in the log if need be */
 	if (level <= LOG_LVL_INFO)
@@ -177,7 +307,7 @@ void log_printf(enum log_levels level,
 	va_list ap;
 
 	count++;
-	if (level > debug_level)
+	if (level > log_level_for(file))
 		return;
 
 	va_start(ap, format);
@@ -194,13 +324,30 @@ void log_printf(enum log_levels level,
 void log_vprintf_lf(enum log_levels level, const char *file, unsigned line,
 		const char *function, const char *format, va_list args)
 {
+	char line_buf[LOG_LINE_SIZE];
 	char *tmp;
+	va_list ap;
+	int len;
 
 	count++;
 
-	if (level > debug_level)
+	if (level > log_level_for(file))
 		return;
 
+	/* format on the stack, leaving room for the newline */
+	va_copy(ap, args);
+	len = vsnprintf(line_buf, sizeof(line_buf) - 1, format, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+
+	if ((size_t)len < sizeof(line_buf) - 1) {
+		line_buf[len] = '\n';
+		line_buf[len + 1] = '\0';
+		log_puts(level, file, line, function, line_buf);
+		return;
+	}
+
 	tmp = alloc_vprintf(format, args);
 
 	if (!tmp)
@@ -255,6 +402,7 @@ COMMAND_HANDLER(handle_log_output_command)
 			LOG_ERROR("failed to open output log '%s'", CMD_ARGV[0]);
 			return ERROR_FAIL;
 		}
+		log_flush();
 		if (log_output != stderr && log_output != NULL) {
 			/* Close previous log file, if it was open and wasn't stderr. */
 			fclose(log_output);
@@ -265,6 +413,70 @@ COMMAND_HANDLER(handle_log_output_command)
 	return ERROR_OK;
 }
 
+COMMAND_HANDLER(handle_log_filter_command)
+{
+	if (CMD_ARGC == 0) {
+		for (unsigned int i = 0; i < log_filter_count; i++)
+			command_print(CMD_CTX, "%s: %d", log_filters[i].pattern,
+					log_filters[i].level);
+		return ERROR_OK;
+	}
+
+	if (CMD_ARGC != 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	const char *pattern = CMD_ARGV[0];
+	int level = LOG_FILTER_NONE;
+	if (strcmp(CMD_ARGV[1], "default") != 0) {
+		COMMAND_PARSE_NUMBER(int, CMD_ARGV[1], level);
+		if ((level > LOG_LVL_DEBUG) || (level < LOG_LVL_SILENT)) {
+			LOG_ERROR("level must be between %d and %d", LOG_LVL_SILENT, LOG_LVL_DEBUG);
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		}
+	}
+
+	/* "src/jtag" and "jtag/" name the same directory as "jtag" */
+	if (!strncmp(pattern, "src/", 4))
+		pattern += 4;
+	size_t len = strlen(pattern);
+	while (len && pattern[len - 1] == '/')
+		len--;
+	if (!len)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	unsigned int i;
+	for (i = 0; i < log_filter_count; i++) {
+		if (strlen(log_filters[i].pattern) == len &&
+				!strncmp(log_filters[i].pattern, pattern, len))
+			break;
+	}
+
+	if (level == LOG_FILTER_NONE) {
+		if (i < log_filter_count) {
+			free(log_filters[i].pattern);
+			log_filters[i] = log_filters[--log_filter_count];
+		}
+	} else if (i < log_filter_count) {
+		log_filters[i].level = level;
+	} else {
+		struct log_filter *filters = realloc(log_filters,
+				(log_filter_count + 1) * sizeof(*filters));
+		if (!filters) {
+			LOG_ERROR("Out of memory");
+			return ERROR_FAIL;
+		}
+		log_filters = filters;
+		log_filters[i].pattern = strndup(pattern, len);
+		log_filters[i].level = level;
+		log_filter_count++;
+	}
+
+	memset(log_filter_cache, 0, sizeof(log_filter_cache));
+	log_filter_active = log_filter_count > 0;
+
+	return ERROR_OK;
+}
+
 static struct command_registration log_command_handlers[] = {
 	{
 		.name = "log_output",
@@ -282,6 +494,15 @@ static struct command_registration log_command_handlers[] = {
 			"2 (default) adds other info; 3 adds debugging.",
 		.usage = "number",
 	},
+	{
+		.name = "log_filter",
+		.handler = handle_log_filter_command,
+		.mode = COMMAND_ANY,
+		.help = "Override the debug level for a source file or directory, "
+			"e.g. 'log_filter jtag/drivers/ftdi.c 3'. "
+			"Without arguments, lists the active overrides.",
+		.usage = "[source_path (number|'default')]",
+	},
 	COMMAND_REGISTRATION_DONE
 };
 
@@ -310,11 +531,14 @@ void log_init(void)
 	if (log_output == NULL)
 		log_output = stderr;
 
+	atexit(log_flush);
+
 	start = last_time = timeval_ms();
 }
 
 int set_log_output(struct command_context *cmd_ctx, FILE *output)
 {
+	log_flush();
 	log_output = output;
 	return ERROR_OK;
 }
@@ -437,6 +661,9 @@ void keep_alive()
 				current_time-last_time);
 	}
 	if (current_time-last_time > 500) {
+		/* long running commands don't reach the idle flush */
+		log_flush();
+
 		/* this will keep the GDB connection alive */
 		LOG_USER_N("%s", "");
 
@@ -31,18 +31,26 @@
 #endif
 
 #include <jtag/jtag.h>
+#include <helper/time_support.h>
 #include "commands.h"
 
 struct cmd_queue_page {
 	struct cmd_queue_page *next;
 	void *address;
+	size_t size;
 	size_t used;
 };
 
 #define CMD_QUEUE_PAGE_SIZE (1024 * 1024)
+/* pages kept across queue flushes, beyond this they go back to malloc */
+#define CMD_QUEUE_KEEP_PAGES 4
 static struct cmd_queue_page *cmd_queue_pages;
 static struct cmd_queue_page *cmd_queue_pages_tail;
 
+static struct jtag_queue_stats cmd_queue_stats;
+static unsigned int cmd_queue_commands;
+static size_t cmd_queue_bytes;
+
 struct jtag_command *jtag_command_queue;
 static struct jtag_command **next_command_pointer = &jtag_command_queue;
 
@@ -58,11 +66,12 @@ void jtag_queue_command(struct jtag_command *cmd)
 
 	/* store location where the next command pointer will be stored */
 	next_command_pointer = &cmd->next;
+
+	cmd_queue_commands++;
 }
 
 void *cmd_queue_alloc(size_t size)
 {
-	struct cmd_queue_page **p_page = &cmd_queue_pages;
 	int offset;
 	uint8_t *t;
 
@@ -98,47 +107,97 @@ void *cmd_queue_alloc(size_t size)
 	size = (size + ALIGN_SIZE - 1) & (~(ALIGN_SIZE - 1));
 	/* Done... */
 
-	if (*p_page) {
-		p_page = &cmd_queue_pages_tail;
-		if (CMD_QUEUE_PAGE_SIZE - (*p_page)->used < size)
-			p_page = &((*p_page)->next);
-	}
+	struct cmd_queue_page *page = cmd_queue_pages_tail;
+
+	if (!page || page->size - page->used < size) {
+		/* move on to the next page, which may be one kept from an
+		 * earlier flush; requests larger than a page get their own */
+		struct cmd_queue_page **p_page = page ? &page->next : &cmd_queue_pages;
+
+		if (!*p_page || (*p_page)->size < size) {
+			page = malloc(sizeof(struct cmd_queue_page));
+			page->used = 0;
+			page->size = (size < CMD_QUEUE_PAGE_SIZE) ?
+						CMD_QUEUE_PAGE_SIZE : size;
+			page->address = malloc(page->size);
+			page->next = *p_page;
+			*p_page = page;
+			cmd_queue_stats.page_allocs++;
+		}
 
-	if (!*p_page) {
-		*p_page = malloc(sizeof(struct cmd_queue_page));
-		(*p_page)->used = 0;
-		size_t alloc_size = (size < CMD_QUEUE_PAGE_SIZE) ?
-					CMD_QUEUE_PAGE_SIZE : size;
-		(*p_page)->address = malloc(alloc_size);
-		(*p_page)->next = NULL;
-		cmd_queue_pages_tail = *p_page;
+		page = *p_page;
+		cmd_queue_pages_tail = page;
 	}
 
-	offset = (*p_page)->used;
-	(*p_page)->used += size;
+	offset = page->used;
+	page->used += size;
+	cmd_queue_bytes += size;
 
-	t = (*p_page)->address;
+	t = page->address;
 	return t + offset;
 }
 
-static void cmd_queue_free(void)
+/**
+ * Make all pages available for the next queue again. Up to
+ * CMD_QUEUE_KEEP_PAGES regular pages are kept, so a steady stream of
+ * flushes doesn't malloc and free them every time.
+ */
+static void cmd_queue_recycle(void)
 {
-	struct cmd_queue_page *page = cmd_queue_pages;
+	struct cmd_queue_page **p_page = &cmd_queue_pages;
+	unsigned int kept = 0;
+
+	while (*p_page) {
+		struct cmd_queue_page *page = *p_page;
 
-	while (page) {
-		struct cmd_queue_page *last = page;
-		free(page->address);
-		page = page->next;
-		free(last);
+		if (page->size == CMD_QUEUE_PAGE_SIZE && kept < CMD_QUEUE_KEEP_PAGES) {
+			page->used = 0;
+			kept++;
+			p_page = &page->next;
+		} else {
+			*p_page = page->next;
+			free(page->address);
+			free(page);
+		}
 	}
 
-	cmd_queue_pages = NULL;
-	cmd_queue_pages_tail = NULL;
+	cmd_queue_pages_tail = cmd_queue_pages;
+}
+
+static void cmd_queue_account(void)
+{
+	if (cmd_queue_commands == 0 && cmd_queue_bytes == 0)
+		return;
+
+	if (cmd_queue_stats.start_ms == 0)
+		cmd_queue_stats.start_ms = timeval_ms();
+	cmd_queue_stats.flushes++;
+	cmd_queue_stats.commands += cmd_queue_commands;
+	cmd_queue_stats.bytes += cmd_queue_bytes;
+	if (cmd_queue_commands > cmd_queue_stats.max_commands)
+		cmd_queue_stats.max_commands = cmd_queue_commands;
+	if (cmd_queue_bytes > cmd_queue_stats.max_bytes)
+		cmd_queue_stats.max_bytes = cmd_queue_bytes;
+
+	cmd_queue_commands = 0;
+	cmd_queue_bytes = 0;
+}
+
+const struct jtag_queue_stats *jtag_command_queue_stats(void)
+{
+	return &cmd_queue_stats;
+}
+
+void jtag_command_queue_stats_reset(void)
+{
+	memset(&cmd_queue_stats, 0, sizeof(cmd_queue_stats));
+	cmd_queue_stats.start_ms = timeval_ms();
 }
 
 void jtag_command_queue_reset(void)
 {
-	cmd_queue_free();
+	cmd_queue_account();
+	cmd_queue_recycle();
 
 	jtag_command_queue = NULL;
 	next_command_pointer = &jtag_command_queue;
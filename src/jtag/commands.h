@@ -168,6 +168,20 @@ void *cmd_queue_alloc(size_t size);
 void jtag_queue_command(struct jtag_command *cmd);
 void jtag_command_queue_reset(void);
 
+/** Counters of the JTAG command queue, summed over queue flushes. */
+struct jtag_queue_stats {
+	int64_t start_ms;		/* when counting started */
+	uint64_t flushes;		/* flushes with anything queued */
+	uint64_t commands;		/* commands queued */
+	uint64_t bytes;			/* queue memory handed out */
+	unsigned int max_commands;	/* most commands in one flush */
+	size_t max_bytes;		/* most queue memory in one flush */
+	unsigned int page_allocs;	/* queue pages taken from malloc */
+};
+
+const struct jtag_queue_stats *jtag_command_queue_stats(void);
+void jtag_command_queue_stats_reset(void);
+
 enum scan_type jtag_scan_type(const struct scan_command *cmd);
 int jtag_scan_size(const struct scan_command *cmd);
 int jtag_read_buffer(uint8_t *buffer, const struct scan_command *cmd);
@@ -105,6 +105,9 @@ static int bitbang_execute_tms(struct jtag_command *cmd)
 
 	DEBUG_JTAG_IO("TMS: %d bits", num_bits);
 
+	if (bitbang_interface->shift)
+		return bitbang_interface->shift(num_bits, bits, NULL, NULL);
+
 	int tms = 0;
 	for (unsigned i = 0; i < num_bits; i++) {
 		tms = ((bits[i/8] >> (i % 8)) & 1);
@@ -202,33 +205,50 @@ static void bitbang_scan(bool ir_scan, enum scan_type type, uint8_t *buffer, int
 		bitbang_end_state(saved_end_state);
 	}
 
-	for (bit_cnt = 0; bit_cnt < scan_size; bit_cnt++) {
-		int val = 0;
-		int tms = (bit_cnt == scan_size-1) ? 1 : 0;
-		int tdi;
-		int bytec = bit_cnt/8;
-		int bcval = 1 << (bit_cnt % 8);
-
-		/* if we're just reading the scan, but don't care about the output
-		 * default to outputting 'low', this also makes valgrind traces more readable,
-		 * as it removes the dependency on an uninitialised value
-		 */
-		tdi = 0;
-		if ((type != SCAN_IN) && (buffer[bytec] & bcval))
-			tdi = 1;
-
-		bitbang_interface->write(0, tms, tdi);
-
-		if (type != SCAN_OUT)
-			val = bitbang_interface->read();
-
-		bitbang_interface->write(1, tms, tdi);
-
-		if (type != SCAN_OUT) {
-			if (val)
-				buffer[bytec] |= bcval;
-			else
-				buffer[bytec] &= ~bcval;
+	if (bitbang_interface->shift) {
+		/* hand the whole scan to the interface, TMS is only set on the
+		 * last bit to leave the shift state */
+		uint8_t *tms = calloc(DIV_ROUND_UP(scan_size, 8), 1);
+		if (tms == NULL) {
+			LOG_ERROR("Out of memory");
+			exit(-1);
+		}
+		if (scan_size > 0)
+			tms[(scan_size - 1) / 8] |= 1 << ((scan_size - 1) % 8);
+
+		bitbang_interface->shift(scan_size, tms,
+				type != SCAN_IN ? buffer : NULL,
+				type != SCAN_OUT ? buffer : NULL);
+		free(tms);
+	} else {
+		for (bit_cnt = 0; bit_cnt < scan_size; bit_cnt++) {
+			int val = 0;
+			int tms = (bit_cnt == scan_size-1) ? 1 : 0;
+			int tdi;
+			int bytec = bit_cnt/8;
+			int bcval = 1 << (bit_cnt % 8);
+
+			/* if we're just reading the scan, but don't care about the output
+			 * default to outputting 'low', this also makes valgrind traces more readable,
+			 * as it removes the dependency on an uninitialised value
+			 */
+			tdi = 0;
+			if ((type != SCAN_IN) && (buffer[bytec] & bcval))
+				tdi = 1;
+
+			bitbang_interface->write(0, tms, tdi);
+
+			if (type != SCAN_OUT)
+				val = bitbang_interface->read();
+
+			bitbang_interface->write(1, tms, tdi);
+
+			if (type != SCAN_OUT) {
+				if (val)
+					buffer[bytec] |= bcval;
+				else
+					buffer[bytec] &= ~bcval;
+			}
 		}
 	}
 
@@ -33,6 +33,13 @@ struct bitbang_interface {
 	void (*blink)(int on);
 	int (*swdio_read)(void);
 	void (*swdio_drive)(bool on);
+
+	/* optional: clock out num_bits TMS and TDI bits (LSB first) in one go,
+	 * leaving TCK low and TDI at 0. TDO is sampled before each rising
+	 * edge into tdo, unless that is NULL. tdi may be NULL for all zeros.
+	 */
+	int (*shift)(unsigned num_bits, const uint8_t *tms, const uint8_t *tdi,
+			uint8_t *tdo);
 };
 
 const struct swd_driver bitbang_swd;
@@ -39,6 +39,9 @@
 #include <jtag/tcl.h>
 
 #include <hidapi.h>
+#if HAVE_LIBUSB1
+#include <libusb.h>
+#endif
 
 /*
  * See CMSIS-DAP documentation:
@@ -62,6 +65,7 @@
 static uint16_t cmsis_dap_vid[MAX_USB_IDS + 1] = { 0 };
 static uint16_t cmsis_dap_pid[MAX_USB_IDS + 1] = { 0 };
 static wchar_t *cmsis_dap_serial;
+static char *cmsis_dap_backend_name;	/* NULL: try all backends */
 static bool swd_mode;
 
 #define PACKET_SIZE       (64 + 1)	/* 64 bytes plus report id */
@@ -163,8 +167,35 @@ static const char * const info_caps_str[] = {
 /* max clock speed (kHz) */
 #define DAP_MAX_CLOCK             5000
 
+/* DAP_TransferBlock is used for runs of at least this many accesses
+ * to the same register, e.g. MEM-AP DRW reads or writes */
+#define CMSIS_DAP_BLOCK_MIN       4
+/* upper bound for the probe reported packet count */
+#define CMSIS_DAP_MAX_PENDING     8
+
+struct cmsis_dap;
+
+/* A way to move CMSIS-DAP packets. The request is built in packet_buffer
+ * after a report number byte, which only HID sends; the reply is stored
+ * at the start of packet_buffer. */
+struct cmsis_dap_backend {
+	const char *name;
+	int (*open)(void);
+	void (*close)(struct cmsis_dap *dap);
+	int (*write)(struct cmsis_dap *dap, int txlen);
+	int (*read)(struct cmsis_dap *dap, int timeout_ms);
+};
+
 struct cmsis_dap {
+	const struct cmsis_dap_backend *backend;
 	hid_device *dev_handle;
+#if HAVE_LIBUSB1
+	libusb_context *usb_ctx;
+	libusb_device_handle *usb_handle;
+	int usb_interface;
+	uint8_t ep_out;
+	uint8_t ep_in;
+#endif
 	uint16_t packet_size;
 	uint16_t packet_count;
 	uint8_t *packet_buffer;
@@ -191,6 +222,8 @@ struct pending_scan_result {
 
 static int pending_transfer_count, pending_queue_len;
 static struct pending_transfer_result *pending_transfers;
+/* last AP read result, returned by the next AP or RDBUFF read */
+static uint32_t pending_last_read;
 
 /* pointers to buffers that will receive jtag scan results on the next flush */
 #define MAX_PENDING_SCAN_RESULTS 256
@@ -208,7 +241,34 @@ static int queued_retval;
 
 static struct cmsis_dap *cmsis_dap_handle;
 
-static int cmsis_dap_usb_open(void)
+static const struct cmsis_dap_backend cmsis_dap_hid_backend;
+#if HAVE_LIBUSB1
+static const struct cmsis_dap_backend cmsis_dap_bulk_backend;
+#endif
+
+static int cmsis_dap_alloc(const struct cmsis_dap_backend *backend, int packet_size)
+{
+	struct cmsis_dap *dap = calloc(1, sizeof(struct cmsis_dap));
+	if (dap == NULL) {
+		LOG_ERROR("unable to allocate memory");
+		return ERROR_FAIL;
+	}
+
+	dap->backend = backend;
+	dap->packet_count = 1;
+	dap->packet_size = packet_size;
+	dap->packet_buffer = malloc(packet_size);
+	if (dap->packet_buffer == NULL) {
+		LOG_ERROR("unable to allocate memory");
+		free(dap);
+		return ERROR_FAIL;
+	}
+
+	cmsis_dap_handle = dap;
+	return ERROR_OK;
+}
+
+static int cmsis_dap_hid_open(void)
 {
 	hid_device *dev = NULL;
 	int i;
@@ -280,7 +340,7 @@ static int cmsis_dap_usb_open(void)
 	hid_free_enumeration(devs);
 
 	if (target_vid == 0 && target_pid == 0) {
-		LOG_ERROR("unable to find CMSIS-DAP device");
+		LOG_DEBUG("no CMSIS-DAP HID device found");
 		return ERROR_FAIL;
 	}
 
@@ -296,18 +356,6 @@ static int cmsis_dap_usb_open(void)
 		return ERROR_FAIL;
 	}
 
-	struct cmsis_dap *dap = malloc(sizeof(struct cmsis_dap));
-	if (dap == NULL) {
-		LOG_ERROR("unable to allocate memory");
-		return ERROR_FAIL;
-	}
-
-	dap->dev_handle = dev;
-	dap->caps = 0;
-	dap->mode = 0;
-
-	cmsis_dap_handle = dap;
-
 	/* allocate default packet buffer, may be changed later.
 	 * currently with HIDAPI we have no way of getting the output report length
 	 * without this info we cannot communicate with the adapter.
@@ -323,27 +371,293 @@ static int cmsis_dap_usb_open(void)
 	if (target_vid == 0x03eb && target_pid != 0x2145)
 		packet_size = 512 + 1;
 
-	cmsis_dap_handle->packet_buffer = malloc(packet_size);
-	cmsis_dap_handle->packet_size = packet_size;
+	int retval = cmsis_dap_alloc(&cmsis_dap_hid_backend, packet_size);
+	if (retval != ERROR_OK) {
+		hid_close(dev);
+		return retval;
+	}
+	cmsis_dap_handle->dev_handle = dev;
+
+	return ERROR_OK;
+}
 
-	if (cmsis_dap_handle->packet_buffer == NULL) {
-		LOG_ERROR("unable to allocate memory");
+static void cmsis_dap_hid_close(struct cmsis_dap *dap)
+{
+	hid_close(dap->dev_handle);
+	hid_exit();
+}
+
+static int cmsis_dap_hid_write(struct cmsis_dap *dap, int txlen)
+{
+	/* Pad the rest of the TX buffer with 0's */
+	memset(dap->packet_buffer + txlen, 0, dap->packet_size - txlen);
+
+	/* write data to device */
+	int retval = hid_write(dap->dev_handle, dap->packet_buffer, dap->packet_size);
+	if (retval == -1) {
+		LOG_ERROR("error writing data: %ls", hid_error(dap->dev_handle));
+		return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
+static int cmsis_dap_hid_read(struct cmsis_dap *dap, int timeout_ms)
+{
+	int retval = hid_read_timeout(dap->dev_handle, dap->packet_buffer, dap->packet_size, timeout_ms);
+	if (retval == -1 || retval == 0) {
+		LOG_DEBUG("error reading data: %ls", hid_error(dap->dev_handle));
+		return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
+static const struct cmsis_dap_backend cmsis_dap_hid_backend = {
+	.name = "hid",
+	.open = cmsis_dap_hid_open,
+	.close = cmsis_dap_hid_close,
+	.write = cmsis_dap_hid_write,
+	.read = cmsis_dap_hid_read,
+};
+
+#if HAVE_LIBUSB1
+/* Check that string descriptor index of the device contains "CMSIS-DAP" */
+static bool cmsis_dap_bulk_is_dap_string(libusb_device_handle *dev_handle, uint8_t index)
+{
+	char str[256];
+
+	if (index == 0)
+		return false;
+
+	int len = libusb_get_string_descriptor_ascii(dev_handle, index,
+			(unsigned char *)str, sizeof(str) - 1);
+	if (len < 0)
+		return false;
+	str[len] = 0;
+
+	return strstr(str, "CMSIS-DAP") != NULL;
+}
+
+static bool cmsis_dap_bulk_serial_matches(libusb_device_handle *dev_handle, uint8_t index)
+{
+	char str[256];
+	wchar_t wstr[256];
+
+	if (cmsis_dap_serial == NULL)
+		return true;
+
+	int len = libusb_get_string_descriptor_ascii(dev_handle, index,
+			(unsigned char *)str, sizeof(str) - 1);
+	if (len < 0)
+		return false;
+	str[len] = 0;
+
+	if (mbstowcs(wstr, str, ARRAY_SIZE(wstr)) == (size_t)-1)
+		return false;
+	wstr[ARRAY_SIZE(wstr) - 1] = 0;
+
+	return wcscmp(cmsis_dap_serial, wstr) == 0;
+}
+
+/* Find the CMSIS-DAP v2 interface: vendor specific class, its name
+ * contains "CMSIS-DAP", and its first two endpoints are bulk OUT and
+ * bulk IN (an optional third one carries SWO) */
+static int cmsis_dap_bulk_find_interface(libusb_device *dev, libusb_device_handle *dev_handle,
+		int *interface, uint8_t *ep_out, uint8_t *ep_in, uint16_t *max_packet)
+{
+	struct libusb_config_descriptor *config;
+	int retval = ERROR_FAIL;
+
+	if (libusb_get_active_config_descriptor(dev, &config) != LIBUSB_SUCCESS)
+		return ERROR_FAIL;
+
+	for (int i = 0; i < config->bNumInterfaces && retval != ERROR_OK; i++) {
+		const struct libusb_interface_descriptor *intf = &config->interface[i].altsetting[0];
+
+		if (intf->bInterfaceClass != LIBUSB_CLASS_VENDOR_SPEC || intf->bNumEndpoints < 2)
+			continue;
+
+		const struct libusb_endpoint_descriptor *out = &intf->endpoint[0];
+		const struct libusb_endpoint_descriptor *in = &intf->endpoint[1];
+		if ((out->bmAttributes & 3) != LIBUSB_TRANSFER_TYPE_BULK ||
+				(out->bEndpointAddress & LIBUSB_ENDPOINT_IN) ||
+				(in->bmAttributes & 3) != LIBUSB_TRANSFER_TYPE_BULK ||
+				!(in->bEndpointAddress & LIBUSB_ENDPOINT_IN))
+			continue;
+
+		if (!cmsis_dap_bulk_is_dap_string(dev_handle, intf->iInterface))
+			continue;
+
+		*interface = intf->bInterfaceNumber;
+		*ep_out = out->bEndpointAddress;
+		*ep_in = in->bEndpointAddress;
+		*max_packet = in->wMaxPacketSize;
+		retval = ERROR_OK;
+	}
+
+	libusb_free_config_descriptor(config);
+	return retval;
+}
+
+static int cmsis_dap_bulk_open(void)
+{
+	libusb_context *ctx;
+	libusb_device **devs;
+	libusb_device_handle *dev_handle = NULL;
+	int interface = 0;
+	uint8_t ep_out = 0, ep_in = 0;
+	uint16_t max_packet = 0;
+
+	if (libusb_init(&ctx) != LIBUSB_SUCCESS) {
+		LOG_ERROR("unable to initialize libusb");
 		return ERROR_FAIL;
 	}
 
+	ssize_t count = libusb_get_device_list(ctx, &devs);
+	for (ssize_t i = 0; i < count && dev_handle == NULL; i++) {
+		struct libusb_device_descriptor desc;
+		bool id_match = false;
+
+		if (libusb_get_device_descriptor(devs[i], &desc) != LIBUSB_SUCCESS)
+			continue;
+
+		for (int j = 0; cmsis_dap_vid[j] || cmsis_dap_pid[j]; j++) {
+			if (cmsis_dap_vid[j] == desc.idVendor && cmsis_dap_pid[j] == desc.idProduct)
+				id_match = true;
+		}
+		if ((cmsis_dap_vid[0] || cmsis_dap_pid[0]) && !id_match)
+			continue;
+
+		if (libusb_open(devs[i], &dev_handle) != LIBUSB_SUCCESS) {
+			dev_handle = NULL;
+			continue;
+		}
+
+		/* same rule as for HID: without a VID:PID, the product
+		 * string must contain "CMSIS-DAP" */
+		if ((!id_match && !cmsis_dap_bulk_is_dap_string(dev_handle, desc.iProduct)) ||
+				!cmsis_dap_bulk_serial_matches(dev_handle, desc.iSerialNumber) ||
+				cmsis_dap_bulk_find_interface(devs[i], dev_handle,
+					&interface, &ep_out, &ep_in, &max_packet) != ERROR_OK ||
+				libusb_claim_interface(dev_handle, interface) != LIBUSB_SUCCESS) {
+			libusb_close(dev_handle);
+			dev_handle = NULL;
+			continue;
+		}
+
+		LOG_INFO("CMSIS-DAP: using USB bulk interface of device 0x%04x:0x%04x",
+				desc.idVendor, desc.idProduct);
+	}
+	if (count >= 0)
+		libusb_free_device_list(devs, 1);
+
+	if (dev_handle == NULL) {
+		LOG_DEBUG("no CMSIS-DAP USB bulk device found");
+		libusb_exit(ctx);
+		return ERROR_FAIL;
+	}
+
+	/* the packet size reported by DAP_Info replaces this later */
+	int retval = cmsis_dap_alloc(&cmsis_dap_bulk_backend, max_packet + 1);
+	if (retval != ERROR_OK) {
+		libusb_release_interface(dev_handle, interface);
+		libusb_close(dev_handle);
+		libusb_exit(ctx);
+		return retval;
+	}
+	cmsis_dap_handle->usb_ctx = ctx;
+	cmsis_dap_handle->usb_handle = dev_handle;
+	cmsis_dap_handle->usb_interface = interface;
+	cmsis_dap_handle->ep_out = ep_out;
+	cmsis_dap_handle->ep_in = ep_in;
+
 	return ERROR_OK;
 }
 
+static void cmsis_dap_bulk_close(struct cmsis_dap *dap)
+{
+	libusb_release_interface(dap->usb_handle, dap->usb_interface);
+	libusb_close(dap->usb_handle);
+	libusb_exit(dap->usb_ctx);
+}
+
+static int cmsis_dap_bulk_write(struct cmsis_dap *dap, int txlen)
+{
+	int transferred = 0;
+
+	/* no report number over bulk */
+	int retval = libusb_bulk_transfer(dap->usb_handle, dap->ep_out,
+			dap->packet_buffer + 1, txlen - 1, &transferred, USB_TIMEOUT);
+	if (retval != LIBUSB_SUCCESS || transferred != txlen - 1) {
+		LOG_ERROR("error writing data: %s", libusb_error_name(retval));
+		return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
+static int cmsis_dap_bulk_read(struct cmsis_dap *dap, int timeout_ms)
+{
+	int transferred = 0;
+
+	/* ask for no more than a full DAP packet, a reply of exactly that
+	 * size ends without a short packet */
+	int retval = libusb_bulk_transfer(dap->usb_handle, dap->ep_in,
+			dap->packet_buffer, dap->packet_size - 1, &transferred, timeout_ms);
+	if (retval != LIBUSB_SUCCESS || transferred == 0) {
+		LOG_DEBUG("error reading data: %s", libusb_error_name(retval));
+		return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
+static const struct cmsis_dap_backend cmsis_dap_bulk_backend = {
+	.name = "usb_bulk",
+	.open = cmsis_dap_bulk_open,
+	.close = cmsis_dap_bulk_close,
+	.write = cmsis_dap_bulk_write,
+	.read = cmsis_dap_bulk_read,
+};
+#endif
+
+/* CMSIS-DAP v2 bulk probes are tried first, they are much faster than
+ * HID on probes that offer both */
+static const struct cmsis_dap_backend * const cmsis_dap_backends[] = {
+#if HAVE_LIBUSB1
+	&cmsis_dap_bulk_backend,
+#endif
+	&cmsis_dap_hid_backend,
+	NULL
+};
+
+static int cmsis_dap_usb_open(void)
+{
+	for (int i = 0; cmsis_dap_backends[i]; i++) {
+		if (cmsis_dap_backend_name &&
+				strcmp(cmsis_dap_backend_name, cmsis_dap_backends[i]->name))
+			continue;
+
+		if (cmsis_dap_backends[i]->open() == ERROR_OK)
+			return ERROR_OK;
+	}
+
+	LOG_ERROR("unable to find CMSIS-DAP device");
+	return ERROR_FAIL;
+}
+
 static void cmsis_dap_usb_close(struct cmsis_dap *dap)
 {
-	hid_close(dap->dev_handle);
-	hid_exit();
+	dap->backend->close(dap);
 
 	free(cmsis_dap_handle->packet_buffer);
 	free(cmsis_dap_handle);
 	cmsis_dap_handle = NULL;
 	free(cmsis_dap_serial);
 	cmsis_dap_serial = NULL;
+	free(cmsis_dap_backend_name);
+	cmsis_dap_backend_name = NULL;
 	free(pending_transfers);
 	pending_transfers = NULL;
 
@@ -356,24 +670,12 @@ static int cmsis_dap_usb_xfer(struct cmsis_dap *dap, int txlen)
 #ifdef CMSIS_DAP_JTAG_DEBUG
 	LOG_DEBUG("cmsis-dap usb xfer cmd=%02X", dap->packet_buffer[1]);
 #endif
-	/* Pad the rest of the TX buffer with 0's */
-	memset(dap->packet_buffer + txlen, 0, dap->packet_size - txlen);
-
-	/* write data to device */
-	int retval = hid_write(dap->dev_handle, dap->packet_buffer, dap->packet_size);
-	if (retval == -1) {
-		LOG_ERROR("error writing data: %ls", hid_error(dap->dev_handle));
-		return ERROR_FAIL;
-	}
+	int retval = dap->backend->write(dap, txlen);
+	if (retval != ERROR_OK)
+		return retval;
 
 	/* get reply */
-	retval = hid_read_timeout(dap->dev_handle, dap->packet_buffer, dap->packet_size, USB_TIMEOUT);
-	if (retval == -1 || retval == 0) {
-		LOG_DEBUG("error reading data: %ls", hid_error(dap->dev_handle));
-		return ERROR_FAIL;
-	}
-
-	return ERROR_OK;
+	return dap->backend->read(dap, USB_TIMEOUT);
 }
 
 static int cmsis_dap_cmd_DAP_SWJ_Pins(uint8_t pins, uint8_t mask, uint32_t delay, uint8_t *input)
@@ -592,84 +894,171 @@ static int cmsis_dap_cmd_DAP_Delay(uint16_t delay_us)
 }
 #endif
 
-static int cmsis_dap_swd_run_queue(void)
+/* A DAP_Transfer or DAP_TransferBlock request sent to the probe whose
+ * reply has not been read yet */
+struct pending_request {
+	int first;		/* index in pending_transfers */
+	int count;
+	bool block;
+};
+
+/* Number of accesses to the same register starting at transfer first */
+static int cmsis_dap_swd_run_length(int first)
 {
-	uint8_t *buffer = cmsis_dap_handle->packet_buffer;
+	uint8_t cmd = pending_transfers[first].cmd;
+	int i = first + 1;
 
-	LOG_DEBUG("Executing %d queued transactions", pending_transfer_count);
+	/* only AP accesses; the DP CTRL/STAT kludge needs DAP_Transfer */
+	if (!(cmd & SWD_CMD_APnDP))
+		return 1;
 
-	if (queued_retval != ERROR_OK) {
-		LOG_DEBUG("Skipping due to previous errors: %d", queued_retval);
-		goto skip;
+	while (i < pending_transfer_count && pending_transfers[i].cmd == cmd)
+		i++;
+
+	return i - first;
+}
+
+static void cmsis_dap_swd_put_data(uint8_t *buffer, size_t *idx, uint8_t cmd, uint32_t data)
+{
+	/* When proper WAIT handling is implemented in the
+	 * common SWD framework, this kludge can be
+	 * removed. However, this might lead to minor
+	 * performance degradation as the adapter wouldn't be
+	 * able to automatically retry anything (because ARM
+	 * has forgotten to implement sticky error flags
+	 * clearing). See also comments regarding
+	 * cmsis_dap_cmd_DAP_TFER_Configure() and
+	 * cmsis_dap_cmd_DAP_SWD_Configure() in
+	 * cmsis_dap_init().
+	 */
+	if (!(cmd & SWD_CMD_APnDP) &&
+	    (cmd & SWD_CMD_A32) >> 1 == DP_CTRL_STAT &&
+	    (data & CORUNDETECT)) {
+		LOG_DEBUG("refusing to enable sticky overrun detection");
+		data &= ~CORUNDETECT;
 	}
 
-	if (!pending_transfer_count)
-		goto skip;
+	buffer[(*idx)++] = (data) & 0xff;
+	buffer[(*idx)++] = (data >> 8) & 0xff;
+	buffer[(*idx)++] = (data >> 16) & 0xff;
+	buffer[(*idx)++] = (data >> 24) & 0xff;
+}
 
+/* Build the next request from the queued transfers starting at first and
+ * send it. Runs of accesses to one AP register go out as a single
+ * DAP_TransferBlock, everything else is packed into DAP_Transfer. */
+static int cmsis_dap_swd_send_request(int first, struct pending_request *req)
+{
+	uint8_t *buffer = cmsis_dap_handle->packet_buffer;
+	/* usable bytes in each direction, without the report number. Replies
+	 * must fit too, the bulk backend reads no more than that. */
+	size_t packet_size = cmsis_dap_handle->packet_size - 1;
 	size_t idx = 0;
+	int run = cmsis_dap_swd_run_length(first);
+
+	req->first = first;
+	req->block = run >= CMSIS_DAP_BLOCK_MIN;
+
 	buffer[idx++] = 0;	/* report number */
-	buffer[idx++] = CMD_DAP_TFER;
-	buffer[idx++] = 0x00;	/* DAP Index */
-	buffer[idx++] = pending_transfer_count;
 
-	for (int i = 0; i < pending_transfer_count; i++) {
-		uint8_t cmd = pending_transfers[i].cmd;
-		uint32_t data = pending_transfers[i].data;
+	if (req->block) {
+		uint8_t cmd = pending_transfers[first].cmd;
+		/* request header is 5 bytes, reply header 4 */
+		int max = cmd & SWD_CMD_RnW ? (packet_size - 4) / 4 : (packet_size - 5) / 4;
+		req->count = MIN(run, max);
 
-		LOG_DEBUG("%s %s reg %x %"PRIx32,
-				cmd & SWD_CMD_APnDP ? "AP" : "DP",
+		LOG_DEBUG("AP %s block reg %x, %d words",
 				cmd & SWD_CMD_RnW ? "read" : "write",
-			  (cmd & SWD_CMD_A32) >> 1, data);
-
-		/* When proper WAIT handling is implemented in the
-		 * common SWD framework, this kludge can be
-		 * removed. However, this might lead to minor
-		 * performance degradation as the adapter wouldn't be
-		 * able to automatically retry anything (because ARM
-		 * has forgotten to implement sticky error flags
-		 * clearing). See also comments regarding
-		 * cmsis_dap_cmd_DAP_TFER_Configure() and
-		 * cmsis_dap_cmd_DAP_SWD_Configure() in
-		 * cmsis_dap_init().
-		 */
-		if (!(cmd & SWD_CMD_RnW) &&
-		    !(cmd & SWD_CMD_APnDP) &&
-		    (cmd & SWD_CMD_A32) >> 1 == DP_CTRL_STAT &&
-		    (data & CORUNDETECT)) {
-			LOG_DEBUG("refusing to enable sticky overrun detection");
-			data &= ~CORUNDETECT;
-		}
+				(cmd & SWD_CMD_A32) >> 1, req->count);
 
+		buffer[idx++] = CMD_DAP_TFER_BLOCK;
+		buffer[idx++] = 0x00;	/* DAP Index */
+		buffer[idx++] = req->count & 0xff;
+		buffer[idx++] = (req->count >> 8) & 0xff;
 		buffer[idx++] = (cmd >> 1) & 0x0f;
 		if (!(cmd & SWD_CMD_RnW)) {
-			buffer[idx++] = (data) & 0xff;
-			buffer[idx++] = (data >> 8) & 0xff;
-			buffer[idx++] = (data >> 16) & 0xff;
-			buffer[idx++] = (data >> 24) & 0xff;
+			for (int i = first; i < first + req->count; i++)
+				cmsis_dap_swd_put_data(buffer, &idx, cmd, pending_transfers[i].data);
 		}
+	} else {
+		size_t reply_len = 3;
+		int i;
+
+		buffer[idx++] = CMD_DAP_TFER;
+		buffer[idx++] = 0x00;	/* DAP Index */
+		idx++;			/* transfer count, set below */
+
+		for (i = first; i < pending_transfer_count && i - first < 255; i++) {
+			uint8_t cmd = pending_transfers[i].cmd;
+			uint32_t data = pending_transfers[i].data;
+			size_t req_bytes = cmd & SWD_CMD_RnW ? 1 : 5;
+			size_t reply_bytes = cmd & SWD_CMD_RnW ? 4 : 0;
+
+			if (idx - 1 + req_bytes > packet_size || reply_len + reply_bytes > packet_size)
+				break;
+			/* leave long runs to DAP_TransferBlock */
+			if (i > first && cmsis_dap_swd_run_length(i) >= CMSIS_DAP_BLOCK_MIN)
+				break;
+
+			LOG_DEBUG("%s %s reg %x %"PRIx32,
+					cmd & SWD_CMD_APnDP ? "AP" : "DP",
+					cmd & SWD_CMD_RnW ? "read" : "write",
+				  (cmd & SWD_CMD_A32) >> 1, data);
+
+			buffer[idx++] = (cmd >> 1) & 0x0f;
+			if (!(cmd & SWD_CMD_RnW))
+				cmsis_dap_swd_put_data(buffer, &idx, cmd, data);
+			reply_len += reply_bytes;
+		}
+
+		req->count = i - first;
+		buffer[3] = req->count;
 	}
 
-	queued_retval = cmsis_dap_usb_xfer(cmsis_dap_handle, idx);
-	if (queued_retval != ERROR_OK)
-		goto skip;
+	return cmsis_dap_handle->backend->write(cmsis_dap_handle, idx);
+}
+
+/* Read the reply to req and store the read data */
+static int cmsis_dap_swd_read_reply(struct pending_request *req)
+{
+	uint8_t *buffer = cmsis_dap_handle->packet_buffer;
+
+	int retval = cmsis_dap_handle->backend->read(cmsis_dap_handle, USB_TIMEOUT);
+	if (retval != ERROR_OK)
+		return retval;
+
+	size_t idx;
+	int count;
+	if (req->block) {
+		count = le_to_h_u16(&buffer[1]);
+		idx = 3;
+	} else {
+		count = buffer[1];
+		idx = 2;
+	}
+
+	if (buffer[0] != (req->block ? CMD_DAP_TFER_BLOCK : CMD_DAP_TFER)) {
+		LOG_ERROR("CMSIS-DAP transfer reply out of sequence");
+		return ERROR_FAIL;
+	}
 
-	idx = 2;
 	uint8_t ack = buffer[idx] & 0x07;
 	if (ack != SWD_ACK_OK || (buffer[idx] & 0x08)) {
-		LOG_DEBUG("SWD ack not OK: %d %s", buffer[idx-1],
+		LOG_DEBUG("SWD ack not OK: %d %s", count,
 			  ack == SWD_ACK_WAIT ? "WAIT" : ack == SWD_ACK_FAULT ? "FAULT" : "JUNK");
-		queued_retval = ack == SWD_ACK_WAIT ? ERROR_WAIT : ERROR_FAIL;
-		goto skip;
+		return ack == SWD_ACK_WAIT ? ERROR_WAIT : ERROR_FAIL;
 	}
 	idx++;
 
-	if (pending_transfer_count != buffer[1])
+	if (req->count != count) {
 		LOG_ERROR("CMSIS-DAP transfer count mismatch: expected %d, got %d",
-			  pending_transfer_count, buffer[1]);
+			  req->count, count);
+		if (count > req->count)
+			count = req->count;
+	}
 
-	for (int i = 0; i < buffer[1]; i++) {
+	for (int i = req->first; i < req->first + count; i++) {
 		if (pending_transfers[i].cmd & SWD_CMD_RnW) {
-			static uint32_t last_read;
 			uint32_t data = le_to_h_u32(&buffer[idx]);
 			uint32_t tmp = data;
 			idx += 4;
@@ -679,8 +1068,8 @@ static int cmsis_dap_swd_run_queue(void)
 			/* Imitate posted AP reads */
 			if ((pending_transfers[i].cmd & SWD_CMD_APnDP) ||
 			    ((pending_transfers[i].cmd & SWD_CMD_A32) >> 1 == DP_RDBUFF)) {
-				tmp = last_read;
-				last_read = data;
+				tmp = pending_last_read;
+				pending_last_read = data;
 			}
 
 			if (pending_transfers[i].buffer)
@@ -688,6 +1077,49 @@ static int cmsis_dap_swd_run_queue(void)
 		}
 	}
 
+	return ERROR_OK;
+}
+
+/* Send the queued transfers in as many requests as needed, keeping up to
+ * the probe's packet count of them in flight. The probe executes requests
+ * in order, so replies are read back in the order they were sent. */
+static int cmsis_dap_swd_run_queue(void)
+{
+	struct pending_request requests[CMSIS_DAP_MAX_PENDING];
+	int max_pending = MIN(MAX(cmsis_dap_handle->packet_count, 1), CMSIS_DAP_MAX_PENDING);
+	int head = 0, pending = 0, next = 0;
+
+	LOG_DEBUG("Executing %d queued transactions", pending_transfer_count);
+
+	if (queued_retval != ERROR_OK) {
+		LOG_DEBUG("Skipping due to previous errors: %d", queued_retval);
+		goto skip;
+	}
+
+	while (next < pending_transfer_count || pending) {
+		/* keep the probe busy while earlier replies come back */
+		while (queued_retval == ERROR_OK && next < pending_transfer_count &&
+				pending < max_pending) {
+			struct pending_request *req = &requests[(head + pending) % max_pending];
+			queued_retval = cmsis_dap_swd_send_request(next, req);
+			if (queued_retval != ERROR_OK)
+				break;
+			next += req->count;
+			pending++;
+		}
+
+		if (!pending)
+			break;
+
+		/* after an error the requests already sent still have to be
+		 * drained, but their results are dropped */
+		int retval = cmsis_dap_swd_read_reply(&requests[head]);
+		if (retval != ERROR_OK && queued_retval == ERROR_OK)
+			queued_retval = retval;
+		head = (head + 1) % max_pending;
+		pending--;
+	}
+
 skip:
 	pending_transfer_count = 0;
 	int retval = queued_retval;
@@ -907,16 +1339,6 @@ static int cmsis_dap_init(void)
 	if (data[0] == 2) {  /* short */
 		uint16_t pkt_sz = data[1] + (data[2] << 8);
 
-		/* 4 bytes of command header + 5 bytes per register
-		 * write. For bulk read sequences just 4 bytes are
-		 * needed per transfer, so this is suboptimal. */
-		pending_queue_len = (pkt_sz - 4) / 5;
-		pending_transfers = malloc(pending_queue_len * sizeof(*pending_transfers));
-		if (!pending_transfers) {
-			LOG_ERROR("Unable to allocate memory for CMSIS-DAP queue");
-			return ERROR_FAIL;
-		}
-
 		if (cmsis_dap_handle->packet_size != pkt_sz + 1) {
 			/* reallocate buffer */
 			cmsis_dap_handle->packet_size = pkt_sz + 1;
@@ -942,6 +1364,17 @@ static int cmsis_dap_init(void)
 		LOG_DEBUG("CMSIS-DAP: Packet Count = %" PRId16, pkt_cnt);
 	}
 
+	/* Queue enough transfers to fill every packet the probe can buffer:
+	 * 4 bytes of command header + 5 bytes per register write, long
+	 * runs of the same register need just 4 bytes per transfer. */
+	pending_queue_len = (cmsis_dap_handle->packet_size - 1 - 4) / 4 *
+		MIN(MAX(cmsis_dap_handle->packet_count, 1), CMSIS_DAP_MAX_PENDING);
+	pending_transfers = malloc(pending_queue_len * sizeof(*pending_transfers));
+	if (!pending_transfers) {
+		LOG_ERROR("Unable to allocate memory for CMSIS-DAP queue");
+		return ERROR_FAIL;
+	}
+
 	retval = cmsis_dap_get_status();
 	if (retval != ERROR_OK)
 		return ERROR_FAIL;
@@ -1536,6 +1969,10 @@ COMMAND_HANDLER(cmsis_dap_handle_info_command)
 	if (cmsis_dap_get_version_info() == ERROR_OK)
 		cmsis_dap_get_status();
 
+	LOG_INFO("CMSIS-DAP: %s backend, %d byte packets, up to %d in flight",
+			cmsis_dap_handle->backend->name, cmsis_dap_handle->packet_size - 1,
+			MIN(MAX(cmsis_dap_handle->packet_count, 1), CMSIS_DAP_MAX_PENDING));
+
 	return ERROR_OK;
 }
 
@@ -1590,6 +2027,28 @@ COMMAND_HANDLER(cmsis_dap_handle_serial_command)
 	return ERROR_OK;
 }
 
+COMMAND_HANDLER(cmsis_dap_handle_backend_command)
+{
+	if (CMD_ARGC != 1)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	free(cmsis_dap_backend_name);
+	cmsis_dap_backend_name = NULL;
+
+	if (strcmp(CMD_ARGV[0], "auto") == 0)
+		return ERROR_OK;
+
+	for (int i = 0; cmsis_dap_backends[i]; i++) {
+		if (strcmp(CMD_ARGV[0], cmsis_dap_backends[i]->name) == 0) {
+			cmsis_dap_backend_name = strdup(CMD_ARGV[0]);
+			return ERROR_OK;
+		}
+	}
+
+	LOG_ERROR("invalid or unsupported CMSIS-DAP backend '%s'", CMD_ARGV[0]);
+	return ERROR_COMMAND_ARGUMENT_INVALID;
+}
+
 static const struct command_registration cmsis_dap_subcommand_handlers[] = {
 	{
 		.name = "info",
@@ -1623,6 +2082,13 @@ static const struct command_registration cmsis_dap_command_handlers[] = {
 		.help = "set the serial number of the adapter",
 		.usage = "serial_string",
 	},
+	{
+		.name = "cmsis_dap_backend",
+		.handler = &cmsis_dap_handle_backend_command,
+		.mode = COMMAND_CONFIG,
+		.help = "set the communication backend of the adapter",
+		.usage = "(auto | usb_bulk | hid)",
+	},
 	COMMAND_REGISTRATION_DONE
 };
 
@@ -77,5 +77,10 @@ int jtag_libusb_choose_interface(struct jtag_libusb_device_handle *devh,
 		unsigned int *usb_write_ep,
 		int bclass, int subclass, int protocol, int trans_type);
 int jtag_libusb_get_pid(struct jtag_libusb_device *dev, uint16_t *pid);
+/**
+ * Handle pending events of asynchronous transfers submitted on a device
+ * opened by jtag_libusb_open(), until @a completed becomes non-zero.
+ */
+int jtag_libusb_handle_events_completed(int *completed);
 
 #endif /* OPENOCD_JTAG_DRIVERS_LIBUSB1_COMMON_H */
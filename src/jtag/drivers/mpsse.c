@@ -64,6 +64,24 @@
 #define SIO_RESET_PURGE_RX 1
 #define SIO_RESET_PURGE_TX 2
 
+/* Number of command buffers. While one is being filled, the others can be
+ * on the wire, so up to MPSSE_BATCHES - 1 flushes are kept in flight. */
+#define MPSSE_BATCHES 4
+
+/* One flushed (or being filled) command buffer with its read data */
+struct mpsse_batch {
+	struct mpsse_ctx *ctx;
+	uint8_t *write_buffer;
+	unsigned write_count;
+	unsigned write_transferred;
+	uint8_t *read_buffer;
+	unsigned read_count;
+	unsigned read_transferred;
+	struct bit_copy_queue read_queue;
+	struct libusb_transfer *write_transfer;
+	bool write_pending;
+};
+
 struct mpsse_ctx {
 	libusb_context *usb_ctx;
 	libusb_device_handle *usb_dev;
@@ -75,15 +93,19 @@ struct mpsse_ctx {
 	uint16_t index;
 	uint8_t interface;
 	enum ftdi_chip_type type;
-	uint8_t *write_buffer;
+	/* Ring of batches: batch_queued in flight starting at batch_head,
+	 * followed by the one currently being filled */
+	struct mpsse_batch batch[MPSSE_BATCHES];
+	unsigned batch_head;
+	unsigned batch_queued;
 	unsigned write_size;
-	unsigned write_count;
-	uint8_t *read_buffer;
 	unsigned read_size;
-	unsigned read_count;
+	/* The read data of all batches in flight arrives as one stream */
 	uint8_t *read_chunk;
 	unsigned read_chunk_size;
-	struct bit_copy_queue read_queue;
+	struct libusb_transfer *read_transfer;
+	bool read_pending;
+	bool usb_failed;
 	int retval;
 };
 
@@ -329,15 +351,24 @@ struct mpsse_ctx *mpsse_open(const uint16_t *vid, const uint16_t *pid, const cha
 	if (!ctx)
 		return 0;
 
-	bit_copy_queue_init(&ctx->read_queue);
 	ctx->read_chunk_size = 16384;
 	ctx->read_size = 16384;
 	ctx->write_size = 16384;
+	for (unsigned i = 0; i < MPSSE_BATCHES; i++)
+		bit_copy_queue_init(&ctx->batch[i].read_queue);
 	ctx->read_chunk = malloc(ctx->read_chunk_size);
-	ctx->read_buffer = malloc(ctx->read_size);
-	ctx->write_buffer = malloc(ctx->write_size);
-	if (!ctx->read_chunk || !ctx->read_buffer || !ctx->write_buffer)
+	ctx->read_transfer = libusb_alloc_transfer(0);
+	if (!ctx->read_chunk || !ctx->read_transfer)
 		goto error;
+	for (unsigned i = 0; i < MPSSE_BATCHES; i++) {
+		struct mpsse_batch *b = &ctx->batch[i];
+		b->ctx = ctx;
+		b->read_buffer = malloc(ctx->read_size);
+		b->write_buffer = malloc(ctx->write_size);
+		b->write_transfer = libusb_alloc_transfer(0);
+		if (!b->read_buffer || !b->write_buffer || !b->write_transfer)
+			goto error;
+	}
 
 	ctx->interface = channel;
 	ctx->index = channel + 1;
@@ -400,13 +431,20 @@ void mpsse_close(struct mpsse_ctx *ctx)
 		libusb_close(ctx->usb_dev);
 	if (ctx->usb_ctx)
 		libusb_exit(ctx->usb_ctx);
-	bit_copy_discard(&ctx->read_queue);
-	if (ctx->write_buffer)
-		free(ctx->write_buffer);
-	if (ctx->read_buffer)
-		free(ctx->read_buffer);
+	for (unsigned i = 0; i < MPSSE_BATCHES; i++) {
+		struct mpsse_batch *b = &ctx->batch[i];
+		bit_copy_discard(&b->read_queue);
+		if (b->write_buffer)
+			free(b->write_buffer);
+		if (b->read_buffer)
+			free(b->read_buffer);
+		if (b->write_transfer)
+			libusb_free_transfer(b->write_transfer);
+	}
 	if (ctx->read_chunk)
 		free(ctx->read_chunk);
+	if (ctx->read_transfer)
+		libusb_free_transfer(ctx->read_transfer);
 
 	free(ctx);
 }
@@ -420,10 +458,18 @@ void mpsse_purge(struct mpsse_ctx *ctx)
 {
 	int err;
 	LOG_DEBUG("-");
-	ctx->write_count = 0;
-	ctx->read_count = 0;
+	for (unsigned i = 0; i < MPSSE_BATCHES; i++) {
+		struct mpsse_batch *b = &ctx->batch[i];
+		b->write_count = 0;
+		b->read_count = 0;
+		b->write_transferred = 0;
+		b->read_transferred = 0;
+		bit_copy_discard(&b->read_queue);
+	}
+	ctx->batch_head = 0;
+	ctx->batch_queued = 0;
+	ctx->usb_failed = false;
 	ctx->retval = ERROR_OK;
-	bit_copy_discard(&ctx->read_queue);
 	err = libusb_control_transfer(ctx->usb_dev, FTDI_DEVICE_OUT_REQTYPE, SIO_RESET_REQUEST,
 			SIO_RESET_PURGE_RX, ctx->index, NULL, 0, ctx->usb_write_timeout);
 	if (err < 0) {
@@ -439,45 +485,56 @@ void mpsse_purge(struct mpsse_ctx *ctx)
 	}
 }
 
+/* The batch commands are currently queued to */
+static struct mpsse_batch *fill_batch(struct mpsse_ctx *ctx)
+{
+	return &ctx->batch[(ctx->batch_head + ctx->batch_queued) % MPSSE_BATCHES];
+}
+
 static unsigned buffer_write_space(struct mpsse_ctx *ctx)
 {
 	/* Reserve one byte for SEND_IMMEDIATE */
-	return ctx->write_size - ctx->write_count - 1;
+	return ctx->write_size - fill_batch(ctx)->write_count - 1;
 }
 
 static unsigned buffer_read_space(struct mpsse_ctx *ctx)
 {
-	return ctx->read_size - ctx->read_count;
+	return ctx->read_size - fill_batch(ctx)->read_count;
 }
 
 static void buffer_write_byte(struct mpsse_ctx *ctx, uint8_t data)
 {
+	struct mpsse_batch *b = fill_batch(ctx);
 	DEBUG_IO("%02x", data);
-	assert(ctx->write_count < ctx->write_size);
-	ctx->write_buffer[ctx->write_count++] = data;
+	assert(b->write_count < ctx->write_size);
+	b->write_buffer[b->write_count++] = data;
 }
 
 static unsigned buffer_write(struct mpsse_ctx *ctx, const uint8_t *out, unsigned out_offset,
 	unsigned bit_count)
 {
+	struct mpsse_batch *b = fill_batch(ctx);
 	DEBUG_IO("%d bits", bit_count);
-	assert(ctx->write_count + DIV_ROUND_UP(bit_count, 8) <= ctx->write_size);
-	bit_copy(ctx->write_buffer + ctx->write_count, 0, out, out_offset, bit_count);
-	ctx->write_count += DIV_ROUND_UP(bit_count, 8);
+	assert(b->write_count + DIV_ROUND_UP(bit_count, 8) <= ctx->write_size);
+	bit_copy(b->write_buffer + b->write_count, 0, out, out_offset, bit_count);
+	b->write_count += DIV_ROUND_UP(bit_count, 8);
 	return bit_count;
 }
 
 static unsigned buffer_add_read(struct mpsse_ctx *ctx, uint8_t *in, unsigned in_offset,
 	unsigned bit_count, unsigned offset)
 {
+	struct mpsse_batch *b = fill_batch(ctx);
 	DEBUG_IO("%d bits, offset %d", bit_count, offset);
-	assert(ctx->read_count + DIV_ROUND_UP(bit_count, 8) <= ctx->read_size);
-	bit_copy_queued(&ctx->read_queue, in, in_offset, ctx->read_buffer + ctx->read_count, offset,
+	assert(b->read_count + DIV_ROUND_UP(bit_count, 8) <= ctx->read_size);
+	bit_copy_queued(&b->read_queue, in, in_offset, b->read_buffer + b->read_count, offset,
 		bit_count);
-	ctx->read_count += DIV_ROUND_UP(bit_count, 8);
+	b->read_count += DIV_ROUND_UP(bit_count, 8);
 	return bit_count;
 }
 
+static int mpsse_submit(struct mpsse_ctx *ctx);
+
 void mpsse_clock_data_out(struct mpsse_ctx *ctx, const uint8_t *out, unsigned out_offset,
 	unsigned length, uint8_t mode)
 {
@@ -510,8 +567,11 @@ void mpsse_clock_data(struct mpsse_ctx *ctx, const uint8_t *out, unsigned out_of
 	while (length > 0) {
 		/* Guarantee buffer space enough for a minimum size transfer */
 		if (buffer_write_space(ctx) + (length < 8) < (out || (!out && !in) ? 4 : 3)
-				|| (in && buffer_read_space(ctx) < 1))
-			ctx->retval = mpsse_flush(ctx);
+				|| (in && buffer_read_space(ctx) < 1)) {
+			ctx->retval = mpsse_submit(ctx);
+			if (ctx->retval != ERROR_OK)
+				return;
+		}
 
 		if (length < 8) {
 			/* Transfer remaining bits in bit mode */
@@ -584,8 +644,11 @@ void mpsse_clock_tms_cs(struct mpsse_ctx *ctx, const uint8_t *out, unsigned out_
 
 	while (length > 0) {
 		/* Guarantee buffer space enough for a minimum size transfer */
-		if (buffer_write_space(ctx) < 3 || (in && buffer_read_space(ctx) < 1))
-			ctx->retval = mpsse_flush(ctx);
+		if (buffer_write_space(ctx) < 3 || (in && buffer_read_space(ctx) < 1)) {
+			ctx->retval = mpsse_submit(ctx);
+			if (ctx->retval != ERROR_OK)
+				return;
+		}
 
 		/* Byte transfer */
 		unsigned this_bits = length;
@@ -627,8 +690,11 @@ void mpsse_set_data_bits_low_byte(struct mpsse_ctx *ctx, uint8_t data, uint8_t d
 		return;
 	}
 
-	if (buffer_write_space(ctx) < 3)
-		ctx->retval = mpsse_flush(ctx);
+	if (buffer_write_space(ctx) < 3) {
+		ctx->retval = mpsse_submit(ctx);
+		if (ctx->retval != ERROR_OK)
+			return;
+	}
 
 	buffer_write_byte(ctx, 0x80);
 	buffer_write_byte(ctx, data);
@@ -644,8 +710,11 @@ void mpsse_set_data_bits_high_byte(struct mpsse_ctx *ctx, uint8_t data, uint8_t
 		return;
 	}
 
-	if (buffer_write_space(ctx) < 3)
-		ctx->retval = mpsse_flush(ctx);
+	if (buffer_write_space(ctx) < 3) {
+		ctx->retval = mpsse_submit(ctx);
+		if (ctx->retval != ERROR_OK)
+			return;
+	}
 
 	buffer_write_byte(ctx, 0x82);
 	buffer_write_byte(ctx, data);
@@ -661,8 +730,11 @@ void mpsse_read_data_bits_low_byte(struct mpsse_ctx *ctx, uint8_t *data)
 		return;
 	}
 
-	if (buffer_write_space(ctx) < 1 || buffer_read_space(ctx) < 1)
-		ctx->retval = mpsse_flush(ctx);
+	if (buffer_write_space(ctx) < 1 || buffer_read_space(ctx) < 1) {
+		ctx->retval = mpsse_submit(ctx);
+		if (ctx->retval != ERROR_OK)
+			return;
+	}
 
 	buffer_write_byte(ctx, 0x81);
 	buffer_add_read(ctx, data, 0, 8, 0);
@@ -677,8 +749,11 @@ void mpsse_read_data_bits_high_byte(struct mpsse_ctx *ctx, uint8_t *data)
 		return;
 	}
 
-	if (buffer_write_space(ctx) < 1 || buffer_read_space(ctx) < 1)
-		ctx->retval = mpsse_flush(ctx);
+	if (buffer_write_space(ctx) < 1 || buffer_read_space(ctx) < 1) {
+		ctx->retval = mpsse_submit(ctx);
+		if (ctx->retval != ERROR_OK)
+			return;
+	}
 
 	buffer_write_byte(ctx, 0x83);
 	buffer_add_read(ctx, data, 0, 8, 0);
@@ -692,8 +767,11 @@ static void single_byte_boolean_helper(struct mpsse_ctx *ctx, bool var, uint8_t
 		return;
 	}
 
-	if (buffer_write_space(ctx) < 1)
-		ctx->retval = mpsse_flush(ctx);
+	if (buffer_write_space(ctx) < 1) {
+		ctx->retval = mpsse_submit(ctx);
+		if (ctx->retval != ERROR_OK)
+			return;
+	}
 
 	buffer_write_byte(ctx, var ? val_if_true : val_if_false);
 }
@@ -713,8 +791,11 @@ void mpsse_set_divisor(struct mpsse_ctx *ctx, uint16_t divisor)
 		return;
 	}
 
-	if (buffer_write_space(ctx) < 3)
-		ctx->retval = mpsse_flush(ctx);
+	if (buffer_write_space(ctx) < 3) {
+		ctx->retval = mpsse_submit(ctx);
+		if (ctx->retval != ERROR_OK)
+			return;
+	}
 
 	buffer_write_byte(ctx, 0x86);
 	buffer_write_byte(ctx, divisor & 0xff);
@@ -774,173 +855,247 @@ int mpsse_set_frequency(struct mpsse_ctx *ctx, int frequency)
 	return frequency;
 }
 
-/* Context needed by the callbacks */
-struct transfer_result {
-	struct mpsse_ctx *ctx;
-	bool done;
-	unsigned transferred;
-};
+static bool batch_done(struct mpsse_batch *b)
+{
+	return !b->write_pending && b->write_transferred == b->write_count
+		&& b->read_transferred == b->read_count;
+}
 
-static LIBUSB_CALL void read_cb(struct libusb_transfer *transfer)
+/* True if some batch in flight still waits for read data */
+static bool read_expected(struct mpsse_ctx *ctx)
 {
-	struct transfer_result *res = transfer->user_data;
-	struct mpsse_ctx *ctx = res->ctx;
+	for (unsigned i = 0; i < ctx->batch_queued; i++) {
+		struct mpsse_batch *b = &ctx->batch[(ctx->batch_head + i) % MPSSE_BATCHES];
+		if (b->read_transferred < b->read_count)
+			return true;
+	}
+	return false;
+}
 
+static LIBUSB_CALL void read_cb(struct libusb_transfer *transfer)
+{
+	struct mpsse_ctx *ctx = transfer->user_data;
 	unsigned packet_size = ctx->max_packet_size;
+	unsigned n = 0;
+
+	ctx->read_pending = false;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		DEBUG_IO("read transfer status %d", transfer->status);
+		ctx->usb_failed = true;
+		return;
+	}
 
 	DEBUG_PRINT_BUF(transfer->buffer, transfer->actual_length);
 
 	/* Strip the two status bytes sent at the beginning of each USB packet
-	 * while copying the chunk buffer to the read buffer */
+	 * while handing the payload to the batches in flight, in order. The
+	 * payload of one packet can complete a batch and start the next one. */
 	unsigned num_packets = DIV_ROUND_UP(transfer->actual_length, packet_size);
 	unsigned chunk_remains = transfer->actual_length;
 	for (unsigned i = 0; i < num_packets && chunk_remains > 2; i++) {
 		unsigned this_size = packet_size - 2;
 		if (this_size > chunk_remains - 2)
 			this_size = chunk_remains - 2;
-		if (this_size > ctx->read_count - res->transferred)
-			this_size = ctx->read_count - res->transferred;
-		memcpy(ctx->read_buffer + res->transferred,
-			ctx->read_chunk + packet_size * i + 2,
-			this_size);
-		res->transferred += this_size;
 		chunk_remains -= this_size + 2;
-		if (res->transferred == ctx->read_count) {
-			res->done = true;
-			break;
+
+		const uint8_t *src = ctx->read_chunk + packet_size * i + 2;
+		while (this_size > 0) {
+			struct mpsse_batch *b = NULL;
+			for (; n < ctx->batch_queued; n++) {
+				b = &ctx->batch[(ctx->batch_head + n) % MPSSE_BATCHES];
+				if (b->read_transferred < b->read_count)
+					break;
+			}
+			if (n == ctx->batch_queued) {
+				DEBUG_IO("discarding %d unexpected bytes", this_size);
+				break;
+			}
+
+			unsigned copy = b->read_count - b->read_transferred;
+			if (copy > this_size)
+				copy = this_size;
+			memcpy(b->read_buffer + b->read_transferred, src, copy);
+			b->read_transferred += copy;
+			src += copy;
+			this_size -= copy;
 		}
 	}
 
-	DEBUG_IO("raw chunk %d, transferred %d of %d", transfer->actual_length, res->transferred,
-		ctx->read_count);
+	DEBUG_IO("raw chunk %d", transfer->actual_length);
 
-	if (!res->done)
-		if (libusb_submit_transfer(transfer) != LIBUSB_SUCCESS)
-			res->done = true;
+	if (read_expected(ctx)) {
+		if (libusb_submit_transfer(transfer) == LIBUSB_SUCCESS)
+			ctx->read_pending = true;
+		else
+			ctx->usb_failed = true;
+	}
 }
 
 static LIBUSB_CALL void write_cb(struct libusb_transfer *transfer)
 {
-	struct transfer_result *res = transfer->user_data;
-	struct mpsse_ctx *ctx = res->ctx;
+	struct mpsse_batch *b = transfer->user_data;
+	struct mpsse_ctx *ctx = b->ctx;
+
+	b->write_pending = false;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		DEBUG_IO("write transfer status %d", transfer->status);
+		ctx->usb_failed = true;
+		return;
+	}
 
-	res->transferred += transfer->actual_length;
+	b->write_transferred += transfer->actual_length;
 
-	DEBUG_IO("transferred %d of %d", res->transferred, ctx->write_count);
+	DEBUG_IO("transferred %d of %d", b->write_transferred, b->write_count);
 
 	DEBUG_PRINT_BUF(transfer->buffer, transfer->actual_length);
 
-	if (res->transferred == ctx->write_count)
-		res->done = true;
-	else {
-		transfer->length = ctx->write_count - res->transferred;
-		transfer->buffer = ctx->write_buffer + res->transferred;
-		if (libusb_submit_transfer(transfer) != LIBUSB_SUCCESS)
-			res->done = true;
+	if (b->write_transferred < b->write_count) {
+		transfer->length = b->write_count - b->write_transferred;
+		transfer->buffer = b->write_buffer + b->write_transferred;
+		if (libusb_submit_transfer(transfer) == LIBUSB_SUCCESS)
+			b->write_pending = true;
+		else
+			ctx->usb_failed = true;
 	}
 }
 
-int mpsse_flush(struct mpsse_ctx *ctx)
+static int handle_events(struct mpsse_ctx *ctx)
 {
-	int retval = ctx->retval;
+	struct timeval timeout_usb;
 
-	if (retval != ERROR_OK) {
-		DEBUG_IO("Ignoring flush due to previous error");
-		assert(ctx->write_count == 0 && ctx->read_count == 0);
-		ctx->retval = ERROR_OK;
-		return retval;
+	timeout_usb.tv_sec = 1;
+	timeout_usb.tv_usec = 0;
+
+	int retval = libusb_handle_events_timeout_completed(ctx->usb_ctx, &timeout_usb, NULL);
+	keep_alive();
+	return retval;
+}
+
+/* Cancel everything in flight, wait for the callbacks and drop all queued data */
+static void mpsse_abort(struct mpsse_ctx *ctx)
+{
+	bool pending;
+
+	do {
+		pending = ctx->read_pending;
+		if (ctx->read_pending)
+			libusb_cancel_transfer(ctx->read_transfer);
+		for (unsigned i = 0; i < MPSSE_BATCHES; i++) {
+			if (ctx->batch[i].write_pending) {
+				libusb_cancel_transfer(ctx->batch[i].write_transfer);
+				pending = true;
+			}
+		}
+	} while (pending && handle_events(ctx) == LIBUSB_SUCCESS);
+
+	mpsse_purge(ctx);
+}
+
+/* Wait for the oldest batch in flight and deliver its read data */
+static int mpsse_wait_oldest(struct mpsse_ctx *ctx)
+{
+	struct mpsse_batch *b = &ctx->batch[ctx->batch_head];
+
+	while (!ctx->usb_failed && !batch_done(b)) {
+		int retval = handle_events(ctx);
+		if (retval != LIBUSB_SUCCESS) {
+			LOG_ERROR("libusb_handle_events() failed with %s", libusb_error_name(retval));
+			ctx->usb_failed = true;
+		}
 	}
 
-	DEBUG_IO("write %d%s, read %d", ctx->write_count, ctx->read_count ? "+1" : "",
-			ctx->read_count);
-	assert(ctx->write_count > 0 || ctx->read_count == 0); /* No read data without write data */
+	if (ctx->usb_failed) {
+		if (b->write_transferred < b->write_count)
+			LOG_ERROR("ftdi device did not accept all data: %d, tried %d",
+				b->write_transferred,
+				b->write_count);
+		else if (b->read_transferred < b->read_count)
+			LOG_ERROR("ftdi device did not return all data: %d, expected %d",
+				b->read_transferred,
+				b->read_count);
+		mpsse_abort(ctx);
+		return ERROR_FAIL;
+	}
 
-	if (ctx->write_count == 0)
-		return retval;
+	bit_copy_execute(&b->read_queue);
+	b->write_count = 0;
+	b->read_count = 0;
+	ctx->batch_head = (ctx->batch_head + 1) % MPSSE_BATCHES;
+	ctx->batch_queued--;
+	return ERROR_OK;
+}
 
-	struct libusb_transfer *read_transfer = 0;
-	struct transfer_result read_result = { .ctx = ctx, .done = true };
-	if (ctx->read_count) {
+/* Put the batch being filled on the wire and continue with the next one,
+ * waiting for the oldest batch only if all of them are in use. */
+static int mpsse_submit(struct mpsse_ctx *ctx)
+{
+	struct mpsse_batch *b = fill_batch(ctx);
+	int retval;
+
+	/* an earlier failure aborted the queue, what was added since is
+	 * incomplete */
+	if (ctx->retval != ERROR_OK)
+		return ctx->retval;
+
+	DEBUG_IO("write %d%s, read %d", b->write_count, b->read_count ? "+1" : "",
+			b->read_count);
+	assert(b->write_count > 0 || b->read_count == 0); /* No read data without write data */
+
+	if (b->write_count == 0)
+		return ERROR_OK;
+
+	if (b->read_count)
 		buffer_write_byte(ctx, 0x87); /* SEND_IMMEDIATE */
-		read_result.done = false;
-		/* delay read transaction to ensure the FTDI chip can support us with data
-		   immediately after processing the MPSSE commands in the write transaction */
-	}
 
-	struct transfer_result write_result = { .ctx = ctx, .done = false };
-	struct libusb_transfer *write_transfer = libusb_alloc_transfer(0);
-	libusb_fill_bulk_transfer(write_transfer, ctx->usb_dev, ctx->out_ep, ctx->write_buffer,
-		ctx->write_count, write_cb, &write_result, ctx->usb_write_timeout);
-	retval = libusb_submit_transfer(write_transfer);
+	b->write_transferred = 0;
+	b->read_transferred = 0;
+	libusb_fill_bulk_transfer(b->write_transfer, ctx->usb_dev, ctx->out_ep, b->write_buffer,
+		b->write_count, write_cb, b, ctx->usb_write_timeout);
+	retval = libusb_submit_transfer(b->write_transfer);
 	if (retval != LIBUSB_SUCCESS)
-		goto error_check;
-
-	if (ctx->read_count) {
-		read_transfer = libusb_alloc_transfer(0);
-		libusb_fill_bulk_transfer(read_transfer, ctx->usb_dev, ctx->in_ep, ctx->read_chunk,
-			ctx->read_chunk_size, read_cb, &read_result,
+		goto error;
+	b->write_pending = true;
+	ctx->batch_queued++;
+
+	/* the read transfer is submitted after the write, to ensure the FTDI chip
+	 * can support us with data immediately after processing the MPSSE commands,
+	 * and stays submitted as long as any batch in flight expects data */
+	if (b->read_count && !ctx->read_pending) {
+		libusb_fill_bulk_transfer(ctx->read_transfer, ctx->usb_dev, ctx->in_ep,
+			ctx->read_chunk, ctx->read_chunk_size, read_cb, ctx,
 			ctx->usb_read_timeout);
-		retval = libusb_submit_transfer(read_transfer);
+		retval = libusb_submit_transfer(ctx->read_transfer);
 		if (retval != LIBUSB_SUCCESS)
-			goto error_check;
+			goto error;
+		ctx->read_pending = true;
 	}
 
-	/* Polling loop, more or less taken from libftdi */
-	while (!write_result.done || !read_result.done) {
-		struct timeval timeout_usb;
+	if (ctx->batch_queued == MPSSE_BATCHES)
+		return mpsse_wait_oldest(ctx);
 
-		timeout_usb.tv_sec = 1;
-		timeout_usb.tv_usec = 0;
+	return ERROR_OK;
 
-		retval = libusb_handle_events_timeout_completed(ctx->usb_ctx, &timeout_usb, NULL);
-		keep_alive();
-		if (retval == LIBUSB_ERROR_NO_DEVICE || retval == LIBUSB_ERROR_INTERRUPTED)
-			break;
+error:
+	LOG_ERROR("libusb_submit_transfer() failed with %s", libusb_error_name(retval));
+	mpsse_abort(ctx);
+	return ERROR_FAIL;
+}
 
-		if (retval != LIBUSB_SUCCESS) {
-			libusb_cancel_transfer(write_transfer);
-			if (read_transfer)
-				libusb_cancel_transfer(read_transfer);
-			while (!write_result.done || !read_result.done) {
-				retval = libusb_handle_events_timeout_completed(ctx->usb_ctx,
-								&timeout_usb, NULL);
-				if (retval != LIBUSB_SUCCESS)
-					break;
-			}
-		}
-	}
+int mpsse_flush(struct mpsse_ctx *ctx)
+{
+	int retval = ctx->retval;
 
-error_check:
-	if (retval != LIBUSB_SUCCESS) {
-		LOG_ERROR("libusb_handle_events() failed with %s", libusb_error_name(retval));
-		retval = ERROR_FAIL;
-	} else if (write_result.transferred < ctx->write_count) {
-		LOG_ERROR("ftdi device did not accept all data: %d, tried %d",
-			write_result.transferred,
-			ctx->write_count);
-		retval = ERROR_FAIL;
-	} else if (read_result.transferred < ctx->read_count) {
-		LOG_ERROR("ftdi device did not return all data: %d, expected %d",
-			read_result.transferred,
-			ctx->read_count);
-		retval = ERROR_FAIL;
-	} else if (ctx->read_count) {
-		ctx->write_count = 0;
-		ctx->read_count = 0;
-		bit_copy_execute(&ctx->read_queue);
-		retval = ERROR_OK;
-	} else {
-		ctx->write_count = 0;
-		bit_copy_discard(&ctx->read_queue);
-		retval = ERROR_OK;
+	if (retval != ERROR_OK) {
+		DEBUG_IO("Ignoring flush due to previous error");
+		assert(fill_batch(ctx)->write_count == 0 && fill_batch(ctx)->read_count == 0);
+		ctx->retval = ERROR_OK;
+		return retval;
 	}
 
-	libusb_free_transfer(write_transfer);
-	if (read_transfer)
-		libusb_free_transfer(read_transfer);
+	retval = mpsse_submit(ctx);
 
-	if (retval != ERROR_OK)
-		mpsse_purge(ctx);
+	while (retval == ERROR_OK && ctx->batch_queued)
+		retval = mpsse_wait_oldest(ctx);
 
 	return retval;
 }
@@ -25,11 +25,15 @@
 #include <netdb.h>
 #endif
 #include <jtag/interface.h>
+#include <helper/binarybuffer.h>
 #include "bitbang.h"
 
 /* arbitrary limit on host name length: */
 #define REMOTE_BITBANG_HOST_MAX 255
 
+/* most bits sent in one protocol v2 shift request */
+#define REMOTE_BITBANG_SHIFT_MAX (4096 * 8)
+
 #define REMOTE_BITBANG_RAISE_ERROR(expr ...) \
 	do { \
 		LOG_ERROR(expr); \
@@ -39,6 +43,7 @@
 
 static char *remote_bitbang_host;
 static char *remote_bitbang_port;
+static int remote_bitbang_protocol = 1;
 
 FILE *remote_bitbang_in;
 FILE *remote_bitbang_out;
@@ -49,6 +54,12 @@ static void remote_bitbang_putc(int c)
 		REMOTE_BITBANG_RAISE_ERROR("remote_bitbang_putc: %s", strerror(errno));
 }
 
+static void remote_bitbang_fwrite(const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, remote_bitbang_out) != len)
+		REMOTE_BITBANG_RAISE_ERROR("remote_bitbang_fwrite: %s", strerror(errno));
+}
+
 static int remote_bitbang_quit(void)
 {
 	if (EOF == fputc('Q', remote_bitbang_out)) {
@@ -120,6 +131,67 @@ static void remote_bitbang_blink(int on)
 	remote_bitbang_putc(c);
 }
 
+/* Protocol v2: 'S', a flags byte (bit 0: return TDO), the number of bits as
+ * 32 bit little endian value, then the TMS and the TDI bits, packed LSB first.
+ * The server clocks all bits without further requests and answers with the
+ * packed TDO bits if asked to, so a whole scan costs one round trip.
+ */
+static int remote_bitbang_shift(unsigned num_bits, const uint8_t *tms,
+		const uint8_t *tdi, uint8_t *tdo)
+{
+	static const uint8_t zeros[REMOTE_BITBANG_SHIFT_MAX / 8];
+	uint8_t in[REMOTE_BITBANG_SHIFT_MAX / 8];
+
+	for (unsigned offset = 0; offset < num_bits; offset += REMOTE_BITBANG_SHIFT_MAX) {
+		unsigned bits = MIN(num_bits - offset, REMOTE_BITBANG_SHIFT_MAX);
+		size_t bytes = DIV_ROUND_UP(bits, 8);
+		uint8_t header[6] = { 'S', tdo ? 1 : 0 };
+
+		h_u32_to_le(header + 2, bits);
+		remote_bitbang_fwrite(header, sizeof(header));
+		remote_bitbang_fwrite(tms + offset / 8, bytes);
+		remote_bitbang_fwrite(tdi ? tdi + offset / 8 : zeros, bytes);
+
+		if (!tdo)
+			continue;
+
+		if (EOF == fflush(remote_bitbang_out)) {
+			remote_bitbang_quit();
+			REMOTE_BITBANG_RAISE_ERROR("fflush: %s", strerror(errno));
+		}
+
+		if (fread(in, 1, bytes, remote_bitbang_in) != bytes) {
+			remote_bitbang_quit();
+			REMOTE_BITBANG_RAISE_ERROR("remote_bitbang: short TDO response");
+		}
+
+		/* only touch the bits that were scanned */
+		buf_set_buf(in, 0, tdo, offset, bits);
+	}
+
+	return ERROR_OK;
+}
+
+/* Make sure the server speaks protocol v2, which the user asked for.
+ * Servers which only know the original protocol never answer the query,
+ * so it is only sent when v2 was configured. */
+static int remote_bitbang_negotiate(void)
+{
+	remote_bitbang_putc('V');
+	if (EOF == fflush(remote_bitbang_out)) {
+		LOG_ERROR("fflush: %s", strerror(errno));
+		return ERROR_FAIL;
+	}
+
+	int c = fgetc(remote_bitbang_in);
+	if (c != '2') {
+		LOG_ERROR("remote_bitbang: server doesn't support protocol v2 (response %i)", c);
+		return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
 static struct bitbang_interface remote_bitbang_bitbang = {
 	.read = &remote_bitbang_read,
 	.write = &remote_bitbang_write,
@@ -225,6 +297,14 @@ static int remote_bitbang_init(void)
 		return ERROR_FAIL;
 	}
 
+	if (remote_bitbang_protocol == 2) {
+		if (remote_bitbang_negotiate() != ERROR_OK)
+			return ERROR_FAIL;
+		LOG_INFO("remote_bitbang: using protocol v2");
+		remote_bitbang_bitbang.shift = &remote_bitbang_shift;
+	} else
+		remote_bitbang_bitbang.shift = NULL;
+
 	LOG_INFO("remote_bitbang driver initialized");
 	return ERROR_OK;
 }
@@ -241,6 +321,19 @@ COMMAND_HANDLER(remote_bitbang_handle_remote_bitbang_port_command)
 	return ERROR_COMMAND_SYNTAX_ERROR;
 }
 
+COMMAND_HANDLER(remote_bitbang_handle_remote_bitbang_protocol_command)
+{
+	if (CMD_ARGC == 1) {
+		int protocol;
+		COMMAND_PARSE_NUMBER(int, CMD_ARGV[0], protocol);
+		if (protocol != 1 && protocol != 2)
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		remote_bitbang_protocol = protocol;
+		return ERROR_OK;
+	}
+	return ERROR_COMMAND_SYNTAX_ERROR;
+}
+
 COMMAND_HANDLER(remote_bitbang_handle_remote_bitbang_host_command)
 {
 	if (CMD_ARGC == 1) {
@@ -268,6 +361,14 @@ static const struct command_registration remote_bitbang_command_handlers[] = {
 			"  if port is 0 or unset, this is the name of the unix socket to use.",
 		.usage = "host_name",
 	},
+	{
+		.name = "remote_bitbang_protocol",
+		.handler = remote_bitbang_handle_remote_bitbang_protocol_command,
+		.mode = COMMAND_CONFIG,
+		.help = "Set the protocol version to use. Version 2 sends whole scans\n"
+			"  as packed bit vectors and needs a server supporting it.",
+		.usage = "('1'|'2')",
+	},
 	COMMAND_REGISTRATION_DONE,
 };
 
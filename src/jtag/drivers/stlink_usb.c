@@ -37,6 +37,10 @@
 
 #include "libusb_common.h"
 
+#ifndef LIBUSB_CALL
+#define LIBUSB_CALL
+#endif
+
 #define ENDPOINT_IN  0x80
 #define ENDPOINT_OUT 0x00
 
@@ -64,6 +68,10 @@
  * 8bit read/writes to max 64 bytes. */
 #define STLINK_MAX_RW8		(64)
 
+/* number of 32bit memory transfer chunks kept in flight: while one
+ * chunk's data phase runs, the next chunk's command is already queued */
+#define STLINK_PIPE_DEPTH	4
+
 /* "WAIT" responses will be retried (with exponential backoff) at
  * most this many times before failing to caller.
  */
@@ -1421,6 +1429,160 @@ static uint32_t stlink_max_block_size(uint32_t tar_autoincr_block, uint32_t addr
 	return max_tar_block;
 }
 
+/** one chunk of a pipelined 32bit memory transfer: command and data phase */
+struct stlink_pipe_slot {
+	struct libusb_transfer *cmd;
+	struct libusb_transfer *data;
+	uint8_t cmdbuf[STLINK_CMD_SIZE_V2];
+	/** transfers submitted and not yet called back */
+	int pending;
+	/** set when pending drops to zero, for libusb_handle_events_completed */
+	int idle;
+	bool failed;
+};
+
+static LIBUSB_CALL void stlink_usb_pipe_cb(struct libusb_transfer *transfer)
+{
+	struct stlink_pipe_slot *slot = transfer->user_data;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+			transfer->actual_length != transfer->length)
+		slot->failed = true;
+
+	if (--slot->pending == 0)
+		slot->idle = 1;
+}
+
+static int stlink_usb_pipe_wait(struct stlink_pipe_slot *slot)
+{
+	while (!slot->idle) {
+		int retval = jtag_libusb_handle_events_completed(&slot->idle);
+		if (retval != LIBUSB_SUCCESS && retval != LIBUSB_ERROR_INTERRUPTED) {
+			LOG_ERROR("libusb_handle_events() failed with %s", libusb_error_name(retval));
+			return ERROR_FAIL;
+		}
+	}
+	return slot->failed ? ERROR_FAIL : ERROR_OK;
+}
+
+static int stlink_usb_pipe_submit(struct stlink_usb_handle_s *h, struct stlink_pipe_slot *slot,
+		bool write, uint32_t addr, uint32_t len, uint8_t *buffer)
+{
+	memset(slot->cmdbuf, 0, sizeof(slot->cmdbuf));
+	slot->cmdbuf[0] = STLINK_DEBUG_COMMAND;
+	slot->cmdbuf[1] = write ? STLINK_DEBUG_WRITEMEM_32BIT : STLINK_DEBUG_READMEM_32BIT;
+	h_u32_to_le(slot->cmdbuf + 2, addr);
+	h_u16_to_le(slot->cmdbuf + 6, len);
+
+	slot->failed = false;
+	slot->idle = 0;
+	slot->pending = 0;
+
+	libusb_fill_bulk_transfer(slot->cmd, h->fd, h->tx_ep, slot->cmdbuf,
+			sizeof(slot->cmdbuf), stlink_usb_pipe_cb, slot, STLINK_WRITE_TIMEOUT);
+	libusb_fill_bulk_transfer(slot->data, h->fd, write ? h->tx_ep : h->rx_ep, buffer,
+			len, stlink_usb_pipe_cb, slot, write ? STLINK_WRITE_TIMEOUT : STLINK_READ_TIMEOUT);
+
+	if (libusb_submit_transfer(slot->cmd) != LIBUSB_SUCCESS)
+		goto fail;
+	slot->pending++;
+
+	if (libusb_submit_transfer(slot->data) != LIBUSB_SUCCESS) {
+		libusb_cancel_transfer(slot->cmd);
+		goto fail;
+	}
+	slot->pending++;
+	return ERROR_OK;
+
+fail:
+	slot->failed = true;
+	if (slot->pending == 0)
+		slot->idle = 1;
+	return ERROR_FAIL;
+}
+
+/**
+ * Transfer len bytes of word aligned memory in chunks that don't cross a
+ * TAR autoincrement boundary, keeping up to STLINK_PIPE_DEPTH chunks
+ * submitted at once. The transfers of one endpoint complete in order, so
+ * the adapter always finds its next command waiting. The status of the
+ * accesses is checked once, after the last chunk: a failing access sets
+ * the sticky error flags, which makes the last status fail as well.
+ */
+static int stlink_usb_rw_mem32_pipelined(void *handle, bool write, uint32_t addr,
+		uint32_t len, uint8_t *buffer)
+{
+	struct stlink_usb_handle_s *h = handle;
+	struct stlink_pipe_slot slots[STLINK_PIPE_DEPTH];
+	unsigned int head = 0, busy = 0;
+	int retval = ERROR_OK;
+
+	memset(slots, 0, sizeof(slots));
+	for (unsigned int i = 0; i < STLINK_PIPE_DEPTH; i++) {
+		slots[i].cmd = libusb_alloc_transfer(0);
+		slots[i].data = libusb_alloc_transfer(0);
+		if (slots[i].cmd == NULL || slots[i].data == NULL) {
+			retval = ERROR_FAIL;
+			goto out;
+		}
+	}
+
+	while (len || busy) {
+		while (retval == ERROR_OK && len && busy < STLINK_PIPE_DEPTH) {
+			uint32_t chunk = MIN(stlink_max_block_size(h->max_mem_packet, addr), len);
+			struct stlink_pipe_slot *slot = &slots[(head + busy) % STLINK_PIPE_DEPTH];
+
+			busy++;
+			retval = stlink_usb_pipe_submit(h, slot, write, addr, chunk, buffer);
+			addr += chunk;
+			buffer += chunk;
+			len -= chunk;
+		}
+
+		if (!busy)
+			break;
+
+		/* once something failed, cancel what is still queued and
+		 * wait for it to come back before freeing the transfers */
+		if (retval != ERROR_OK) {
+			for (unsigned int i = 0; i < busy; i++) {
+				struct stlink_pipe_slot *slot = &slots[(head + i) % STLINK_PIPE_DEPTH];
+				if (slot->pending) {
+					libusb_cancel_transfer(slot->cmd);
+					libusb_cancel_transfer(slot->data);
+				}
+			}
+		}
+
+		int ret = stlink_usb_pipe_wait(&slots[head]);
+		if (ret != ERROR_OK) {
+			if (retval == ERROR_OK)
+				LOG_DEBUG("pipelined %s failed", write ? "bulk write" : "bulk read");
+			retval = ret;
+		}
+		head = (head + 1) % STLINK_PIPE_DEPTH;
+		busy--;
+	}
+
+out:
+	for (unsigned int i = 0; i < STLINK_PIPE_DEPTH; i++) {
+		libusb_free_transfer(slots[i].cmd);
+		libusb_free_transfer(slots[i].data);
+	}
+
+	if (retval != ERROR_OK)
+		return retval;
+
+	return stlink_usb_get_rw_status(handle);
+}
+
+/* Pipelining needs the V2 protocol, V1 wraps every command in a SCSI
+ * transaction with its own status phase */
+static bool stlink_usb_can_pipeline(struct stlink_usb_handle_s *h)
+{
+	return h->version.stlink >= 2 && h->jtag_api == STLINK_JTAG_API_V2;
+}
+
 static int stlink_usb_read_mem(void *handle, uint32_t addr, uint32_t size,
 		uint32_t count, uint8_t *buffer)
 {
@@ -1432,6 +1594,18 @@ static int stlink_usb_read_mem(void *handle, uint32_t addr, uint32_t size,
 	/* calculate byte count */
 	count *= size;
 
+	/* aligned words in one pipelined batch, retried as a whole on WAIT */
+	if (size == 4 && addr % 4 == 0 && count > 4 && stlink_usb_can_pipeline(h)) {
+		while (1) {
+			retval = stlink_usb_rw_mem32_pipelined(handle, false, addr, count, buffer);
+			if (retval == ERROR_WAIT && retries < MAX_WAIT_RETRIES) {
+				usleep((1<<retries++) * 1000);
+				continue;
+			}
+			return retval;
+		}
+	}
+
 	while (count) {
 
 		bytes_remaining = (size == 4) ? \
@@ -1502,6 +1676,20 @@ static int stlink_usb_write_mem(void *handle, uint32_t addr, uint32_t size,
 	/* calculate byte count */
 	count *= size;
 
+	/* aligned words in one pipelined batch, retried as a whole on WAIT */
+	if (size == 4 && addr % 4 == 0 && count > 4 && stlink_usb_can_pipeline(h)) {
+		while (1) {
+			/* libusb doesn't modify the data of an OUT transfer */
+			retval = stlink_usb_rw_mem32_pipelined(handle, true, addr, count,
+					(uint8_t *)buffer);
+			if (retval == ERROR_WAIT && retries < MAX_WAIT_RETRIES) {
+				usleep((1<<retries++) * 1000);
+				continue;
+			}
+			return retval;
+		}
+	}
+
 	while (count) {
 
 		bytes_remaining = (size == 4) ? \
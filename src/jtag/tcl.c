@@ -36,6 +36,7 @@
 #include "interface.h"
 #include "interfaces.h"
 #include "tcl.h"
+#include "commands.h"
 
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
@@ -831,6 +832,33 @@ COMMAND_HANDLER(handle_jtag_init_command)
 	return jtag_init(CMD_CTX);
 }
 
+COMMAND_HANDLER(handle_jtag_queue_stats_command)
+{
+	if (CMD_ARGC == 1) {
+		if (strcmp(CMD_ARGV[0], "reset") != 0)
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		jtag_command_queue_stats_reset();
+		return ERROR_OK;
+	} else if (CMD_ARGC != 0)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	const struct jtag_queue_stats *stats = jtag_command_queue_stats();
+	int64_t elapsed = stats->flushes ? timeval_ms() - stats->start_ms : 0;
+
+	command_print(CMD_CTX, "%" PRIu64 " queue flushes, %.1f per second",
+			stats->flushes,
+			elapsed > 0 ? stats->flushes * 1000.0 / elapsed : 0.0);
+	if (stats->flushes) {
+		command_print(CMD_CTX, "commands per flush: %.1f average, %u max",
+				(double)stats->commands / stats->flushes, stats->max_commands);
+		command_print(CMD_CTX, "bytes per flush: %.0f average, %zu max",
+				(double)stats->bytes / stats->flushes, stats->max_bytes);
+	}
+	command_print(CMD_CTX, "queue pages allocated: %u", stats->page_allocs);
+
+	return ERROR_OK;
+}
+
 static const struct command_registration jtag_subcommand_handlers[] = {
 	{
 		.name = "init",
@@ -913,6 +941,13 @@ static const struct command_registration jtag_subcommand_handlers[] = {
 		.jim_handler = jim_jtag_names,
 		.help = "Returns list of all JTAG tap names.",
 	},
+	{
+		.name = "queue_stats",
+		.mode = COMMAND_ANY,
+		.handler = handle_jtag_queue_stats_command,
+		.help = "Show or reset statistics of the JTAG command queue.",
+		.usage = "['reset']",
+	},
 	{
 		.chain = jtag_command_handlers_to_move,
 	},
@@ -177,7 +177,7 @@ static int FreeRTOS_update_threads(struct rtos *rtos)
 	}
 
 	int thread_list_size = 0;
-	retval = target_read_buffer(rtos->target,
+	retval = rtos_snapshot_read(rtos,
 			rtos->symbols[FreeRTOS_VAL_uxCurrentNumberOfTasks].address,
 			param->thread_count_width,
 			(uint8_t *)&thread_list_size);
@@ -194,7 +194,7 @@ static int FreeRTOS_update_threads(struct rtos *rtos)
 	rtos_free_threadlist(rtos);
 
 	/* read the current thread */
-	retval = target_read_buffer(rtos->target,
+	retval = rtos_snapshot_read(rtos,
 			rtos->symbols[FreeRTOS_VAL_pxCurrentTCB].address,
 			param->pointer_width,
 			(uint8_t *)&rtos->current_thread);
@@ -245,7 +245,7 @@ static int FreeRTOS_update_threads(struct rtos *rtos)
 		return ERROR_FAIL;
 	}
 	int64_t max_used_priority = 0;
-	retval = target_read_buffer(rtos->target,
+	retval = rtos_snapshot_read(rtos,
 			rtos->symbols[FreeRTOS_VAL_uxTopUsedPriority].address,
 			param->pointer_width,
 			(uint8_t *)&max_used_priority);
@@ -260,6 +260,13 @@ static int FreeRTOS_update_threads(struct rtos *rtos)
 		return ERROR_FAIL;
 	}
 
+	/* the ready lists are one array, read it at once */
+	retval = rtos_snapshot_prefetch(rtos,
+			rtos->symbols[FreeRTOS_VAL_pxReadyTasksLists].address,
+			(max_used_priority + 1) * param->list_width);
+	if (retval != ERROR_OK)
+		return retval;
+
 	symbol_address_t *list_of_lists =
 		malloc(sizeof(symbol_address_t) *
 			(max_used_priority+1 + 5));
@@ -285,7 +292,7 @@ static int FreeRTOS_update_threads(struct rtos *rtos)
 
 		/* Read the number of threads in this list */
 		int64_t list_thread_count = 0;
-		retval = target_read_buffer(rtos->target,
+		retval = rtos_snapshot_read(rtos,
 				list_of_lists[i],
 				param->thread_count_width,
 				(uint8_t *)&list_thread_count);
@@ -303,7 +310,7 @@ static int FreeRTOS_update_threads(struct rtos *rtos)
 		/* Read the location of first list item */
 		uint64_t prev_list_elem_ptr = -1;
 		uint64_t list_elem_ptr = 0;
-		retval = target_read_buffer(rtos->target,
+		retval = rtos_snapshot_read(rtos,
 				list_of_lists[i] + param->list_next_offset,
 				param->pointer_width,
 				(uint8_t *)&list_elem_ptr);
@@ -318,9 +325,26 @@ static int FreeRTOS_update_threads(struct rtos *rtos)
 		while ((list_thread_count > 0) && (list_elem_ptr != 0) &&
 				(list_elem_ptr != prev_list_elem_ptr) &&
 				(tasks_found < thread_list_size)) {
+			/* Read the next list item first: its read ahead also brings
+			 * in the list item content and, as list items live in the
+			 * TCB, usually the thread name too */
+			uint64_t next_list_elem_ptr = 0;
+			retval = rtos_snapshot_read(rtos,
+					list_elem_ptr + param->list_elem_next_offset,
+					param->pointer_width,
+					(uint8_t *)&next_list_elem_ptr);
+			if (retval != ERROR_OK) {
+				LOG_ERROR("Error reading next thread item location in FreeRTOS thread list");
+				free(list_of_lists);
+				return retval;
+			}
+			LOG_DEBUG("FreeRTOS: Read next thread location at 0x%" PRIx64 ", value 0x%" PRIx64 "\r\n",
+										list_elem_ptr + param->list_elem_next_offset,
+										next_list_elem_ptr);
+
 			/* Get the location of the thread structure. */
 			rtos->thread_details[tasks_found].threadid = 0;
-			retval = target_read_buffer(rtos->target,
+			retval = rtos_snapshot_read(rtos,
 					list_elem_ptr + param->list_elem_content_offset,
 					param->pointer_width,
 					(uint8_t *)&(rtos->thread_details[tasks_found].threadid));
@@ -339,7 +363,7 @@ static int FreeRTOS_update_threads(struct rtos *rtos)
 			char tmp_str[FREERTOS_THREAD_NAME_STR_SIZE];
 
 			/* Read the thread name */
-			retval = target_read_buffer(rtos->target,
+			retval = rtos_snapshot_read(rtos,
 					rtos->thread_details[tasks_found].threadid + param->thread_name_offset,
 					FREERTOS_THREAD_NAME_STR_SIZE,
 					(uint8_t *)&tmp_str);
@@ -374,19 +398,7 @@ static int FreeRTOS_update_threads(struct rtos *rtos)
 			list_thread_count--;
 
 			prev_list_elem_ptr = list_elem_ptr;
-			list_elem_ptr = 0;
-			retval = target_read_buffer(rtos->target,
-					prev_list_elem_ptr + param->list_elem_next_offset,
-					param->pointer_width,
-					(uint8_t *)&list_elem_ptr);
-			if (retval != ERROR_OK) {
-				LOG_ERROR("Error reading next thread item location in FreeRTOS thread list");
-				free(list_of_lists);
-				return retval;
-			}
-			LOG_DEBUG("FreeRTOS: Read next thread location at 0x%" PRIx64 ", value 0x%" PRIx64 "\r\n",
-										prev_list_elem_ptr + param->list_elem_next_offset,
-										list_elem_ptr);
+			list_elem_ptr = next_list_elem_ptr;
 		}
 	}
 
@@ -414,7 +426,7 @@ static int FreeRTOS_get_thread_reg_list(struct rtos *rtos, int64_t thread_id, ch
 	param = (const struct FreeRTOS_params *) rtos->rtos_specific_params;
 
 	/* Read the stack pointer */
-	retval = target_read_buffer(rtos->target,
+	retval = rtos_snapshot_read(rtos,
 			thread_id + param->thread_stack_offset,
 			param->pointer_width,
 			(uint8_t *)&stack_ptr);
@@ -48,7 +48,34 @@ static struct rtos_type *rtos_types[] = {
 	NULL
 };
 
+/* bytes read past the end of a snapshot miss, so that following reads
+ * of the same TCB or list are served from the host */
+#define RTOS_SNAPSHOT_READAHEAD	256
+/* snapshot size above which reads are no longer kept */
+#define RTOS_SNAPSHOT_MAX		(1024 * 1024)
+
 int rtos_thread_packet(struct connection *connection, const char *packet, int packet_size);
+static void rtos_prime_reg_cache(struct rtos *rtos);
+
+static int rtos_target_event(struct target *target, enum target_event event, void *priv)
+{
+	struct rtos *os = priv;
+
+	/* anything read from the target is stale once it runs again */
+	if (event == TARGET_EVENT_RESUME_START)
+		rtos_snapshot_invalidate(os);
+
+	return ERROR_OK;
+}
+
+static int rtos_target_reset(struct target *target, enum target_reset_mode reset_mode, void *priv)
+{
+	struct rtos *os = priv;
+
+	rtos_snapshot_invalidate(os);
+
+	return ERROR_OK;
+}
 
 int rtos_smp_init(struct target *target)
 {
@@ -73,6 +100,9 @@ static int os_alloc(struct target *target, struct rtos_type *ostype)
 	/* RTOS drivers can override the packet handler in _create(). */
 	os->gdb_thread_packet = rtos_thread_packet;
 
+	target_register_event_callback(rtos_target_event, os);
+	target_register_reset_callback(rtos_target_reset, os);
+
 	return JIM_OK;
 }
 
@@ -84,6 +114,9 @@ static void os_free(struct target *target)
 	if (target->rtos->symbols)
 		free(target->rtos->symbols);
 
+	target_unregister_event_callback(rtos_target_event, target->rtos);
+	target_unregister_reset_callback(rtos_target_reset, target->rtos);
+	rtos_snapshot_invalidate(target->rtos);
 	free(target->rtos);
 	target->rtos = NULL;
 }
@@ -344,6 +377,9 @@ int rtos_thread_packet(struct connection *connection, char const *packet, int pa
 	} else if (strncmp(packet, "qfThreadInfo", 12) == 0) {
 		int i;
 		if (target->rtos != NULL) {
+			/* GDB asks for the registers of every thread next */
+			rtos_prime_reg_cache(target->rtos);
+
 			if (target->rtos->thread_count == 0) {
 				gdb_put_packet(connection, "l", 1);
 			} else {
@@ -421,6 +457,60 @@ int rtos_thread_packet(struct connection *connection, char const *packet, int pa
 	return GDB_THREAD_PACKET_NOT_CONSUMED;
 }
 
+/* Get the register list of a thread from the per halt cache, reading and
+ * caching it on a miss. The list stays owned by the cache. */
+static int rtos_get_thread_reg_list_cached(struct rtos *rtos, threadid_t threadid,
+		char **hex_reg_list)
+{
+	struct rtos_reg_cache *entry;
+
+	for (entry = rtos->reg_cache; entry; entry = entry->next) {
+		if (entry->threadid == threadid) {
+			*hex_reg_list = entry->hex_reg_list;
+			return entry->retval;
+		}
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return ERROR_FAIL;
+
+	/* failures are cached too, a thread with a broken stack would
+	 * otherwise be read again for every GDB request */
+	entry->threadid = threadid;
+	entry->retval = rtos->type->get_thread_reg_list(rtos, threadid, &entry->hex_reg_list);
+	if (entry->retval != ERROR_OK) {
+		free(entry->hex_reg_list);
+		entry->hex_reg_list = NULL;
+	}
+	entry->next = rtos->reg_cache;
+	rtos->reg_cache = entry;
+
+	*hex_reg_list = entry->hex_reg_list;
+	return entry->retval;
+}
+
+/* Read the saved registers of all threads while their TCBs are still in
+ * the snapshot, so that GDB walking every thread is served from the host */
+static void rtos_prime_reg_cache(struct rtos *rtos)
+{
+	if (rtos->reg_cache_primed || rtos->target->state != TARGET_HALTED)
+		return;
+	rtos->reg_cache_primed = true;
+
+	for (int i = 0; i < rtos->thread_count; i++) {
+		threadid_t threadid = rtos->thread_details[i].threadid;
+		char *hex_reg_list;
+
+		if (threadid == 0 || (threadid == rtos->current_thread && !rtos->target->smp))
+			continue;
+		rtos_get_thread_reg_list_cached(rtos, threadid, &hex_reg_list);
+	}
+
+	LOG_DEBUG("RTOS: register lists of %d threads read with %u target reads",
+			rtos->thread_count, rtos->snapshot_misses);
+}
+
 int rtos_get_gdb_reg_list(struct connection *connection)
 {
 	struct target *target = get_target_from_connection(connection);
@@ -436,7 +526,7 @@ int rtos_get_gdb_reg_list(struct connection *connection)
 										current_threadid,
 										target->rtos->current_thread);
 
-		int retval = target->rtos->type->get_thread_reg_list(target->rtos,
+		int retval = rtos_get_thread_reg_list_cached(target->rtos,
 				current_threadid,
 				&hex_reg_list);
 		if (retval != ERROR_OK) {
@@ -446,7 +536,6 @@ int rtos_get_gdb_reg_list(struct connection *connection)
 
 		if (hex_reg_list != NULL) {
 			gdb_put_packet(connection, hex_reg_list, strlen(hex_reg_list));
-			free(hex_reg_list);
 			return ERROR_OK;
 		}
 	}
@@ -474,7 +563,10 @@ int rtos_generic_stack_read(struct target *target,
 
 	if (stacking->stack_growth_direction == 1)
 		address -= stacking->stack_registers_size;
-	retval = target_read_buffer(target, address, stacking->stack_registers_size, stack_data);
+	if (target->rtos)
+		retval = rtos_snapshot_read(target->rtos, address, stacking->stack_registers_size, stack_data);
+	else
+		retval = target_read_buffer(target, address, stacking->stack_registers_size, stack_data);
 	if (retval != ERROR_OK) {
 		free(stack_data);
 		LOG_ERROR("Error reading stack frame from thread");
@@ -542,11 +634,146 @@ int rtos_try_next(struct target *target)
 
 int rtos_update_threads(struct target *target)
 {
-	if ((target->rtos != NULL) && (target->rtos->type != NULL))
+	if ((target->rtos != NULL) && (target->rtos->type != NULL)) {
+		rtos_snapshot_invalidate(target->rtos);
 		target->rtos->type->update_threads(target->rtos);
+		LOG_DEBUG("RTOS: thread list read with %u target reads, %u served from the snapshot",
+				target->rtos->snapshot_misses, target->rtos->snapshot_hits);
+	}
 	return ERROR_OK;
 }
 
+static struct rtos_snapshot_block *rtos_snapshot_find(struct rtos *rtos,
+		target_addr_t address, uint32_t size)
+{
+	for (struct rtos_snapshot_block *b = rtos->snapshot; b; b = b->next) {
+		if (address >= b->address && address - b->address + size <= b->size)
+			return b;
+	}
+	return NULL;
+}
+
+static int rtos_snapshot_add(struct rtos *rtos, target_addr_t address, uint32_t size)
+{
+	struct rtos_snapshot_block *b = malloc(sizeof(*b) + size);
+	if (b == NULL)
+		return ERROR_FAIL;
+
+	int retval = target_read_buffer(rtos->target, address, size, b->data);
+	if (retval != ERROR_OK) {
+		free(b);
+		return retval;
+	}
+
+	b->address = address;
+	b->size = size;
+	b->next = rtos->snapshot;
+	rtos->snapshot = b;
+	rtos->snapshot_size += size;
+	rtos->snapshot_misses++;
+	return ERROR_OK;
+}
+
+/**
+ * Read a block of target memory into the snapshot in a single access, so
+ * that following rtos_snapshot_read() calls inside it don't touch the
+ * target. Use it for arrays of list heads, TCB tables and the like.
+ */
+int rtos_snapshot_prefetch(struct rtos *rtos, target_addr_t address, uint32_t size)
+{
+	if (rtos_snapshot_find(rtos, address, size))
+		return ERROR_OK;
+
+	if (rtos->snapshot_size + size > RTOS_SNAPSHOT_MAX)
+		return ERROR_OK;
+
+	return rtos_snapshot_add(rtos, address, size);
+}
+
+/**
+ * Read target memory for an RTOS driver. The memory of the halted target
+ * is read once, in blocks extended by RTOS_SNAPSHOT_READAHEAD bytes, and
+ * served from the host until the target resumes or the thread list is
+ * updated again.
+ */
+int rtos_snapshot_read(struct rtos *rtos, target_addr_t address, uint32_t size, uint8_t *buffer)
+{
+	struct rtos_snapshot_block *b = rtos_snapshot_find(rtos, address, size);
+
+	if (b == NULL) {
+		if (rtos->snapshot_size + size + RTOS_SNAPSHOT_READAHEAD > RTOS_SNAPSHOT_MAX) {
+			rtos->snapshot_misses++;
+			return target_read_buffer(rtos->target, address, size, buffer);
+		}
+
+		/* the read ahead may run off the end of memory, then read
+		 * exactly what was asked for */
+		if (rtos_snapshot_add(rtos, address, size + RTOS_SNAPSHOT_READAHEAD) != ERROR_OK) {
+			int retval = rtos_snapshot_add(rtos, address, size);
+			if (retval != ERROR_OK)
+				return retval;
+		}
+		b = rtos->snapshot;
+	} else
+		rtos->snapshot_hits++;
+
+	memcpy(buffer, b->data + (address - b->address), size);
+	return ERROR_OK;
+}
+
+/* Drop the cached thread register lists, failed reads included */
+void rtos_reg_cache_invalidate(struct rtos *rtos)
+{
+	while (rtos->reg_cache) {
+		struct rtos_reg_cache *next = rtos->reg_cache->next;
+		free(rtos->reg_cache->hex_reg_list);
+		free(rtos->reg_cache);
+		rtos->reg_cache = next;
+	}
+	rtos->reg_cache_primed = false;
+}
+
+/* Drop everything read from the target during this halt */
+void rtos_snapshot_invalidate(struct rtos *rtos)
+{
+	rtos_reg_cache_invalidate(rtos);
+
+	while (rtos->snapshot) {
+		struct rtos_snapshot_block *next = rtos->snapshot->next;
+		free(rtos->snapshot);
+		rtos->snapshot = next;
+	}
+	rtos->snapshot_size = 0;
+	rtos->snapshot_hits = 0;
+	rtos->snapshot_misses = 0;
+}
+
+/* The host wrote target memory, which may hold TCBs or stacks read during
+ * this halt. With SMP, the cores share that memory. */
+void rtos_memory_written(struct target *target)
+{
+	if (target->smp) {
+		for (struct target_list *head = target->head; head; head = head->next) {
+			if (head->target->rtos)
+				rtos_snapshot_invalidate(head->target->rtos);
+		}
+	} else if (target->rtos)
+		rtos_snapshot_invalidate(target->rtos);
+}
+
+/* The host wrote core registers. The register lists of the threads
+ * running on a core are read from it, with SMP by any of the cores. */
+void rtos_registers_written(struct target *target)
+{
+	if (target->smp) {
+		for (struct target_list *head = target->head; head; head = head->next) {
+			if (head->target->rtos)
+				rtos_reg_cache_invalidate(head->target->rtos);
+		}
+	} else if (target->rtos)
+		rtos_reg_cache_invalidate(target->rtos);
+}
+
 void rtos_free_threadlist(struct rtos *rtos)
 {
 	if (rtos->thread_details) {
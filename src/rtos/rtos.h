@@ -20,6 +20,7 @@
 #define OPENOCD_RTOS_RTOS_H
 
 #include "server/server.h"
+#include <helper/types.h>
 #include <jim-nvp.h>
 
 typedef int64_t threadid_t;
@@ -43,6 +44,22 @@ struct thread_detail {
 	char *extra_info_str;
 };
 
+/* a block of target memory read while the target is halted */
+struct rtos_snapshot_block {
+	target_addr_t address;
+	uint32_t size;
+	struct rtos_snapshot_block *next;
+	uint8_t data[];
+};
+
+/* register list of a thread, as sent to GDB, read during this halt */
+struct rtos_reg_cache {
+	threadid_t threadid;
+	int retval;
+	char *hex_reg_list;
+	struct rtos_reg_cache *next;
+};
+
 struct rtos {
 	const struct rtos_type *type;
 
@@ -55,6 +72,13 @@ struct rtos {
 	int thread_count;
 	int (*gdb_thread_packet)(struct connection *connection, char const *packet, int packet_size);
 	void *rtos_specific_params;
+	/* target memory already read during this halt, see rtos_snapshot_read() */
+	struct rtos_snapshot_block *snapshot;
+	uint32_t snapshot_size;
+	unsigned int snapshot_hits;
+	unsigned int snapshot_misses;
+	struct rtos_reg_cache *reg_cache;
+	bool reg_cache_primed;
 };
 
 struct rtos_type {
@@ -105,6 +129,12 @@ int rtos_get_gdb_reg_list(struct connection *connection);
 int rtos_update_threads(struct target *target);
 void rtos_free_threadlist(struct rtos *rtos);
 int rtos_smp_init(struct target *target);
+int rtos_snapshot_prefetch(struct rtos *rtos, target_addr_t address, uint32_t size);
+int rtos_snapshot_read(struct rtos *rtos, target_addr_t address, uint32_t size, uint8_t *buffer);
+void rtos_reg_cache_invalidate(struct rtos *rtos);
+void rtos_snapshot_invalidate(struct rtos *rtos);
+void rtos_memory_written(struct target *target);
+void rtos_registers_written(struct target *target);
 /*  function for handling symbol access */
 int rtos_qsymbol(struct connection *connection, char const *packet, int packet_size);
 
@@ -49,6 +49,10 @@
 #include "rtos/rtos.h"
 #include "target/smp.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /**
  * @file
  * GDB server implementation.
@@ -66,6 +70,9 @@ struct target_desc_format {
 /* private connection data for GDB */
 struct gdb_connection {
 	char buffer[GDB_BUFFER_SIZE];
+	/* reused for hex encoded replies, large enough to hold a complete
+	 * "$<payload>#xx" packet of GDB_BUFFER_SIZE payload characters */
+	char out_buffer[GDB_BUFFER_SIZE + 4];
 	char *buf_p;
 	int buf_cnt;
 	int ctrl_c;
@@ -83,6 +90,12 @@ struct gdb_connection {
 	 * can be replied immediately and a new GDB packet will be ready without delay
 	 * (ca. 10% or so...). */
 	bool mem_write_error;
+	/* Consecutive 'X' packets are combined into one target write while GDB
+	 * keeps streaming them, see gdb_write_memory_binary_packet(). This holds
+	 * data that was already acknowledged but not yet written to the target. */
+	uint8_t *write_buffer;
+	uint64_t write_address;
+	uint32_t write_count;
 	/* with extended-remote it seems we need to better emulate attach/detach.
 	 * what this means is we reply with a W stop reply after a kill packet,
 	 * normally we reply with a S reply via gdb_last_signal_packet.
@@ -98,6 +111,12 @@ struct gdb_connection {
 #define _DEBUG_GDB_IO_
 #endif
 
+/* largest target write built from consecutive 'X' packets */
+#define GDB_WRITE_COMBINE_SIZE (4 * GDB_BUFFER_SIZE)
+/* how long to wait for the next packet of a stream of 'X' packets before
+ * the data collected so far is written to the target */
+#define GDB_WRITE_COMBINE_WAIT_MS 2
+
 static struct gdb_connection *current_gdb_connection;
 
 static int gdb_breakpoint_override;
@@ -192,6 +211,27 @@ static int check_pending(struct connection *connection,
 	return ERROR_OK;
 }
 
+/* Like check_pending(), but waits at most @a timeout_ms and never fails */
+static bool gdb_input_within(struct connection *connection, int timeout_ms)
+{
+	struct timeval tv;
+	fd_set read_fds;
+	struct gdb_connection *gdb_con = connection->priv;
+
+	if (gdb_con->buf_cnt > 0)
+		return true;
+
+	FD_ZERO(&read_fds);
+	FD_SET(connection->fd, &read_fds);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = timeout_ms * 1000;
+	if (socket_select(connection->fd + 1, &read_fds, NULL, NULL, &tv) <= 0)
+		return false;
+
+	return FD_ISSET(connection->fd, &read_fds) != 0;
+}
+
 static int gdb_get_char_inner(struct connection *connection, int *next_char)
 {
 	struct gdb_connection *gdb_con = connection->priv;
@@ -345,6 +385,60 @@ static int gdb_write(struct connection *connection, void *data, int len)
 	return ERROR_SERVER_REMOTE_CLOSED;
 }
 
+/* Waits for GDB to acknowledge the packet just sent. @a resend is set when
+ * GDB asked for the packet to be transmitted again. */
+static int gdb_get_packet_ack(struct connection *connection, bool *resend)
+{
+	struct gdb_connection *gdb_con = connection->priv;
+	int reply;
+	int retval;
+
+	*resend = false;
+
+	retval = gdb_get_char(connection, &reply);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (reply == '+')
+		return ERROR_OK;
+	else if (reply == '-') {
+		/* Stop sending output packets for now */
+		log_remove_callback(gdb_log_callback, connection);
+		LOG_WARNING("negative reply, retrying");
+		*resend = true;
+	} else if (reply == 0x3) {
+		gdb_con->ctrl_c = 1;
+		retval = gdb_get_char(connection, &reply);
+		if (retval != ERROR_OK)
+			return retval;
+		if (reply == '+')
+			return ERROR_OK;
+		else if (reply == '-') {
+			/* Stop sending output packets for now */
+			log_remove_callback(gdb_log_callback, connection);
+			LOG_WARNING("negative reply, retrying");
+			*resend = true;
+		} else if (reply == '$') {
+			LOG_ERROR("GDB missing ack(1) - assumed good");
+			gdb_putback_char(connection, reply);
+		} else {
+			LOG_ERROR("unknown character(1) 0x%2.2x in reply, dropping connection", reply);
+			gdb_con->closed = 1;
+			return ERROR_SERVER_REMOTE_CLOSED;
+		}
+	} else if (reply == '$') {
+		LOG_ERROR("GDB missing ack(2) - assumed good");
+		gdb_putback_char(connection, reply);
+	} else {
+		LOG_ERROR("unknown character(2) 0x%2.2x in reply, dropping connection",
+			reply);
+		gdb_con->closed = 1;
+		return ERROR_SERVER_REMOTE_CLOSED;
+	}
+
+	return ERROR_OK;
+}
+
 static int gdb_put_packet_inner(struct connection *connection,
 		char *buffer, int len)
 {
@@ -352,8 +446,9 @@ static int gdb_put_packet_inner(struct connection *connection,
 	unsigned char my_checksum = 0;
 #ifdef _DEBUG_GDB_IO_
 	char *debug_buffer;
-#endif
 	int reply;
+#endif
+	bool resend;
 	int retval;
 	struct gdb_connection *gdb_con = connection->priv;
 
@@ -398,9 +493,11 @@ static int gdb_put_packet_inner(struct connection *connection,
 		local_buffer[0] = '$';
 		if ((size_t)len + 4 <= sizeof(local_buffer)) {
 			/* performance gain on smaller packets by only a single call to gdb_write() */
-			memcpy(local_buffer + 1, buffer, len++);
-			len += snprintf(local_buffer + len, sizeof(local_buffer) - len, "#%02x", my_checksum);
-			retval = gdb_write(connection, local_buffer, len);
+			memcpy(local_buffer + 1, buffer, len);
+			int framed_len = len + 1;
+			framed_len += snprintf(local_buffer + framed_len,
+					sizeof(local_buffer) - framed_len, "#%02x", my_checksum);
+			retval = gdb_write(connection, local_buffer, framed_len);
 			if (retval != ERROR_OK)
 				return retval;
 		} else {
@@ -421,46 +518,11 @@ static int gdb_put_packet_inner(struct connection *connection,
 		if (gdb_con->noack_mode)
 			break;
 
-		retval = gdb_get_char(connection, &reply);
+		retval = gdb_get_packet_ack(connection, &resend);
 		if (retval != ERROR_OK)
 			return retval;
-
-		if (reply == '+')
+		if (!resend)
 			break;
-		else if (reply == '-') {
-			/* Stop sending output packets for now */
-			log_remove_callback(gdb_log_callback, connection);
-			LOG_WARNING("negative reply, retrying");
-		} else if (reply == 0x3) {
-			gdb_con->ctrl_c = 1;
-			retval = gdb_get_char(connection, &reply);
-			if (retval != ERROR_OK)
-				return retval;
-			if (reply == '+')
-				break;
-			else if (reply == '-') {
-				/* Stop sending output packets for now */
-				log_remove_callback(gdb_log_callback, connection);
-				LOG_WARNING("negative reply, retrying");
-			} else if (reply == '$') {
-				LOG_ERROR("GDB missing ack(1) - assumed good");
-				gdb_putback_char(connection, reply);
-				return ERROR_OK;
-			} else {
-				LOG_ERROR("unknown character(1) 0x%2.2x in reply, dropping connection", reply);
-				gdb_con->closed = 1;
-				return ERROR_SERVER_REMOTE_CLOSED;
-			}
-		} else if (reply == '$') {
-			LOG_ERROR("GDB missing ack(2) - assumed good");
-			gdb_putback_char(connection, reply);
-			return ERROR_OK;
-		} else {
-			LOG_ERROR("unknown character(2) 0x%2.2x in reply, dropping connection",
-				reply);
-			gdb_con->closed = 1;
-			return ERROR_SERVER_REMOTE_CLOSED;
-		}
 	}
 	if (gdb_con->closed)
 		return ERROR_SERVER_REMOTE_CLOSED;
@@ -481,6 +543,119 @@ int gdb_put_packet(struct connection *connection, char *buffer, int len)
 	return retval;
 }
 
+/**
+ * Sends @a count bytes of binary data hex encoded as a single packet.
+ *
+ * The packet is framed, hex encoded and checksummed straight in @a out,
+ * which is then written with a single gdb_write(). @a bin may point into
+ * that same buffer, at or after offset <tt>count + 1</tt>, see
+ * gdb_hex_packet_data().
+ */
+static int gdb_put_hex_packet(struct connection *connection, char *out,
+		const uint8_t *bin, uint32_t count)
+{
+	static const char hex_digits[] = "0123456789abcdef";
+	struct gdb_connection *gdb_con = connection->priv;
+	unsigned char my_checksum = 0;
+	char *p = out;
+	bool resend;
+	int retval;
+
+	*p++ = '$';
+	size_t hex_len = hexify(p, bin, count, 2 * (size_t)count + 1);
+	for (size_t i = 0; i < hex_len; i++)
+		my_checksum += p[i];
+	p += hex_len;
+	*p++ = '#';
+	*p++ = hex_digits[my_checksum >> 4];
+	*p++ = hex_digits[my_checksum & 0xf];
+
+	gdb_con->busy = 1;
+	while (1) {
+		retval = gdb_write(connection, out, p - out);
+		if (retval != ERROR_OK)
+			break;
+
+		if (gdb_con->noack_mode)
+			break;
+
+		retval = gdb_get_packet_ack(connection, &resend);
+		if (retval != ERROR_OK || !resend)
+			break;
+	}
+	gdb_con->busy = 0;
+
+	/* we sent some data, reset timer for keep alive messages */
+	kept_alive();
+
+	if (retval == ERROR_OK && gdb_con->closed)
+		return ERROR_SERVER_REMOTE_CLOSED;
+
+	return retval;
+}
+
+/**
+ * Returns where @a count bytes of binary data can be stored in @a out so
+ * that gdb_put_hex_packet() can encode them in place. The packet grows at
+ * twice the rate the data is consumed, so data placed behind the first
+ * <tt>count + 1</tt> characters is never overwritten before it is read.
+ */
+static inline uint8_t *gdb_hex_packet_data(char *out, uint32_t count)
+{
+	return (uint8_t *)out + count + 1;
+}
+
+/* Size of an output buffer able to hold @a count bytes hex encoded in a
+ * framed packet. */
+#define GDB_HEX_PACKET_SIZE(count) (2 * (count) + 4)
+
+/**
+ * Copies the characters of @a src up to, not including, the first '#' or
+ * '}', but at most @a len of them, into @a dst and adds them to
+ * @a checksum. These plain runs make up the bulk of binary packets and
+ * are handled 16 characters at a time where SSE2 is available.
+ *
+ * @returns The number of characters copied.
+ */
+static inline int gdb_copy_plain_run(char *dst, const char *src, int len,
+		unsigned char *checksum)
+{
+	unsigned int sum = *checksum;
+	int i = 0;
+
+#ifdef __SSE2__
+	const __m128i hash = _mm_set1_epi8('#');
+	const __m128i escape = _mm_set1_epi8('}');
+	const __m128i zero = _mm_setzero_si128();
+
+	while (i + 16 <= len) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+		int special = _mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(in, hash), _mm_cmpeq_epi8(in, escape)));
+		if (special) {
+			/* finish the run character by character below */
+			len = i + __builtin_ctz(special);
+			break;
+		}
+		_mm_storeu_si128((__m128i *)(dst + i), in);
+		__m128i sums = _mm_sad_epu8(in, zero);
+		sum += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+		i += 16;
+	}
+#endif
+
+	for (; i < len; i++) {
+		char character = src[i];
+		if (character == '#' || character == '}')
+			break;
+		dst[i] = character;
+		sum += character & 0xff;
+	}
+
+	*checksum = sum;
+	return i;
+}
+
 static inline int fetch_packet(struct connection *connection,
 		int *checksum_ok, int noack, int *len, char *buffer)
 {
@@ -515,6 +690,14 @@ static inline int fetch_packet(struct connection *connection,
 			i = 0;
 			int done = 0;
 			while (i < run) {
+				int plain = gdb_copy_plain_run(buffer + count, buf, run - i,
+						&my_checksum);
+				buf += plain;
+				i += plain;
+				count += plain;
+				if (i >= run)
+					break;
+
 				character = *buf++;
 				i++;
 				if (character == '#') {
@@ -934,6 +1117,9 @@ static int gdb_new_connection(struct connection *connection)
 	gdb_connection->noack_mode = 0;
 	gdb_connection->sync = false;
 	gdb_connection->mem_write_error = false;
+	gdb_connection->write_buffer = NULL;
+	gdb_connection->write_address = 0;
+	gdb_connection->write_count = 0;
 	gdb_connection->attached = true;
 	gdb_connection->target_desc.tdesc = NULL;
 	gdb_connection->target_desc.tdesc_length = 0;
@@ -1005,6 +1191,32 @@ static int gdb_new_connection(struct connection *connection)
 	return ERROR_OK;
 }
 
+/* Writes data combined from 'X' packets to the target. A failure is
+ * reported to GDB with the next memory write or step/continue. */
+static int gdb_flush_combined_write(struct connection *connection)
+{
+	struct gdb_connection *gdb_connection = connection->priv;
+	int retval = ERROR_OK;
+
+	if (!gdb_connection->write_count)
+		return ERROR_OK;
+
+	LOG_DEBUG("addr: 0x%" PRIx64 ", len: 0x%8.8" PRIx32 "",
+			gdb_connection->write_address, gdb_connection->write_count);
+
+	retval = target_write_buffer(get_target_from_connection(connection),
+			gdb_connection->write_address, gdb_connection->write_count,
+			gdb_connection->write_buffer);
+	if (retval != ERROR_OK)
+		gdb_connection->mem_write_error = true;
+
+	/* remember where the data ended to recognize a continued stream */
+	gdb_connection->write_address += gdb_connection->write_count;
+	gdb_connection->write_count = 0;
+
+	return retval;
+}
+
 static int gdb_connection_closed(struct connection *connection)
 {
 	struct gdb_service *gdb_service = connection->service->priv;
@@ -1021,6 +1233,10 @@ static int gdb_connection_closed(struct connection *connection)
 		target_state_name(gdb_service->target),
 		gdb_actual_connections);
 
+	/* GDB got an OK for this data already */
+	gdb_flush_combined_write(connection);
+	free(gdb_connection->write_buffer);
+
 	/* see if an image built with vFlash commands is left */
 	if (gdb_connection->vflash_image) {
 		image_close(gdb_connection->vflash_image);
@@ -1240,6 +1456,8 @@ static int gdb_set_registers_packet(struct connection *connection,
 	/* free struct reg *reg_list[] array allocated by get_gdb_reg_list */
 	free(reg_list);
 
+	rtos_registers_written(target);
+
 	gdb_put_packet(connection, "OK", 2);
 
 	return ERROR_OK;
@@ -1325,6 +1543,7 @@ static int gdb_set_register_packet(struct connection *connection,
 	gdb_target_to_reg(target, separator + 1, chars, bin_buf);
 
 	reg_list[reg_num]->type->set(reg_list[reg_num], bin_buf);
+	rtos_registers_written(target);
 
 	gdb_put_packet(connection, "OK", 2);
 
@@ -1359,7 +1578,8 @@ static int gdb_read_memory_packet(struct connection *connection,
 	uint32_t len = 0;
 
 	uint8_t *buffer;
-	char *hex_buffer;
+	char *out;
+	char *out_alloc = NULL;
 
 	int retval = ERROR_OK;
 
@@ -1381,7 +1601,22 @@ static int gdb_read_memory_packet(struct connection *connection,
 		return ERROR_OK;
 	}
 
-	buffer = malloc(len);
+	/* Replies up to the size GDB was told about in qSupported are built in
+	 * the connection's output buffer, the target data is read directly into
+	 * its tail and hex encoded in place. Only oversized requests need a
+	 * temporary buffer. */
+	struct gdb_connection *gdb_con = connection->priv;
+	if (GDB_HEX_PACKET_SIZE((size_t)len) <= sizeof(gdb_con->out_buffer))
+		out = gdb_con->out_buffer;
+	else {
+		out_alloc = malloc(GDB_HEX_PACKET_SIZE((size_t)len));
+		if (out_alloc == NULL) {
+			LOG_ERROR("unable to allocate %" PRIu32 " bytes for memory read", len);
+			return gdb_error(connection, ERROR_FAIL);
+		}
+		out = out_alloc;
+	}
+	buffer = gdb_hex_packet_data(out, len);
 
 	LOG_DEBUG("addr: 0x%16.16" PRIx64 ", len: 0x%8.8" PRIx32 "", addr, len);
 
@@ -1405,18 +1640,12 @@ static int gdb_read_memory_packet(struct connection *connection,
 		retval = ERROR_OK;
 	}
 
-	if (retval == ERROR_OK) {
-		hex_buffer = malloc(len * 2 + 1);
-
-		size_t pkt_len = hexify(hex_buffer, buffer, len, len * 2 + 1);
-
-		gdb_put_packet(connection, hex_buffer, pkt_len);
-
-		free(hex_buffer);
-	} else
+	if (retval == ERROR_OK)
+		gdb_put_hex_packet(connection, out, buffer, len);
+	else
 		retval = gdb_error(connection, retval);
 
-	free(buffer);
+	free(out_alloc);
 
 	return retval;
 }
@@ -1501,6 +1730,13 @@ static int gdb_write_memory_binary_packet(struct connection *connection,
 
 	struct gdb_connection *gdb_connection = connection->priv;
 
+	/* data combined from previous packets goes to the target first, unless
+	 * this packet continues it */
+	if (gdb_connection->write_count && (len < fast_limit
+			|| addr != gdb_connection->write_address + gdb_connection->write_count
+			|| gdb_connection->write_count + len > GDB_WRITE_COMBINE_SIZE))
+		gdb_flush_combined_write(connection);
+
 	if (gdb_connection->mem_write_error)
 		retval = ERROR_FAIL;
 
@@ -1522,7 +1758,29 @@ static int gdb_write_memory_binary_packet(struct connection *connection,
 			return retval;
 	}
 
-	if (len) {
+	bool combine = len >= fast_limit && len <= GDB_WRITE_COMBINE_SIZE;
+	if (combine && gdb_connection->write_buffer == NULL) {
+		gdb_connection->write_buffer = malloc(GDB_WRITE_COMBINE_SIZE);
+		combine = gdb_connection->write_buffer != NULL;
+	}
+
+	if (combine) {
+		/* GDB sends the next packet of a download as soon as it got the
+		 * OK above. If it arrives quickly, combine it with this one into
+		 * a larger target write, which saves the per transfer overhead
+		 * of the adapter. Otherwise write what we have. */
+		bool streaming = addr == gdb_connection->write_address
+			+ gdb_connection->write_count;
+		if (!gdb_connection->write_count)
+			gdb_connection->write_address = addr;
+		memcpy(gdb_connection->write_buffer + gdb_connection->write_count,
+				separator, len);
+		gdb_connection->write_count += len;
+
+		if (gdb_connection->write_count + len > GDB_WRITE_COMBINE_SIZE
+				|| !gdb_input_within(connection, streaming ? GDB_WRITE_COMBINE_WAIT_MS : 0))
+			gdb_flush_combined_write(connection);
+	} else if (len) {
 		LOG_DEBUG("addr: 0x%" PRIx64 ", len: 0x%8.8" PRIx32 "", addr, len);
 
 		retval = target_write_buffer(target, addr, len, (uint8_t *)separator);
@@ -2812,6 +3070,11 @@ static int gdb_input_inner(struct connection *connection)
 				LOG_DEBUG("received packet: '%s'", packet);
 		}
 
+		/* anything but another 'X' packet must see the target memory
+		 * written by the previous ones */
+		if (packet_size == 0 || packet[0] != 'X')
+			gdb_flush_combined_write(connection);
+
 		if (packet_size > 0) {
 			retval = ERROR_OK;
 			switch (packet[0]) {
@@ -3008,7 +3271,7 @@ static int gdb_input_inner(struct connection *connection)
 			}
 		}
 
-	} while (gdb_con->buf_cnt > 0);
+	} while (gdb_con->buf_cnt > 0 || gdb_con->write_count);
 
 	return ERROR_OK;
 }
@@ -3017,6 +3280,10 @@ static int gdb_input(struct connection *connection)
 {
 	int retval = gdb_input_inner(connection);
 	struct gdb_connection *gdb_con = connection->priv;
+
+	/* don't leave acknowledged data behind if the input loop bailed out */
+	gdb_flush_combined_write(connection);
+
 	if (retval == ERROR_SERVER_REMOTE_CLOSED)
 		return retval;
 
@@ -44,6 +44,14 @@
 #include <netinet/tcp.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#define SERVER_USE_EPOLL
+#elif defined(HAVE_POLL_H) && !defined(_WIN32)
+#include <poll.h>
+#define SERVER_USE_POLL
+#endif
+
 static struct service *services;
 
 /* shutdown_openocd == 1: exit the main event loop, and quit the
@@ -59,6 +67,217 @@ static int polling_period = 100;
 /* address by name on which to listen for incoming TCP/IP connections */
 static char *bindto_name;
 
+/* File descriptors the event loop waits on. Services and connections
+ * register their fd once, when they are created, instead of having the
+ * wait set rebuilt on every iteration of server_loop(). */
+struct server_watch {
+	int fd;
+	/* false for fds the kernel cannot wait on (e.g. stdin redirected
+	 * from a regular file); those are always reported as readable */
+	bool waitable;
+};
+
+static struct server_watch *watches;
+static unsigned int watch_count;
+static unsigned int watch_alloc;
+
+/* readiness of the last server_wait_events(), indexed by fd */
+static bool *fd_ready;
+static int fd_ready_size;
+
+#if defined(SERVER_USE_EPOLL)
+#define SERVER_MAX_EVENTS 64
+static int epoll_fd = -1;
+#elif defined(SERVER_USE_POLL)
+static struct pollfd *poll_fds;
+#endif
+
+static int server_watch_fd(int fd)
+{
+	if (fd < 0)
+		return ERROR_OK;
+
+	if (fd >= fd_ready_size) {
+		int size = fd_ready_size ? fd_ready_size : 64;
+		while (size <= fd)
+			size *= 2;
+		bool *ready = realloc(fd_ready, size * sizeof(*ready));
+		if (ready == NULL)
+			return ERROR_FAIL;
+		memset(ready + fd_ready_size, 0, (size - fd_ready_size) * sizeof(*ready));
+		fd_ready = ready;
+		fd_ready_size = size;
+	}
+
+	if (watch_count == watch_alloc) {
+		unsigned int alloc = watch_alloc ? watch_alloc * 2 : 16;
+		struct server_watch *w = realloc(watches, alloc * sizeof(*w));
+		if (w == NULL)
+			return ERROR_FAIL;
+		watches = w;
+#ifdef SERVER_USE_POLL
+		struct pollfd *p = realloc(poll_fds, alloc * sizeof(*p));
+		if (p == NULL)
+			return ERROR_FAIL;
+		poll_fds = p;
+#endif
+		watch_alloc = alloc;
+	}
+
+	struct server_watch *w = &watches[watch_count];
+	w->fd = fd;
+	w->waitable = true;
+
+#if defined(SERVER_USE_EPOLL)
+	if (epoll_fd == -1) {
+		epoll_fd = epoll_create(SERVER_MAX_EVENTS);
+		if (epoll_fd == -1) {
+			LOG_ERROR("error creating epoll instance: %s", strerror(errno));
+			return ERROR_FAIL;
+		}
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		if (errno != EPERM) {
+			LOG_ERROR("error adding fd %d to epoll: %s", fd, strerror(errno));
+			return ERROR_FAIL;
+		}
+		w->waitable = false;
+	}
+#elif defined(SERVER_USE_POLL)
+	poll_fds[watch_count].fd = fd;
+	poll_fds[watch_count].events = POLLIN;
+	poll_fds[watch_count].revents = 0;
+#endif
+
+	watch_count++;
+	return ERROR_OK;
+}
+
+static void server_unwatch_fd(int fd)
+{
+	if (fd < 0)
+		return;
+
+	for (unsigned int i = 0; i < watch_count; i++) {
+		if (watches[i].fd != fd)
+			continue;
+
+#if defined(SERVER_USE_EPOLL)
+		if (watches[i].waitable)
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#elif defined(SERVER_USE_POLL)
+		poll_fds[i] = poll_fds[watch_count - 1];
+#endif
+		watches[i] = watches[watch_count - 1];
+		watch_count--;
+		fd_ready[fd] = false;
+		return;
+	}
+}
+
+static void server_unwatch_all(void)
+{
+#if defined(SERVER_USE_EPOLL)
+	if (epoll_fd != -1) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+#elif defined(SERVER_USE_POLL)
+	free(poll_fds);
+	poll_fds = NULL;
+#endif
+	free(watches);
+	watches = NULL;
+	watch_count = 0;
+	watch_alloc = 0;
+	free(fd_ready);
+	fd_ready = NULL;
+	fd_ready_size = 0;
+}
+
+static bool server_fd_ready(int fd)
+{
+	return fd >= 0 && fd < fd_ready_size && fd_ready[fd];
+}
+
+/* Waits up to timeout_ms for input on the registered fds and records
+ * which of them became readable. Returns the number of ready fds, 0 on
+ * timeout or -1 on error, like select(). */
+static int server_wait_events(int timeout_ms)
+{
+	int retval;
+
+	if (fd_ready)
+		memset(fd_ready, 0, fd_ready_size * sizeof(*fd_ready));
+
+#if defined(SERVER_USE_EPOLL)
+	int always_ready = 0;
+	for (unsigned int i = 0; i < watch_count; i++) {
+		if (!watches[i].waitable) {
+			fd_ready[watches[i].fd] = true;
+			always_ready++;
+		}
+	}
+
+	if (epoll_fd == -1) {
+		if (!always_ready && timeout_ms > 0)
+			usleep(timeout_ms * 1000);
+		return always_ready;
+	}
+
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	retval = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS,
+			always_ready ? 0 : timeout_ms);
+	if (retval == -1)
+		return always_ready ? always_ready : -1;
+
+	for (int i = 0; i < retval; i++)
+		fd_ready[events[i].data.fd] = true;
+
+	return retval + always_ready;
+#elif defined(SERVER_USE_POLL)
+	retval = poll(poll_fds, watch_count, timeout_ms);
+	if (retval <= 0)
+		return retval;
+
+	for (unsigned int i = 0; i < watch_count; i++) {
+		if (poll_fds[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))
+			fd_ready[poll_fds[i].fd] = true;
+	}
+
+	return retval;
+#else
+	fd_set read_fds;
+	int fd_max = 0;
+	struct timeval tv;
+
+	FD_ZERO(&read_fds);
+	for (unsigned int i = 0; i < watch_count; i++) {
+		FD_SET(watches[i].fd, &read_fds);
+		if (watches[i].fd > fd_max)
+			fd_max = watches[i].fd;
+	}
+
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	retval = socket_select(fd_max + 1, &read_fds, NULL, NULL, &tv);
+	if (retval <= 0)
+		return retval;
+
+	for (unsigned int i = 0; i < watch_count; i++) {
+		if (FD_ISSET(watches[i].fd, &read_fds))
+			fd_ready[watches[i].fd] = true;
+	}
+
+	return retval;
+#endif
+}
+
 static int add_connection(struct service *service, struct command_context *cmd_ctx)
 {
 	socklen_t address_size;
@@ -147,6 +366,17 @@ static int add_connection(struct service *service, struct command_context *cmd_c
 		}
 	}
 
+	/* stdin and pipe connections inherit the fd the service was
+	 * already watching, only accepted sockets are new */
+	if (service->type == CONNECTION_TCP && server_watch_fd(c->fd) != ERROR_OK) {
+		LOG_ERROR("cannot watch '%s' connection", service->name);
+		service->connection_closed(c);
+		close_socket(c->fd);
+		command_done(c->cmd_ctx);
+		free(c);
+		return ERROR_FAIL;
+	}
+
 	/* add to the end of linked list */
 	for (p = &service->connections; *p; p = &(*p)->next)
 		;
@@ -167,8 +397,11 @@ static int remove_connection(struct service *service, struct connection *connect
 	while ((c = *p)) {
 		if (c->fd == connection->fd) {
 			service->connection_closed(c);
-			if (service->type == CONNECTION_TCP)
+			if (service->type == CONNECTION_TCP) {
+				server_unwatch_fd(c->fd);
 				close_socket(c->fd);
+			} else if (service->type == CONNECTION_STDINOUT)
+				server_unwatch_fd(c->fd);
 			else if (service->type == CONNECTION_PIPE) {
 				/* The service will listen to the pipe again */
 				c->service->fd = c->fd;
@@ -330,6 +563,16 @@ int add_service(char *name,
 #endif
 	}
 
+	if (server_watch_fd(c->fd) != ERROR_OK) {
+		LOG_ERROR("cannot watch '%s' service", name);
+		if (c->type == CONNECTION_TCP)
+			close_socket(c->fd);
+		else if (c->type == CONNECTION_PIPE)
+			close(c->fd);
+		free_service(c);
+		return ERROR_FAIL;
+	}
+
 	/* add to the end of linked list */
 	for (p = &services; *p; p = &(*p)->next)
 		;
@@ -338,6 +581,37 @@ int add_service(char *name,
 	return ERROR_OK;
 }
 
+int remove_service(const char *name, const char *port)
+{
+	struct service **p = &services;
+	struct service *c;
+
+	while ((c = *p)) {
+		if (strcmp(c->name, name) != 0 || strcmp(c->port, port) != 0) {
+			p = &c->next;
+			continue;
+		}
+
+		while (c->connections)
+			remove_connection(c, c->connections);
+
+		if (c->type == CONNECTION_TCP) {
+			server_unwatch_fd(c->fd);
+			close_socket(c->fd);
+		} else if (c->type == CONNECTION_PIPE && c->fd != -1) {
+			server_unwatch_fd(c->fd);
+			close(c->fd);
+		}
+
+		*p = c->next;
+		free(c->priv);
+		free_service(c);
+		return ERROR_OK;
+	}
+
+	return ERROR_FAIL;
+}
+
 static int remove_services(void)
 {
 	struct service *c = services;
@@ -367,6 +641,7 @@ static int remove_services(void)
 	}
 
 	services = NULL;
+	server_unwatch_all();
 
 	return ERROR_OK;
 }
@@ -377,59 +652,36 @@ int server_loop(struct command_context *command_context)
 
 	bool poll_ok = true;
 
-	/* used in select() */
-	fd_set read_fds;
-	int fd_max;
-
 	/* used in accept() */
 	int retval;
 
+	int64_t next_event = timeval_ms() + polling_period;
+
 #ifndef _WIN32
 	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
 		LOG_ERROR("couldn't set SIGPIPE to SIG_IGN");
 #endif
 
 	while (!shutdown_openocd) {
-		/* monitor sockets for activity */
-		fd_max = 0;
-		FD_ZERO(&read_fds);
-
-		/* add service and connection fds to read_fds */
-		for (service = services; service; service = service->next) {
-			if (service->fd != -1) {
-				/* listen for new connections */
-				FD_SET(service->fd, &read_fds);
-
-				if (service->fd > fd_max)
-					fd_max = service->fd;
-			}
-
-			if (service->connections) {
-				struct connection *c;
-
-				for (c = service->connections; c; c = c->next) {
-					/* check for activity on the connection */
-					FD_SET(c->fd, &read_fds);
-					if (c->fd > fd_max)
-						fd_max = c->fd;
-				}
-			}
-		}
+		/* write out what was logged while handling the last events */
+		log_flush();
 
-		struct timeval tv;
-		tv.tv_sec = 0;
 		if (poll_ok) {
 			/* we're just polling this iteration, this is faster on embedded
 			 * hosts */
-			tv.tv_usec = 0;
-			retval = socket_select(fd_max + 1, &read_fds, NULL, NULL, &tv);
+			retval = server_wait_events(0);
 		} else {
-			/* Every 100ms, can be changed with "poll_period" command */
-			tv.tv_usec = polling_period * 1000;
+			/* Sleep until the next timer callback is due, but at most
+			 * every 100ms, can be changed with "poll_period" command */
+			int64_t timeout_ms = next_event - timeval_ms();
+			if (timeout_ms < 0)
+				timeout_ms = 0;
+			else if (timeout_ms > polling_period)
+				timeout_ms = polling_period;
 			/* Only while we're sleeping we'll let others run */
 			openocd_sleep_prelude();
 			kept_alive();
-			retval = socket_select(fd_max + 1, &read_fds, NULL, NULL, &tv);
+			retval = server_wait_events((int)timeout_ms);
 			openocd_sleep_postlude();
 		}
 
@@ -439,7 +691,7 @@ int server_loop(struct command_context *command_context)
 			errno = WSAGetLastError();
 
 			if (errno == WSAEINTR)
-				FD_ZERO(&read_fds);
+				retval = 0;
 			else {
 				LOG_ERROR("error during select: %s", strerror(errno));
 				return ERROR_FAIL;
@@ -447,21 +699,23 @@ int server_loop(struct command_context *command_context)
 #else
 
 			if (errno == EINTR)
-				FD_ZERO(&read_fds);
+				retval = 0;
 			else {
-				LOG_ERROR("error during select: %s", strerror(errno));
+				LOG_ERROR("error waiting for events: %s", strerror(errno));
 				return ERROR_FAIL;
 			}
 #endif
 		}
 
-		if (retval == 0) {
-			/* We only execute these callbacks when there was nothing to do or we timed
-			 *out */
+		/* Timer callbacks run as soon as they are due, even while the
+		 * connections keep us busy, so their latency stays bounded. */
+		if (retval == 0 || timeval_ms() >= next_event) {
 			target_call_timer_callbacks();
-			process_jim_events(command_context);
+			next_event = target_timer_next_event();
+		}
 
-			FD_ZERO(&read_fds);	/* eCos leaves read_fds unchanged in this case!  */
+		if (retval == 0) {
+			process_jim_events(command_context);
 
 			/* We timed out/there was nothing to do, timeout rather than poll next time
 			 **/
@@ -481,7 +735,7 @@ int server_loop(struct command_context *command_context)
 		for (service = services; service; service = service->next) {
 			/* handle new connections on listeners */
 			if ((service->fd != -1)
-			    && (FD_ISSET(service->fd, &read_fds))) {
+			    && server_fd_ready(service->fd)) {
 				if (service->max_connections != 0)
 					add_connection(service, command_context);
 				else {
@@ -505,7 +759,7 @@ int server_loop(struct command_context *command_context)
 				struct connection *c;
 
 				for (c = service->connections; c; ) {
-					if ((FD_ISSET(c->fd, &read_fds)) || c->input_pending) {
+					if (server_fd_ready(c->fd) || c->input_pending) {
 						retval = service->input(c);
 						if (retval != ERROR_OK) {
 							struct connection *next = c->next;
@@ -704,7 +958,8 @@ static const struct command_registration server_command_handlers[] = {
 		.handler = &handle_poll_period_command,
 		.mode = COMMAND_ANY,
 		.usage = "",
-		.help = "set the servers polling period",
+		.help = "set the longest time the server sleeps waiting "
+			"for connection activity (ms)",
 	},
 	{
 		.name = "bindto",
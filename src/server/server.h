@@ -75,6 +75,12 @@ int add_service(char *name, const char *port,
 		input_handler_t in_handler, connection_closed_handler_t close_handler,
 		void *priv);
 
+/**
+ * Close a service previously created by add_service(), together with all
+ * of its connections.  The service's @a priv is freed.
+ */
+int remove_service(const char *name, const char *port);
+
 int server_preinit(void);
 int server_init(struct command_context *cmd_ctx);
 int server_quit(void);
@@ -27,6 +27,7 @@
 #define TCL_SERVER_VERSION		"TCL Server 0.1"
 #define TCL_LINE_INITIAL		(4*1024)
 #define TCL_LINE_MAX			(4*1024*1024)
+#define TCL_BATCH_READ_MAX		(1024*1024)
 
 struct tcl_connection {
 	int tc_linedrop;
@@ -327,6 +328,125 @@ COMMAND_HANDLER(handle_tcl_trace_command)
 	}
 }
 
+/* Check one mem_batch operation and return the bytes it transfers */
+static COMMAND_HELPER(tcl_mem_batch_parse, unsigned int i,
+		bool *is_read, target_addr_t *address, unsigned int *width, uint32_t *len)
+{
+	const char *op = CMD_ARGV[i];
+
+	if (!strcmp(op, "r"))
+		*is_read = true;
+	else if (!strcmp(op, "w"))
+		*is_read = false;
+	else {
+		LOG_ERROR("mem_batch: unknown operation '%s'", op);
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	}
+
+	COMMAND_PARSE_ADDRESS(CMD_ARGV[i + 1], *address);
+	COMMAND_PARSE_NUMBER(uint, CMD_ARGV[i + 2], *width);
+	if (*width != 1 && *width != 2 && *width != 4) {
+		LOG_ERROR("mem_batch: width must be 1, 2 or 4");
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+	if (*address % *width) {
+		LOG_ERROR("mem_batch: address " TARGET_ADDR_FMT " is not aligned for %u byte access",
+				*address, *width);
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+
+	if (*is_read) {
+		uint32_t count;
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[i + 3], count);
+		if (count == 0 || count > TCL_BATCH_READ_MAX / *width) {
+			LOG_ERROR("mem_batch: read count must be between 1 and %u",
+					TCL_BATCH_READ_MAX / *width);
+			return ERROR_COMMAND_ARGUMENT_INVALID;
+		}
+		*len = count * *width;
+	} else {
+		const char *data = CMD_ARGV[i + 3];
+		size_t hex_len = strlen(data);
+		if (strspn(data, "0123456789abcdefABCDEF") != hex_len) {
+			LOG_ERROR("mem_batch: write data '%s' is not a hex string", data);
+			return ERROR_COMMAND_ARGUMENT_INVALID;
+		}
+		if (hex_len == 0 || hex_len % (2 * *width)) {
+			LOG_ERROR("mem_batch: write data must be a whole number of %u byte items", *width);
+			return ERROR_COMMAND_ARGUMENT_INVALID;
+		}
+		if (hex_len / 2 > TCL_BATCH_READ_MAX) {
+			LOG_ERROR("mem_batch: write data exceeds %u bytes", TCL_BATCH_READ_MAX);
+			return ERROR_COMMAND_ARGUMENT_INVALID;
+		}
+		*len = hex_len / 2;
+	}
+
+	return ERROR_OK;
+}
+
+/* Run a list of memory reads and writes in one command, so that scripts
+ * poking many registers pay for one command evaluation and one socket
+ * round trip instead of one per access.  Read results are returned as
+ * hex strings of the bytes in target memory order, one line per read. */
+COMMAND_HANDLER(handle_tcl_mem_batch_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	bool is_read;
+	target_addr_t address;
+	unsigned int width;
+	uint32_t len, max_len = 0;
+	int retval;
+
+	if (CMD_ARGC == 0 || CMD_ARGC % 4)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	/* reject malformed batches before touching the target */
+	for (unsigned int i = 0; i < CMD_ARGC; i += 4) {
+		retval = CALL_COMMAND_HANDLER(tcl_mem_batch_parse, i,
+				&is_read, &address, &width, &len);
+		if (retval != ERROR_OK)
+			return retval;
+		if (len > max_len)
+			max_len = len;
+	}
+
+	uint8_t *buffer = malloc(max_len);
+	char *hex = malloc(2 * max_len + 1);
+	if (!buffer || !hex) {
+		LOG_ERROR("mem_batch: out of memory");
+		free(buffer);
+		free(hex);
+		return ERROR_FAIL;
+	}
+
+	for (unsigned int i = 0; i < CMD_ARGC; i += 4) {
+		CALL_COMMAND_HANDLER(tcl_mem_batch_parse, i, &is_read, &address, &width, &len);
+
+		if (is_read) {
+			retval = target_read_memory(target, address, width, len / width, buffer);
+			if (retval == ERROR_OK) {
+				hexify(hex, buffer, len, 2 * max_len + 1);
+				command_print(CMD_CTX, "%s", hex);
+			}
+		} else {
+			unhexify(buffer, CMD_ARGV[i + 3], len);
+			retval = target_write_memory(target, address, width, len / width, buffer);
+		}
+
+		if (retval != ERROR_OK) {
+			LOG_ERROR("mem_batch: %s of %" PRIu32 " bytes at " TARGET_ADDR_FMT
+					" (operation %u) failed", is_read ? "read" : "write",
+					len, address, i / 4);
+			break;
+		}
+	}
+
+	free(buffer);
+	free(hex);
+	return retval;
+}
+
 static const struct command_registration tcl_command_handlers[] = {
 	{
 		.name = "tcl_port",
@@ -351,6 +471,14 @@ static const struct command_registration tcl_command_handlers[] = {
 		.help = "Target trace output",
 		.usage = "[on|off]",
 	},
+	{
+		.name = "mem_batch",
+		.handler = handle_tcl_mem_batch_command,
+		.mode = COMMAND_EXEC,
+		.help = "Run a list of memory reads and writes on the current "
+			"target, returning the data read as hex strings",
+		.usage = "(('r' address width count) | ('w' address width hex_data))...",
+	},
 	COMMAND_REGISTRATION_DONE
 };
 
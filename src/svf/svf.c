@@ -224,6 +224,11 @@ static size_t svf_command_buffer_size;
 static int svf_line_number;
 static int svf_getline(char **lineptr, size_t *n, FILE *stream);
 
+/* The file is read in large chunks, lines are cut out of them */
+#define SVF_READ_CHUNK_SIZE   (64 * 1024)
+static char *svf_read_chunk;
+static size_t svf_read_chunk_pos, svf_read_chunk_len;
+
 #define SVF_MAX_BUFFER_SIZE_TO_COMMIT   (1024 * 1024)
 static uint8_t *svf_tdi_buffer, *svf_tdo_buffer, *svf_mask_buffer;
 static int svf_buffer_index, svf_buffer_size ;
@@ -419,6 +424,15 @@ COMMAND_HANDLER(handle_svf_command)
 	svf_line_number = 0;
 	svf_command_buffer_size = 0;
 
+	svf_read_chunk_pos = 0;
+	svf_read_chunk_len = 0;
+	svf_read_chunk = malloc(SVF_READ_CHUNK_SIZE);
+	if (NULL == svf_read_chunk) {
+		LOG_ERROR("not enough memory");
+		ret = ERROR_FAIL;
+		goto free_all;
+	}
+
 	svf_check_tdo_para_index = 0;
 	svf_check_tdo_para = malloc(sizeof(struct svf_check_tdo_para) * SVF_CHECK_TDO_PARA_SIZE);
 	if (NULL == svf_check_tdo_para) {
@@ -490,10 +504,15 @@ COMMAND_HANDLER(handle_svf_command)
 
 	if (svf_progress_enabled) {
 		/* Count total lines in file. */
-		while (!feof(svf_fd)) {
-			svf_getline(&svf_command_buffer, &svf_command_buffer_size, svf_fd);
-			svf_total_lines++;
+		svf_total_lines = 1;
+		while ((svf_read_chunk_len = fread(svf_read_chunk, 1, SVF_READ_CHUNK_SIZE, svf_fd)) > 0) {
+			const char *p = svf_read_chunk, *end = svf_read_chunk + svf_read_chunk_len;
+			while ((p = memchr(p, '\n', end - p)) != NULL) {
+				svf_total_lines++;
+				p++;
+			}
 		}
+		svf_read_chunk_len = 0;
 		rewind(svf_fd);
 	}
 	while (ERROR_OK == svf_read_command_from_file(svf_fd)) {
@@ -546,6 +565,10 @@ free_all:
 	svf_fd = 0;
 
 	/* free buffers */
+	if (svf_read_chunk) {
+		free(svf_read_chunk);
+		svf_read_chunk = NULL;
+	}
 	if (svf_command_buffer) {
 		free(svf_command_buffer);
 		svf_command_buffer = NULL;
@@ -591,34 +614,51 @@ free_all:
 	return ret;
 }
 
+/* Copy the next line, including its '\n', from the read chunk to *lineptr.
+ * Returns the line length, or -1 at end of file. */
 static int svf_getline(char **lineptr, size_t *n, FILE *stream)
 {
-#define MIN_CHUNK 16	/* Buffer is increased by this size each time as required */
+#define MIN_CHUNK 256	/* Initial line buffer size, doubled as required */
 	size_t i = 0;
 
-	if (*lineptr == NULL) {
-		*n = MIN_CHUNK;
-		*lineptr = malloc(*n);
-		if (!*lineptr)
-			return -1;
+	for (;;) {
+		if (svf_read_chunk_pos == svf_read_chunk_len) {
+			svf_read_chunk_pos = 0;
+			svf_read_chunk_len = fread(svf_read_chunk, 1, SVF_READ_CHUNK_SIZE, stream);
+			if (svf_read_chunk_len == 0)
+				break;
+		}
+
+		const char *start = svf_read_chunk + svf_read_chunk_pos;
+		size_t avail = svf_read_chunk_len - svf_read_chunk_pos;
+		const char *eol = memchr(start, '\n', avail);
+		size_t count = eol ? (size_t)(eol - start) + 1 : avail;
+
+		if (*lineptr == NULL || i + count + 1 > *n) {
+			size_t new_n = MAX(*lineptr ? *n * 2 : MIN_CHUNK, i + count + 1);
+			char *new_line = realloc(*lineptr, new_n);
+			if (!new_line)
+				return -1;
+			*lineptr = new_line;
+			*n = new_n;
+		}
+
+		memcpy(*lineptr + i, start, count);
+		i += count;
+		svf_read_chunk_pos += count;
+		if (eol)
+			break;
 	}
 
-	(*lineptr)[0] = fgetc(stream);
-	while ((*lineptr)[i] != '\n') {
-		(*lineptr)[++i] = fgetc(stream);
-		if (feof(stream)) {
+	if (i == 0) {
+		if (*lineptr)
 			(*lineptr)[0] = 0;
-			return -1;
-		}
-		if ((i + 2) > *n) {
-			*n += MIN_CHUNK;
-			*lineptr = realloc(*lineptr, *n);
-		}
+		return -1;
 	}
 
-	(*lineptr)[++i] = 0;
+	(*lineptr)[i] = 0;
 
-	return sizeof(*lineptr);
+	return i;
 }
 
 #define SVFP_CMD_INC_CNT 1024
@@ -680,12 +720,14 @@ static int svf_read_command_from_file(FILE *fd)
 				 *  - terminating NUL ('\0')
 				 */
 				if (cmd_pos + 3 > svf_command_buffer_size) {
-					svf_command_buffer = realloc(svf_command_buffer, cmd_pos + 3);
-					svf_command_buffer_size = cmd_pos + 3;
-					if (svf_command_buffer == NULL) {
+					size_t new_size = MAX(svf_command_buffer_size * 2, SVFP_CMD_INC_CNT);
+					char *new_buffer = realloc(svf_command_buffer, new_size);
+					if (new_buffer == NULL) {
 						LOG_ERROR("not enough memory");
 						return ERROR_FAIL;
 					}
+					svf_command_buffer = new_buffer;
+					svf_command_buffer_size = new_size;
 				}
 
 				/* insert a space before '(' */
@@ -153,36 +153,51 @@ static void log_dap_cmd(const char *header, struct dap_cmd *el)
 #endif
 }
 
-static struct dap_cmd *dap_cmd_new(uint8_t instr,
+/* number of dap_cmd entries allocated at once when the pool runs dry */
+#define DAP_CMD_POOL_BLOCK 256
+
+static struct dap_cmd *dap_cmd_new(struct adiv5_dap *dap, uint8_t instr,
 		uint8_t reg_addr, uint8_t RnW,
 		uint8_t *outvalue, uint8_t *invalue,
 		uint32_t memaccess_tck)
 {
 	struct dap_cmd *cmd;
 
-	cmd = (struct dap_cmd *)calloc(1, sizeof(struct dap_cmd));
-	if (cmd != NULL) {
-		INIT_LIST_HEAD(&cmd->lh);
-		cmd->instr = instr;
-		cmd->reg_addr = reg_addr;
-		cmd->RnW = RnW;
-		if (outvalue != NULL)
-			memcpy(cmd->outvalue_buf, outvalue, 4);
-		cmd->invalue = (invalue != NULL) ? invalue : cmd->invalue_buf;
-		cmd->memaccess_tck = memaccess_tck;
+	/* Journal entries are taken from a pool which is only ever grown, so
+	 * a steady stream of transactions doesn't malloc/free one each.
+	 */
+	if (list_empty(&dap->cmd_pool)) {
+		struct dap_cmd *block = calloc(DAP_CMD_POOL_BLOCK, sizeof(struct dap_cmd));
+		if (block == NULL)
+			return NULL;
+		for (int i = 0; i < DAP_CMD_POOL_BLOCK; i++)
+			list_add_tail(&block[i].lh, &dap->cmd_pool);
 	}
 
+	cmd = list_first_entry(&dap->cmd_pool, struct dap_cmd, lh);
+	list_del(&cmd->lh);
+
+	memset(cmd, 0, sizeof(struct dap_cmd));
+	INIT_LIST_HEAD(&cmd->lh);
+	cmd->instr = instr;
+	cmd->reg_addr = reg_addr;
+	cmd->RnW = RnW;
+	if (outvalue != NULL)
+		memcpy(cmd->outvalue_buf, outvalue, 4);
+	cmd->invalue = (invalue != NULL) ? invalue : cmd->invalue_buf;
+	cmd->memaccess_tck = memaccess_tck;
+
 	return cmd;
 }
 
-static void flush_journal(struct list_head *lh)
+static void dap_cmd_release(struct adiv5_dap *dap, struct dap_cmd *cmd)
 {
-	struct dap_cmd *el, *tmp;
+	list_add(&cmd->lh, &dap->cmd_pool);
+}
 
-	list_for_each_entry_safe(el, tmp, lh, lh) {
-		list_del(&el->lh);
-		free(el);
-	}
+static void flush_journal(struct adiv5_dap *dap, struct list_head *lh)
+{
+	list_splice_init(lh, &dap->cmd_pool);
 }
 
 /***************************************************************************
@@ -273,15 +288,18 @@ static int adi_jtag_dp_scan(struct adiv5_dap *dap,
 	struct dap_cmd *cmd;
 	int retval;
 
-	cmd = dap_cmd_new(instr, reg_addr, RnW, outvalue, invalue, memaccess_tck);
+	cmd = dap_cmd_new(dap, instr, reg_addr, RnW, outvalue, invalue, memaccess_tck);
 	if (cmd != NULL)
 		cmd->dp_select = dap->select;
 	else
 		return ERROR_JTAG_DEVICE_ERROR;
 
 	retval = adi_jtag_dp_scan_cmd(dap, cmd, ack);
-	if (retval == ERROR_OK)
+	if (retval == ERROR_OK) {
 		list_add_tail(&cmd->lh,	&dap->cmd_journal);
+		dap->wait_stats.transactions++;
+	} else
+		dap_cmd_release(dap, cmd);
 
 	return retval;
 }
@@ -415,12 +433,14 @@ static int jtagdp_overrun_check(struct adiv5_dap *dap)
 				* To complete the READ, we just keep polling RDBUFF
 				* until the WAIT condition clears
 				*/
-				tmp = dap_cmd_new(JTAG_DP_DPACC,
+				tmp = dap_cmd_new(dap, JTAG_DP_DPACC,
 						DP_RDBUFF, DPAP_READ, NULL, NULL, 0);
 				if (tmp == NULL) {
 					retval = ERROR_JTAG_DEVICE_ERROR;
 					goto done;
 				}
+				dap->wait_stats.read_recoveries++;
+
 				/* synchronously retry the command until it succeeds */
 				time_now = timeval_ms();
 				do {
@@ -448,6 +468,7 @@ static int jtagdp_overrun_check(struct adiv5_dap *dap)
 					/* timeout happened */
 					if (tmp->ack != JTAG_ACK_OK_FAULT) {
 						LOG_ERROR("Timeout during WAIT recovery");
+						dap->wait_stats.timeouts++;
 						dap->select = DP_SELECT_INVALID;
 						jtag_ap_q_abort(dap, NULL);
 						/* clear the sticky overrun condition */
@@ -459,7 +480,7 @@ static int jtagdp_overrun_check(struct adiv5_dap *dap)
 				}
 
 				/* we're done with this command, release it */
-				free(tmp);
+				dap_cmd_release(dap, tmp);
 
 				if (retval != ERROR_OK)
 					goto done;
@@ -476,14 +497,16 @@ static int jtagdp_overrun_check(struct adiv5_dap *dap)
 	list_for_each_entry_safe_from(el, tmp, &dap->cmd_journal, lh) {
 		log_dap_cmd("REP", el);
 		list_move_tail(&el->lh, &replay_list);
+		dap->wait_stats.replayed++;
 	}
 
 	/* we're done with the journal, flush it */
-	flush_journal(&dap->cmd_journal);
+	flush_journal(dap, &dap->cmd_journal);
 
 	/* check for overrun condition in the last batch of transactions */
 	if (found_wait) {
 		LOG_INFO("DAP transaction stalled (WAIT) - slowing down");
+		dap->wait_stats.stalls++;
 		/* clear the sticky overrun condition */
 		retval = adi_jtag_scan_inout_check_u32(dap, JTAG_DP_DPACC,
 				DP_CTRL_STAT, DPAP_WRITE,
@@ -494,7 +517,7 @@ static int jtagdp_overrun_check(struct adiv5_dap *dap)
 		/* restore SELECT register first */
 		if (!list_empty(&replay_list)) {
 			el = list_first_entry(&replay_list, struct dap_cmd, lh);
-			tmp = dap_cmd_new(JTAG_DP_DPACC,
+			tmp = dap_cmd_new(dap, JTAG_DP_DPACC,
 					  DP_SELECT, DPAP_WRITE, (uint8_t *)&el->dp_select, NULL, 0);
 			if (tmp == NULL) {
 				retval = ERROR_JTAG_DEVICE_ERROR;
@@ -525,11 +548,13 @@ static int jtagdp_overrun_check(struct adiv5_dap *dap)
 					retval = ERROR_JTAG_DEVICE_ERROR;
 					break;
 				}
+				dap->wait_stats.replay_waits++;
 			} while (timeval_ms() - time_now < 1000);
 
 			if (retval == ERROR_OK) {
 				if (el->ack != JTAG_ACK_OK_FAULT) {
 					LOG_ERROR("Timeout during WAIT recovery");
+					dap->wait_stats.timeouts++;
 					dap->select = DP_SELECT_INVALID;
 					jtag_ap_q_abort(dap, NULL);
 					/* clear the sticky overrun condition */
@@ -545,8 +570,8 @@ static int jtagdp_overrun_check(struct adiv5_dap *dap)
 	}
 
  done:
-	flush_journal(&replay_list);
-	flush_journal(&dap->cmd_journal);
+	flush_journal(dap, &replay_list);
+	flush_journal(dap, &dap->cmd_journal);
 	return retval;
 }
 
@@ -592,7 +617,7 @@ static int jtagdp_transaction_endcheck(struct adiv5_dap *dap)
 	}
 
  done:
-	flush_journal(&dap->cmd_journal);
+	flush_journal(dap, &dap->cmd_journal);
 	return retval;
 }
 
@@ -587,6 +587,7 @@ struct adiv5_dap *dap_init(void)
 		dap->ap[i].tar_autoincr_block = (1<<10);
 	}
 	INIT_LIST_HEAD(&dap->cmd_journal);
+	INIT_LIST_HEAD(&dap->cmd_pool);
 	return dap;
 }
 
@@ -1483,6 +1484,31 @@ COMMAND_HANDLER(dap_memaccess_command)
 	return ERROR_OK;
 }
 
+COMMAND_HANDLER(dap_waitstats_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	struct arm *arm = target_to_arm(target);
+	struct adiv5_dap *dap = arm->dap;
+	struct adiv5_wait_stats *stats = &dap->wait_stats;
+
+	if (CMD_ARGC == 1) {
+		if (strcmp(CMD_ARGV[0], "reset") != 0)
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		memset(stats, 0, sizeof(*stats));
+		return ERROR_OK;
+	} else if (CMD_ARGC != 0)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	command_print(CMD_CTX, "%" PRIu64 " transactions, %u stalled by WAIT, "
+			"%" PRIu64 " replayed",
+			stats->transactions, stats->stalls, stats->replayed);
+	command_print(CMD_CTX, "%" PRIu64 " WAIT responses while replaying, "
+			"%u posted reads recovered, %u timeouts",
+			stats->replay_waits, stats->read_recoveries, stats->timeouts);
+
+	return ERROR_OK;
+}
+
 COMMAND_HANDLER(dap_apsel_command)
 {
 	struct target *target = get_current_target(CMD_CTX);
@@ -1711,6 +1737,13 @@ static const struct command_registration dap_commands[] = {
 			"bus access [0-255]",
 		.usage = "[cycles]",
 	},
+	{
+		.name = "waitstats",
+		.handler = dap_waitstats_command,
+		.mode = COMMAND_EXEC,
+		.help = "show or reset statistics of the JTAG-DP WAIT recovery",
+		.usage = "['reset']",
+	},
 	{
 		.name = "ti_be_32_quirks",
 		.handler = dap_ti_be_32_quirks_command,
@@ -183,6 +183,19 @@ struct adiv5_ap {
 };
 
 
+/**
+ * Counters of the WAIT recovery of the JTAG-DP transport. They show how
+ * often the memaccess delay of an AP is too short for the bus behind it.
+ */
+struct adiv5_wait_stats {
+	uint64_t transactions;		/* DP/AP accesses queued */
+	unsigned int stalls;		/* batches which ran into a WAIT response */
+	uint64_t replayed;		/* accesses replayed after a WAIT */
+	unsigned int read_recoveries;	/* posted reads recovered by polling RDBUFF */
+	uint64_t replay_waits;		/* WAIT responses while replaying */
+	unsigned int timeouts;		/* WAIT recoveries which gave up */
+};
+
 /**
  * This represents an ARM Debug Interface (v5) Debug Access Port (DAP).
  * A DAP has two types of component:  one Debug Port (DP), which is a
@@ -205,6 +218,11 @@ struct adiv5_dap {
 	/* dap transaction list for WAIT support */
 	struct list_head cmd_journal;
 
+	/* unused transaction list entries, kept for reuse */
+	struct list_head cmd_pool;
+
+	struct adiv5_wait_stats wait_stats;
+
 	struct jtag_tap *tap;
 	/* Control config */
 	uint32_t dp_ctrl_stat;
@@ -24,32 +24,367 @@
 #include <target/cortex_m.h>
 #include <target/armv7m_trace.h>
 #include <jtag/interface.h>
+#include <server/server.h>
+#include <helper/replacements.h>
 
 #define TRACE_BUF_SIZE	4096
 
+/* Raw trace buffered between the adapter and the ITM decoder (power of 2) */
+#define TRACE_RING_SIZE		(256 * 1024)
+/* Adapter reads per timer tick; stops earlier once the adapter is drained */
+#define TRACE_POLL_READS	16
+/* Bytes decoded per timer tick, the rest waits in the ring */
+#define TRACE_DECODE_BUDGET	(64 * 1024)
+
+#define ITM_NUM_PORTS		256
+#define ITM_MAX_PAYLOAD		6
+#define ITM_SINK_BUF_SIZE	1024
+#define DWT_NUM_EXCEPTIONS	512
+
+enum itm_sink_type {
+	ITM_SINK_FILE,
+	ITM_SINK_TCP,
+};
+
+/* Destination of the data written to one ITM stimulus port */
+struct itm_sink {
+	enum itm_sink_type type;
+	FILE *file;
+	bool dirty;
+	/* TCP sinks: the service is known once the first client connects */
+	char tcp_port[6];
+	struct service *service;
+	uint8_t out[ITM_SINK_BUF_SIZE];
+	size_t out_len;
+	uint64_t dropped;
+};
+
+struct armv7m_trace_decoder {
+	uint8_t *ring;
+	/* free running indexes, masked on access */
+	size_t head;
+	size_t tail;
+	/* false while the stream is wrapped in TPIU formatter frames */
+	bool decode;
+
+	/* ITM packet being assembled */
+	uint8_t header;
+	uint8_t payload[ITM_MAX_PAYLOAD];
+	unsigned int len;
+	unsigned int need;
+	bool cont;
+	unsigned int zeros;
+	unsigned int page;
+
+	struct itm_sink *sinks[ITM_NUM_PORTS];
+
+	uint64_t bytes;
+	uint64_t ring_dropped;
+	size_t ring_high_water;
+	uint64_t sync;
+	uint64_t overflow;
+	uint64_t timestamps;
+	uint64_t extensions;
+	uint64_t unknown;
+	uint64_t port_bytes[ITM_NUM_PORTS];
+	uint64_t event_counter;
+	uint64_t pc_samples;
+	uint64_t pc_sleep;
+	uint64_t data_trace;
+	/* entered, exited, returned */
+	uint32_t exceptions[DWT_NUM_EXCEPTIONS][3];
+};
+
+static struct armv7m_trace_decoder *armv7m_trace_decoder_get(struct armv7m_common *armv7m)
+{
+	struct armv7m_trace_decoder *dec = armv7m->trace_config.decoder;
+
+	if (dec)
+		return dec;
+
+	dec = calloc(1, sizeof(*dec));
+	if (!dec)
+		return NULL;
+	dec->ring = malloc(TRACE_RING_SIZE);
+	if (!dec->ring) {
+		free(dec);
+		return NULL;
+	}
+
+	armv7m->trace_config.decoder = dec;
+	return dec;
+}
+
+static void itm_sink_flush(struct itm_sink *sink)
+{
+	if (sink->type == ITM_SINK_FILE) {
+		if (sink->dirty)
+			fflush(sink->file);
+		sink->dirty = false;
+		return;
+	}
+
+	if (!sink->out_len)
+		return;
+
+	/* client sockets are non-blocking, a slow reader loses data instead
+	 * of stalling the server loop */
+	if (sink->service) {
+		for (struct connection *c = sink->service->connections; c; c = c->next) {
+			int n = connection_write(c, sink->out, sink->out_len);
+			if (n < (int)sink->out_len)
+				sink->dropped += sink->out_len - (n > 0 ? n : 0);
+		}
+	}
+	sink->out_len = 0;
+}
+
+static void itm_sink_write(struct itm_sink *sink, const uint8_t *data, size_t len)
+{
+	if (sink->type == ITM_SINK_FILE) {
+		if (fwrite(data, 1, len, sink->file) != len)
+			sink->dropped += len;
+		sink->dirty = true;
+		return;
+	}
+
+	if (sink->out_len + len > sizeof(sink->out))
+		itm_sink_flush(sink);
+	memcpy(sink->out + sink->out_len, data, len);
+	sink->out_len += len;
+}
+
+static void itm_sink_free(struct itm_sink *sink)
+{
+	itm_sink_flush(sink);
+
+	if (sink->type == ITM_SINK_FILE) {
+		fclose(sink->file);
+		free(sink);
+	} else {
+		/* the service owns the sink and frees it */
+		remove_service("itm", sink->tcp_port);
+	}
+}
+
+static int itm_sink_new_connection(struct connection *connection)
+{
+	struct itm_sink *sink = connection->service->priv;
+
+	sink->service = connection->service;
+	socket_nonblock(connection->fd);
+	return ERROR_OK;
+}
+
+static int itm_sink_input(struct connection *connection)
+{
+	uint8_t buf[64];
+
+	/* clients only listen, anything they send is discarded */
+	int n = connection_read(connection, buf, sizeof(buf));
+	if (n == 0)
+		return ERROR_SERVER_REMOTE_CLOSED;
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return ERROR_SERVER_REMOTE_CLOSED;
+	return ERROR_OK;
+}
+
+static int itm_sink_connection_closed(struct connection *connection)
+{
+	return ERROR_OK;
+}
+
+static void itm_source_packet(struct armv7m_trace_decoder *dec)
+{
+	unsigned int id = dec->header >> 3;
+
+	if (!(dec->header & 0x04)) {
+		/* instrumentation packet from a stimulus port */
+		unsigned int port = dec->page * 32 + id;
+		dec->port_bytes[port] += dec->len;
+		if (dec->sinks[port])
+			itm_sink_write(dec->sinks[port], dec->payload, dec->len);
+		return;
+	}
+
+	/* hardware source packets from the DWT */
+	switch (id) {
+	case 0:
+		dec->event_counter++;
+		break;
+	case 1:
+		if (dec->len == 2) {
+			unsigned int exc = dec->payload[0] | ((dec->payload[1] & 1) << 8);
+			unsigned int fn = (dec->payload[1] >> 4) & 3;
+			if (fn)
+				dec->exceptions[exc][fn - 1]++;
+		} else
+			dec->unknown++;
+		break;
+	case 2:
+		/* a single byte sample means the core was sleeping */
+		if (dec->len == 4)
+			dec->pc_samples++;
+		else
+			dec->pc_sleep++;
+		break;
+	default:
+		if (id >= 8 && id <= 23)
+			dec->data_trace++;
+		else
+			dec->unknown++;
+		break;
+	}
+}
+
+static void itm_decode_byte(struct armv7m_trace_decoder *dec, uint8_t byte)
+{
+	if (dec->need) {
+		dec->payload[dec->len++] = byte;
+		if (--dec->need == 0)
+			itm_source_packet(dec);
+		return;
+	}
+
+	if (dec->cont) {
+		/* timestamp and extension payloads end with a clear C bit */
+		if (!(byte & 0x80))
+			dec->cont = false;
+		else if (++dec->len == ITM_MAX_PAYLOAD) {
+			dec->cont = false;
+			dec->unknown++;
+		}
+		return;
+	}
+
+	if (byte == 0x00) {
+		dec->zeros++;
+		return;
+	}
+	if (byte == 0x80 && dec->zeros >= 5) {
+		dec->zeros = 0;
+		dec->page = 0;
+		dec->sync++;
+		return;
+	}
+	dec->zeros = 0;
+
+	dec->header = byte;
+	dec->len = 0;
+
+	if (byte == 0x70) {
+		dec->overflow++;
+	} else if (byte & 0x03) {
+		dec->need = (byte & 0x03) == 3 ? 4 : (byte & 0x03);
+	} else if ((byte & 0x8F) == 0x00 || (byte & 0xCF) == 0xC0) {
+		/* local timestamp, format 2 has no payload */
+		dec->timestamps++;
+		dec->cont = byte & 0x80;
+	} else if ((byte & 0xDF) == 0x94) {
+		dec->timestamps++;
+		dec->cont = true;
+	} else if ((byte & 0x0B) == 0x08) {
+		dec->extensions++;
+		if (byte & 0x80)
+			dec->cont = true;
+		else if (!(byte & 0x04))
+			dec->page = (byte >> 4) & 0x07;
+	} else {
+		dec->unknown++;
+	}
+}
+
+static void armv7m_trace_decode(struct armv7m_trace_decoder *dec, size_t *budget)
+{
+	while (dec->tail != dec->head && *budget) {
+		size_t offset = dec->tail & (TRACE_RING_SIZE - 1);
+		size_t n = dec->head - dec->tail;
+		if (n > TRACE_RING_SIZE - offset)
+			n = TRACE_RING_SIZE - offset;
+		if (n > *budget)
+			n = *budget;
+
+		if (dec->decode) {
+			for (size_t i = 0; i < n; i++)
+				itm_decode_byte(dec, dec->ring[offset + i]);
+		}
+
+		dec->tail += n;
+		*budget -= n;
+	}
+}
+
 static int armv7m_poll_trace(void *target)
 {
 	struct armv7m_common *armv7m = target_to_armv7m(target);
-	uint8_t buf[TRACE_BUF_SIZE];
-	size_t size = sizeof(buf);
-	int retval;
+	struct armv7m_trace_config *trace_config = &armv7m->trace_config;
+	struct armv7m_trace_decoder *dec = trace_config->decoder;
+	uint8_t scratch[TRACE_BUF_SIZE];
+	size_t budget = TRACE_DECODE_BUDGET;
+	bool written = false;
+	int retval = ERROR_OK;
+
+	/* Drain the adapter completely; one read per tick loses data as soon
+	 * as SWO runs faster than a read's worth per millisecond. */
+	for (unsigned int i = 0; i < TRACE_POLL_READS; i++) {
+		uint8_t *buf = scratch;
+		size_t want = sizeof(scratch);
+
+		if (dec) {
+			size_t offset = dec->head & (TRACE_RING_SIZE - 1);
+			size_t space = TRACE_RING_SIZE - (dec->head - dec->tail);
+			if (space) {
+				buf = dec->ring + offset;
+				want = TRACE_RING_SIZE - offset;
+				if (want > space)
+					want = space;
+			}
+		}
 
-	retval = adapter_poll_trace(buf, &size);
-	if (retval != ERROR_OK || !size)
-		return retval;
+		size_t size = want;
+		retval = adapter_poll_trace(buf, &size);
+		if (retval != ERROR_OK || !size)
+			break;
 
-	target_call_trace_callbacks(target, size, buf);
+		target_call_trace_callbacks(target, size, buf);
 
-	if (armv7m->trace_config.trace_file != NULL) {
-		if (fwrite(buf, 1, size, armv7m->trace_config.trace_file) == size)
-			fflush(armv7m->trace_config.trace_file);
-		else {
-			LOG_ERROR("Error writing to the trace destination file");
-			return ERROR_FAIL;
+		if (trace_config->trace_file != NULL) {
+			if (fwrite(buf, 1, size, trace_config->trace_file) != size) {
+				LOG_ERROR("Error writing to the trace destination file");
+				retval = ERROR_FAIL;
+				break;
+			}
+			written = true;
 		}
+
+		if (dec) {
+			dec->bytes += size;
+			if (buf == scratch) {
+				dec->ring_dropped += size;
+			} else {
+				dec->head += size;
+				if (dec->head - dec->tail > dec->ring_high_water)
+					dec->ring_high_water = dec->head - dec->tail;
+			}
+			armv7m_trace_decode(dec, &budget);
+		}
+
+		/* a short read means the adapter has nothing more buffered
+		 * (ST-Link returns one byte less than asked when it has more) */
+		if (size + 1 < want)
+			break;
 	}
 
-	return ERROR_OK;
+	if (written)
+		fflush(trace_config->trace_file);
+
+	if (dec) {
+		for (unsigned int port = 0; port < ITM_NUM_PORTS; port++)
+			if (dec->sinks[port])
+				itm_sink_flush(dec->sinks[port]);
+	}
+
+	return retval;
 }
 
 int armv7m_trace_tpiu_config(struct target *target)
@@ -115,8 +450,22 @@ int armv7m_trace_tpiu_config(struct target *target)
 	if (retval != ERROR_OK)
 		return retval;
 
-	if (trace_config->config_type == INTERNAL)
+	if (trace_config->config_type == INTERNAL) {
+		struct armv7m_trace_decoder *dec = armv7m_trace_decoder_get(armv7m);
+		if (!dec) {
+			LOG_ERROR("Failed to allocate trace buffer");
+			return ERROR_FAIL;
+		}
+		/* only a bare ITM stream can be decoded, TPIU frames are
+		 * passed through to the trace file unchanged */
+		dec->decode = trace_config->pin_protocol != SYNC && !trace_config->formatter;
+		dec->tail = dec->head;
+		dec->need = 0;
+		dec->cont = false;
+		dec->zeros = 0;
+		dec->page = 0;
 		target_register_timer_callback(armv7m_poll_trace, 1, 1, target);
+	}
 
 	target_call_event_callbacks(target, TARGET_EVENT_TRACE_CONFIG);
 
@@ -300,6 +649,141 @@ COMMAND_HANDLER(handle_itm_ports_command)
 		return ERROR_OK;
 }
 
+COMMAND_HANDLER(handle_itm_sink_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	struct armv7m_common *armv7m = target_to_armv7m(target);
+	struct armv7m_trace_decoder *dec;
+	struct itm_sink *sink;
+	unsigned int port;
+
+	if (CMD_ARGC < 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	COMMAND_PARSE_NUMBER(uint, CMD_ARGV[0], port);
+	if (port >= ITM_NUM_PORTS) {
+		LOG_ERROR("ITM stimulus port must be below %d", ITM_NUM_PORTS);
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+
+	if (!strcmp(CMD_ARGV[1], "none")) {
+		if (CMD_ARGC != 2)
+			return ERROR_COMMAND_SYNTAX_ERROR;
+	} else if (!strcmp(CMD_ARGV[1], "file") || !strcmp(CMD_ARGV[1], "tcp")) {
+		if (CMD_ARGC != 3)
+			return ERROR_COMMAND_SYNTAX_ERROR;
+	} else
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	dec = armv7m_trace_decoder_get(armv7m);
+	if (!dec) {
+		LOG_ERROR("Failed to allocate trace buffer");
+		return ERROR_FAIL;
+	}
+
+	if (dec->sinks[port]) {
+		itm_sink_free(dec->sinks[port]);
+		dec->sinks[port] = NULL;
+	}
+
+	if (!strcmp(CMD_ARGV[1], "none"))
+		return ERROR_OK;
+
+	sink = calloc(1, sizeof(*sink));
+	if (!sink) {
+		LOG_ERROR("Out of memory");
+		return ERROR_FAIL;
+	}
+
+	if (!strcmp(CMD_ARGV[1], "file")) {
+		sink->type = ITM_SINK_FILE;
+		sink->file = fopen(CMD_ARGV[2], "ab");
+		if (!sink->file) {
+			LOG_ERROR("Can't open ITM port %u destination file", port);
+			free(sink);
+			return ERROR_FAIL;
+		}
+	} else {
+		uint16_t tcp_port;
+		COMMAND_PARSE_NUMBER(u16, CMD_ARGV[2], tcp_port);
+		sink->type = ITM_SINK_TCP;
+		snprintf(sink->tcp_port, sizeof(sink->tcp_port), "%u", tcp_port);
+		/* the service takes ownership of the sink */
+		if (add_service("itm", sink->tcp_port, CONNECTION_LIMIT_UNLIMITED,
+				itm_sink_new_connection, itm_sink_input,
+				itm_sink_connection_closed, sink) != ERROR_OK) {
+			free(sink);
+			return ERROR_FAIL;
+		}
+	}
+
+	dec->sinks[port] = sink;
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(handle_itm_stats_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	struct armv7m_common *armv7m = target_to_armv7m(target);
+	struct armv7m_trace_decoder *dec = armv7m->trace_config.decoder;
+
+	if (CMD_ARGC > 1)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (CMD_ARGC == 1) {
+		if (strcmp(CMD_ARGV[0], "reset"))
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		if (dec) {
+			size_t offset = offsetof(struct armv7m_trace_decoder, bytes);
+			memset((uint8_t *)dec + offset, 0, sizeof(*dec) - offset);
+			for (unsigned int port = 0; port < ITM_NUM_PORTS; port++)
+				if (dec->sinks[port])
+					dec->sinks[port]->dropped = 0;
+		}
+		return ERROR_OK;
+	}
+
+	if (!dec) {
+		command_print(CMD_CTX, "no trace data captured");
+		return ERROR_OK;
+	}
+
+	command_print(CMD_CTX, "trace: %" PRIu64 " bytes, %" PRIu64 " dropped (buffer full), "
+			"buffer high water %zu of %d bytes%s",
+			dec->bytes, dec->ring_dropped, dec->ring_high_water, TRACE_RING_SIZE,
+			dec->decode ? "" : ", not decoded (TPIU formatter in use)");
+	command_print(CMD_CTX, "ITM: %" PRIu64 " sync, %" PRIu64 " overflow, %" PRIu64
+			" timestamp, %" PRIu64 " extension, %" PRIu64 " unknown packets",
+			dec->sync, dec->overflow, dec->timestamps, dec->extensions, dec->unknown);
+
+	for (unsigned int port = 0; port < ITM_NUM_PORTS; port++) {
+		struct itm_sink *sink = dec->sinks[port];
+		if (!dec->port_bytes[port] && !sink)
+			continue;
+		if (!sink)
+			command_print(CMD_CTX, "port %u: %" PRIu64 " bytes", port, dec->port_bytes[port]);
+		else
+			command_print(CMD_CTX, "port %u: %" PRIu64 " bytes to %s%s, %" PRIu64 " dropped",
+					port, dec->port_bytes[port],
+					sink->type == ITM_SINK_FILE ? "file" : "tcp/",
+					sink->type == ITM_SINK_FILE ? "" : sink->tcp_port,
+					sink->dropped);
+	}
+
+	command_print(CMD_CTX, "DWT: %" PRIu64 " PC samples, %" PRIu64 " sleeping, %" PRIu64
+			" event counter, %" PRIu64 " data trace packets",
+			dec->pc_samples, dec->pc_sleep, dec->event_counter, dec->data_trace);
+
+	for (unsigned int exc = 0; exc < DWT_NUM_EXCEPTIONS; exc++) {
+		uint32_t *count = dec->exceptions[exc];
+		if (count[0] || count[1] || count[2])
+			command_print(CMD_CTX, "exception %u: %" PRIu32 " entered, %" PRIu32
+					" exited, %" PRIu32 " returned to", exc, count[0], count[1], count[2]);
+	}
+
+	return ERROR_OK;
+}
+
 static const struct command_registration tpiu_command_handlers[] = {
 	{
 		.name = "config",
@@ -329,6 +813,20 @@ static const struct command_registration itm_command_handlers[] = {
 		.help = "Enable or disable all ITM stimulus ports",
 		.usage = "(0|1|on|off)",
 	},
+	{
+		.name = "sink",
+		.handler = handle_itm_sink_command,
+		.mode = COMMAND_ANY,
+		.help = "Send decoded data of an ITM stimulus port to a file or TCP port",
+		.usage = "<port> (none | file <filename> | tcp <tcp_port>)",
+	},
+	{
+		.name = "stats",
+		.handler = handle_itm_stats_command,
+		.mode = COMMAND_ANY,
+		.help = "Display or reset trace capture and decoder statistics",
+		.usage = "['reset']",
+	},
 	COMMAND_REGISTRATION_DONE
 };
 
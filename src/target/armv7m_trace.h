@@ -21,6 +21,8 @@
 #include <target/target.h>
 #include <command.h>
 
+struct armv7m_trace_decoder;
+
 /**
  * @file
  * Holds the interface to TPIU, ITM and DWT configuration functions.
@@ -75,6 +77,8 @@ struct armv7m_trace_config {
 	unsigned int trace_freq;
 	/** Handle to output trace data in INTERNAL capture mode */
 	FILE *trace_file;
+	/** Ring buffer, ITM decoder and stimulus port sinks for INTERNAL capture */
+	struct armv7m_trace_decoder *decoder;
 };
 
 extern const struct command_registration armv7m_trace_command_handlers[];
@@ -1692,6 +1692,106 @@ static int cortex_m_write_memory(struct target *target, target_addr_t address,
 	return mem_ap_write_buf(armv7m->debug_ap, buffer, size, count, address);
 }
 
+/* Number of DWT_PCSR reads queued per DAP round trip while profiling */
+#define CORTEX_M_PCSR_BATCH	1024
+
+/*
+ * Sample the PC through DWT_PCSR while the core keeps running.  Reads are
+ * issued as non-incrementing block reads of the same address, so a whole
+ * batch of samples costs a single queue flush instead of a halt/resume
+ * cycle per sample.  PCSR reads as 0xFFFFFFFF while the core is halted,
+ * in debug state or (on some parts) sleeping; those samples are dropped.
+ */
+static int cortex_m_profiling(struct target *target, uint32_t *samples,
+		uint32_t max_num_samples, uint32_t *num_samples, uint32_t seconds)
+{
+	struct armv7m_common *armv7m = target_to_armv7m(target);
+	struct adiv5_ap *ap = armv7m->debug_ap;
+	uint32_t pcsr;
+	int retval;
+
+	*num_samples = 0;
+
+	/* PCSR is optional on ARMv6-M and reads as zero when not implemented */
+	retval = mem_ap_read_atomic_u32(ap, DWT_PCSR, &pcsr);
+	if (retval != ERROR_OK) {
+		LOG_ERROR("Error while reading PCSR");
+		return retval;
+	}
+	if (pcsr == 0) {
+		LOG_INFO("PCSR sampling not supported on this processor.");
+		return target_profiling_default(target, samples, max_num_samples,
+				num_samples, seconds);
+	}
+
+	retval = target_poll(target);
+	if (retval != ERROR_OK)
+		return retval;
+	if (target->state == TARGET_HALTED) {
+		/* current pc, addr = 0, do not handle breakpoints, not debugging */
+		retval = target_resume(target, 1, 0, 0, 0);
+		if (retval != ERROR_OK) {
+			LOG_ERROR("Error while resuming target");
+			return retval;
+		}
+	}
+
+	LOG_INFO("Starting Cortex-M profiling. Sampling DWT_PCSR as fast as we can...");
+
+	int64_t start = timeval_ms();
+	int64_t deadline = start + (int64_t)seconds * 1000;
+	uint32_t sample_count = 0;
+	uint32_t dropped = 0;
+
+	while (sample_count < max_num_samples) {
+		uint32_t count = max_num_samples - sample_count;
+		if (count > CORTEX_M_PCSR_BATCH)
+			count = CORTEX_M_PCSR_BATCH;
+
+		/* raw samples land in place and are compacted below */
+		uint8_t *raw = (uint8_t *)&samples[sample_count];
+		retval = mem_ap_read_buf_noincr(ap, raw, 4, count, DWT_PCSR);
+		if (retval != ERROR_OK) {
+			LOG_ERROR("Error while reading PCSR");
+			break;
+		}
+
+		uint32_t valid = 0;
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t pc = target_buffer_get_u32(target, raw + 4 * i);
+			if (pc == 0xFFFFFFFF) {
+				dropped++;
+				continue;
+			}
+			samples[sample_count + valid++] = pc;
+		}
+		sample_count += valid;
+
+		if (valid == 0) {
+			/* the whole batch saw a stopped core; find out why */
+			retval = target_poll(target);
+			if (retval != ERROR_OK)
+				break;
+			if (target->state != TARGET_RUNNING) {
+				LOG_INFO("Target not running, profiling stopped");
+				break;
+			}
+		}
+
+		keep_alive();
+		if (timeval_ms() >= deadline)
+			break;
+	}
+
+	int64_t elapsed = timeval_ms() - start;
+	LOG_INFO("Profiling completed. %" PRIu32 " samples in %" PRId64 " ms"
+			" (%" PRIu32 " dropped while the core was stopped).",
+			sample_count, elapsed, dropped);
+
+	*num_samples = sample_count;
+	return retval;
+}
+
 static int cortex_m_init_target(struct command_context *cmd_ctx,
 	struct target *target)
 {
@@ -2451,6 +2551,8 @@ struct target_type cortexm_target = {
 	.add_watchpoint = cortex_m_add_watchpoint,
 	.remove_watchpoint = cortex_m_remove_watchpoint,
 
+	.profiling = cortex_m_profiling,
+
 	.commands = cortex_m_command_handlers,
 	.target_create = cortex_m_target_create,
 	.target_jim_configure = adiv5_jim_configure,
@@ -31,8 +31,16 @@
 
 #include "image.h"
 #include "target.h"
+#include <helper/binarybuffer.h>
 #include <helper/log.h>
 
+/* carry-less multiply CRC32, selected at run time if the CPU has it */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_CRC32_CLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 /* convert ELF header field to host endianness */
 #define field16(elf, field) \
 	((elf->endianness == ELFDATA2LSB) ? \
@@ -115,6 +123,193 @@ static int identify_image_type(struct image *image, const char *type_string, con
 	return ERROR_OK;
 }
 
+static int image_record_add_mark(struct image_record_index *index,
+	uint32_t offset, size_t position)
+{
+	/* one mark every IMAGE_RECORD_MARK_STRIDE bytes is enough to find any
+	 * offset without decoding much data that isn't needed */
+	if (index->num_marks > 0 &&
+		offset < index->marks[index->num_marks - 1].offset + IMAGE_RECORD_MARK_STRIDE)
+		return ERROR_OK;
+
+	if (index->num_marks % 64 == 0) {
+		struct image_record_mark *marks = realloc(index->marks,
+				(index->num_marks + 64) * sizeof(struct image_record_mark));
+		if (marks == NULL) {
+			LOG_ERROR("Out of memory");
+			return ERROR_FAIL;
+		}
+		index->marks = marks;
+	}
+
+	index->marks[index->num_marks].offset = offset;
+	index->marks[index->num_marks].position = position;
+	index->num_marks++;
+
+	return ERROR_OK;
+}
+
+static void image_record_index_free(struct image_record_index *index)
+{
+	if (index == NULL)
+		return;
+
+	for (int i = 0; i < IMAGE_MAX_SECTIONS; i++)
+		free(index[i].marks);
+	free(index);
+}
+
+/**
+ * Decode the data of an IHEX record.
+ * @returns the number of data bytes, 0 if the line is not a data record,
+ * or -1 if it is malformed.
+ */
+static int image_ihex_decode_record(const char *line, uint8_t *data)
+{
+	uint8_t header[4];
+
+	if (line[0] != ':')
+		return 0;
+
+	if (unhexify(header, line + 1, 4) != 4)
+		return -1;
+
+	/* header[0] is the byte count, header[3] the record type */
+	if (header[3] != 0)
+		return 0;
+
+	if (unhexify(data, line + 9, header[0]) != header[0])
+		return -1;
+
+	return header[0];
+}
+
+/**
+ * Decode the data of an S1, S2 or S3 record.
+ * @returns the number of data bytes, 0 if the line is not a data record,
+ * or -1 if it is malformed.
+ */
+static int image_mot_decode_record(const char *line, uint8_t *data)
+{
+	uint8_t count;
+
+	if (line[0] != 'S' || line[1] < '1' || line[1] > '3')
+		return 0;
+
+	if (unhexify(&count, line + 2, 1) != 1)
+		return -1;
+
+	/* the count covers address, data and checksum */
+	int address_bytes = line[1] - '0' + 1;
+	int data_bytes = count - address_bytes - 1;
+	if (data_bytes < 0)
+		return -1;
+
+	if (unhexify(data, line + 4 + 2 * address_bytes, data_bytes) != (size_t)data_bytes)
+		return -1;
+
+	return data_bytes;
+}
+
+/**
+ * Read from a section of an IHEX or S19 image by decoding its data records
+ * again, starting at the nearest indexed record. The position where the read
+ * stopped is remembered, so that a sequence of reads through a section
+ * decodes each record only once.
+ */
+static int image_record_read_section(struct image *image,
+	struct fileio *fileio,
+	struct image_record_cursor *cursor,
+	int (*decode)(const char *line, uint8_t *data),
+	int section,
+	uint32_t offset,
+	uint32_t size,
+	uint8_t *buffer,
+	size_t *size_read)
+{
+	struct image_record_index *index = image->sections[section].private;
+	uint32_t record_offset;
+	size_t position;
+	int retval;
+
+	*size_read = 0;
+	if (size == 0)
+		return ERROR_OK;
+
+	if (index->num_marks == 0)
+		return ERROR_IMAGE_FORMAT_ERROR;
+
+	/* find the last mark at or before the offset */
+	unsigned int lo = 0, hi = index->num_marks;
+	while (hi - lo > 1) {
+		unsigned int mid = (lo + hi) / 2;
+		if (index->marks[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	record_offset = index->marks[lo].offset;
+	position = index->marks[lo].position;
+
+	/* continue from the previous read if that's closer */
+	if (cursor->section == section && cursor->offset <= offset &&
+			cursor->offset > record_offset) {
+		record_offset = cursor->offset;
+		position = cursor->position;
+	}
+
+	char *line = malloc(1023);
+	uint8_t *data = malloc(256);
+	if (line == NULL || data == NULL) {
+		free(line);
+		free(data);
+		LOG_ERROR("Out of memory");
+		return ERROR_FAIL;
+	}
+
+	retval = fileio_seek(fileio, position);
+
+	while (retval == ERROR_OK && *size_read < size) {
+		size_t line_position = position;
+
+		retval = fileio_fgets(fileio, 1023, line);
+		if (retval == ERROR_OK)
+			retval = fileio_tell(fileio, &position);
+		if (retval != ERROR_OK) {
+			LOG_ERROR("premature end of file while decoding image section");
+			retval = ERROR_IMAGE_FORMAT_ERROR;
+			break;
+		}
+
+		int count = decode(line, data);
+		if (count < 0) {
+			LOG_ERROR("malformed data record while decoding image section");
+			retval = ERROR_IMAGE_FORMAT_ERROR;
+			break;
+		}
+
+		uint32_t want = offset + *size_read;
+		if (record_offset + count > want) {
+			uint32_t skip = want - record_offset;
+			uint32_t n = MIN((uint32_t)count - skip, size - *size_read);
+
+			memcpy(buffer + *size_read, data + skip, n);
+			*size_read += n;
+
+			cursor->section = section;
+			cursor->offset = record_offset;
+			cursor->position = line_position;
+		}
+
+		record_offset += count;
+	}
+
+	free(data);
+	free(line);
+
+	return retval;
+}
+
 static int image_ihex_buffer_complete_inner(struct image *image,
 	char *lpszLine,
 	struct imagesection *section)
@@ -122,27 +317,23 @@ static int image_ihex_buffer_complete_inner(struct image *image,
 	struct image_ihex *ihex = image->type_private;
 	struct fileio *fileio = ihex->fileio;
 	uint32_t full_address = 0x0;
-	uint32_t cooked_bytes;
+	size_t position;
 	int i;
 
 	/* we can't determine the number of sections that we'll have to create ahead of time,
-	 * so we locally hold them until parsing is finished */
+	 * so we locally hold them until parsing is finished. The data itself isn't kept,
+	 * only an index into the file to decode it from when the section is read */
 
-	size_t filesize;
 	int retval;
-	retval = fileio_size(fileio, &filesize);
-	if (retval != ERROR_OK)
-		return retval;
 
-	ihex->buffer = malloc(filesize >> 1);
-	cooked_bytes = 0x0;
 	image->num_sections = 0;
-	section[image->num_sections].private = &ihex->buffer[cooked_bytes];
+	section[image->num_sections].private = &ihex->index[image->num_sections];
 	section[image->num_sections].base_address = 0x0;
 	section[image->num_sections].size = 0x0;
 	section[image->num_sections].flags = 0;
 
-	while (fileio_fgets(fileio, 1023, lpszLine) == ERROR_OK) {
+	while (fileio_tell(fileio, &position) == ERROR_OK &&
+			fileio_fgets(fileio, 1023, lpszLine) == ERROR_OK) {
 		uint32_t count;
 		uint32_t address;
 		uint32_t record_type;
@@ -179,20 +370,25 @@ static int image_ihex_buffer_complete_inner(struct image *image,
 					section[image->num_sections].size = 0x0;
 					section[image->num_sections].flags = 0;
 					section[image->num_sections].private =
-						&ihex->buffer[cooked_bytes];
+						&ihex->index[image->num_sections];
 				}
 				section[image->num_sections].base_address =
 					(full_address & 0xffff0000) | address;
 				full_address = (full_address & 0xffff0000) | address;
 			}
 
+			if (count > 0) {
+				retval = image_record_add_mark(&ihex->index[image->num_sections],
+						section[image->num_sections].size, position);
+				if (retval != ERROR_OK)
+					return retval;
+			}
+
 			while (count-- > 0) {
 				unsigned value;
 				sscanf(&lpszLine[bytes_read], "%2x", &value);
-				ihex->buffer[cooked_bytes] = (uint8_t)value;
-				cal_checksum += (uint8_t)ihex->buffer[cooked_bytes];
+				cal_checksum += (uint8_t)value;
 				bytes_read += 2;
-				cooked_bytes += 1;
 				section[image->num_sections].size += 1;
 				full_address++;
 			}
@@ -233,7 +429,7 @@ static int image_ihex_buffer_complete_inner(struct image *image,
 					section[image->num_sections].size = 0x0;
 					section[image->num_sections].flags = 0;
 					section[image->num_sections].private =
-						&ihex->buffer[cooked_bytes];
+						&ihex->index[image->num_sections];
 				}
 				section[image->num_sections].base_address =
 					(full_address & 0xffff) | (upper_address << 4);
@@ -272,7 +468,7 @@ static int image_ihex_buffer_complete_inner(struct image *image,
 					section[image->num_sections].size = 0x0;
 					section[image->num_sections].flags = 0;
 					section[image->num_sections].private =
-						&ihex->buffer[cooked_bytes];
+						&ihex->index[image->num_sections];
 				}
 				section[image->num_sections].base_address =
 					(full_address & 0xffff) | (upper_address << 16);
@@ -484,6 +680,11 @@ static int image_elf_read_section(struct image *image,
 		LOG_DEBUG("read elf: size = 0x%zu at 0x%" PRIx32 "", read_size,
 			field32(elf, segment->p_offset) + offset);
 		/* read initialized area of the segment */
+		if (elf->data) {
+			memcpy(buffer, elf->data + field32(elf, segment->p_offset) + offset, read_size);
+			*size_read += read_size;
+			return ERROR_OK;
+		}
 		retval = fileio_seek(elf->fileio, field32(elf, segment->p_offset) + offset);
 		if (retval != ERROR_OK) {
 			LOG_ERROR("cannot find ELF segment content, seek failed");
@@ -511,27 +712,23 @@ static int image_mot_buffer_complete_inner(struct image *image,
 	struct image_mot *mot = image->type_private;
 	struct fileio *fileio = mot->fileio;
 	uint32_t full_address = 0x0;
-	uint32_t cooked_bytes;
+	size_t position;
 	int i;
 
 	/* we can't determine the number of sections that we'll have to create ahead of time,
-	 * so we locally hold them until parsing is finished */
+	 * so we locally hold them until parsing is finished. The data itself isn't kept,
+	 * only an index into the file to decode it from when the section is read */
 
 	int retval;
-	size_t filesize;
-	retval = fileio_size(fileio, &filesize);
-	if (retval != ERROR_OK)
-		return retval;
 
-	mot->buffer = malloc(filesize >> 1);
-	cooked_bytes = 0x0;
 	image->num_sections = 0;
-	section[image->num_sections].private = &mot->buffer[cooked_bytes];
+	section[image->num_sections].private = &mot->index[image->num_sections];
 	section[image->num_sections].base_address = 0x0;
 	section[image->num_sections].size = 0x0;
 	section[image->num_sections].flags = 0;
 
-	while (fileio_fgets(fileio, 1023, lpszLine) == ERROR_OK) {
+	while (fileio_tell(fileio, &position) == ERROR_OK &&
+			fileio_fgets(fileio, 1023, lpszLine) == ERROR_OK) {
 		uint32_t count;
 		uint32_t address;
 		uint32_t record_type;
@@ -600,22 +797,32 @@ static int image_mot_buffer_complete_inner(struct image *image,
 				 */
 				if (section[image->num_sections].size != 0) {
 					image->num_sections++;
+					if (image->num_sections >= IMAGE_MAX_SECTIONS) {
+						/* too many sections */
+						LOG_ERROR("Too many sections found in S19 file");
+						return ERROR_IMAGE_FORMAT_ERROR;
+					}
 					section[image->num_sections].size = 0x0;
 					section[image->num_sections].flags = 0;
 					section[image->num_sections].private =
-						&mot->buffer[cooked_bytes];
+						&mot->index[image->num_sections];
 				}
 				section[image->num_sections].base_address = address;
 				full_address = address;
 			}
 
+			if (count > 0) {
+				retval = image_record_add_mark(&mot->index[image->num_sections],
+						section[image->num_sections].size, position);
+				if (retval != ERROR_OK)
+					return retval;
+			}
+
 			while (count-- > 0) {
 				unsigned value;
 				sscanf(&lpszLine[bytes_read], "%2x", &value);
-				mot->buffer[cooked_bytes] = (uint8_t)value;
-				cal_checksum += (uint8_t)mot->buffer[cooked_bytes];
+				cal_checksum += (uint8_t)value;
 				bytes_read += 2;
-				cooked_bytes += 1;
 				section[image->num_sections].size += 1;
 				full_address++;
 			}
@@ -712,6 +919,10 @@ int image_open(struct image *image, const char *url, const char *type_string)
 			return retval;
 		}
 
+		/* serve reads straight from the file if it can be mapped */
+		if (fileio_map(image_binary->fileio, &image_binary->data) != ERROR_OK)
+			image_binary->data = NULL;
+
 		image->num_sections = 1;
 		image->sections = malloc(sizeof(struct imagesection));
 		image->sections[0].base_address = 0x0;
@@ -726,10 +937,19 @@ int image_open(struct image *image, const char *url, const char *type_string)
 		if (retval != ERROR_OK)
 			return retval;
 
+		image_ihex->index = calloc(IMAGE_MAX_SECTIONS, sizeof(struct image_record_index));
+		image_ihex->cursor.section = -1;
+		if (image_ihex->index == NULL) {
+			LOG_ERROR("Out of memory");
+			fileio_close(image_ihex->fileio);
+			return ERROR_FAIL;
+		}
+
 		retval = image_ihex_buffer_complete(image);
 		if (retval != ERROR_OK) {
 			LOG_ERROR(
 				"failed buffering IHEX image, check server output for additional information");
+			image_record_index_free(image_ihex->index);
 			fileio_close(image_ihex->fileio);
 			return retval;
 		}
@@ -747,6 +967,20 @@ int image_open(struct image *image, const char *url, const char *type_string)
 			fileio_close(image_elf->fileio);
 			return retval;
 		}
+
+		/* serve segment reads straight from the file if it can be mapped */
+		if (fileio_size(image_elf->fileio, &image_elf->size) != ERROR_OK ||
+				fileio_map(image_elf->fileio, &image_elf->data) != ERROR_OK)
+			image_elf->data = NULL;
+
+		/* segments that don't fit in the file get the read errors they used to */
+		for (int i = 0; image_elf->data && i < image->num_sections; i++) {
+			Elf32_Phdr *segment = image->sections[i].private;
+			uint64_t end = (uint64_t)field32(image_elf, segment->p_offset) +
+				field32(image_elf, segment->p_filesz);
+			if (end > image_elf->size)
+				image_elf->data = NULL;
+		}
 	} else if (image->type == IMAGE_MEMORY) {
 		struct target *target = get_target(url);
 
@@ -777,10 +1011,19 @@ int image_open(struct image *image, const char *url, const char *type_string)
 		if (retval != ERROR_OK)
 			return retval;
 
+		image_mot->index = calloc(IMAGE_MAX_SECTIONS, sizeof(struct image_record_index));
+		image_mot->cursor.section = -1;
+		if (image_mot->index == NULL) {
+			LOG_ERROR("Out of memory");
+			fileio_close(image_mot->fileio);
+			return ERROR_FAIL;
+		}
+
 		retval = image_mot_buffer_complete(image);
 		if (retval != ERROR_OK) {
 			LOG_ERROR(
 				"failed buffering S19 image, check server output for additional information");
+			image_record_index_free(image_mot->index);
 			fileio_close(image_mot->fileio);
 			return retval;
 		}
@@ -832,6 +1075,12 @@ int image_read_section(struct image *image,
 		if (section != 0)
 			return ERROR_COMMAND_SYNTAX_ERROR;
 
+		if (image_binary->data) {
+			memcpy(buffer, image_binary->data + offset, size);
+			*size_read = size;
+			return ERROR_OK;
+		}
+
 		/* seek to offset */
 		retval = fileio_seek(image_binary->fileio, offset);
 		if (retval != ERROR_OK)
@@ -842,10 +1091,10 @@ int image_read_section(struct image *image,
 		if (retval != ERROR_OK)
 			return retval;
 	} else if (image->type == IMAGE_IHEX) {
-		memcpy(buffer, (uint8_t *)image->sections[section].private + offset, size);
-		*size_read = size;
+		struct image_ihex *image_ihex = image->type_private;
 
-		return ERROR_OK;
+		return image_record_read_section(image, image_ihex->fileio, &image_ihex->cursor,
+				image_ihex_decode_record, section, offset, size, buffer, size_read);
 	} else if (image->type == IMAGE_ELF)
 		return image_elf_read_section(image, section, offset, size, buffer, size_read);
 	else if (image->type == IMAGE_MEMORY) {
@@ -887,10 +1136,10 @@ int image_read_section(struct image *image,
 			address += (size_in_cache > size) ? size : size_in_cache;
 		}
 	} else if (image->type == IMAGE_SRECORD) {
-		memcpy(buffer, (uint8_t *)image->sections[section].private + offset, size);
-		*size_read = size;
+		struct image_mot *image_mot = image->type_private;
 
-		return ERROR_OK;
+		return image_record_read_section(image, image_mot->fileio, &image_mot->cursor,
+				image_mot_decode_record, section, offset, size, buffer, size_read);
 	} else if (image->type == IMAGE_BUILDER) {
 		memcpy(buffer, (uint8_t *)image->sections[section].private + offset, size);
 		*size_read = size;
@@ -901,6 +1150,46 @@ int image_read_section(struct image *image,
 	return ERROR_OK;
 }
 
+/**
+ * Get a pointer to section data without copying it, for images whose content
+ * is already in memory: mapped binary and ELF files and built images.
+ * The data stays valid until the image is closed.
+ *
+ * @returns ERROR_IMAGE_TEMPORARILY_UNAVAILABLE if the data has to be read
+ * with image_read_section() instead.
+ */
+int image_get_section_data(struct image *image,
+	int section,
+	uint32_t offset,
+	uint32_t size,
+	const uint8_t **data)
+{
+	if (offset + size > image->sections[section].size)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (image->type == IMAGE_BINARY) {
+		struct image_binary *image_binary = image->type_private;
+
+		if (image_binary->data) {
+			*data = image_binary->data + offset;
+			return ERROR_OK;
+		}
+	} else if (image->type == IMAGE_ELF) {
+		struct image_elf *elf = image->type_private;
+		Elf32_Phdr *segment = (Elf32_Phdr *)image->sections[section].private;
+
+		if (elf->data) {
+			*data = elf->data + field32(elf, segment->p_offset) + offset;
+			return ERROR_OK;
+		}
+	} else if (image->type == IMAGE_BUILDER) {
+		*data = (uint8_t *)image->sections[section].private + offset;
+		return ERROR_OK;
+	}
+
+	return ERROR_IMAGE_TEMPORARILY_UNAVAILABLE;
+}
+
 int image_add_section(struct image *image, uint32_t base, uint32_t size, int flags, uint8_t const *data)
 {
 	struct imagesection *section;
@@ -949,10 +1238,8 @@ void image_close(struct image *image)
 
 		fileio_close(image_ihex->fileio);
 
-		if (image_ihex->buffer) {
-			free(image_ihex->buffer);
-			image_ihex->buffer = NULL;
-		}
+		image_record_index_free(image_ihex->index);
+		image_ihex->index = NULL;
 	} else if (image->type == IMAGE_ELF) {
 		struct image_elf *image_elf = image->type_private;
 
@@ -979,10 +1266,8 @@ void image_close(struct image *image)
 
 		fileio_close(image_mot->fileio);
 
-		if (image_mot->buffer) {
-			free(image_mot->buffer);
-			image_mot->buffer = NULL;
-		}
+		image_record_index_free(image_mot->index);
+		image_mot->index = NULL;
 	} else if (image->type == IMAGE_BUILDER) {
 		int i;
 
@@ -1003,37 +1288,212 @@ void image_close(struct image *image)
 	}
 }
 
-int image_calculate_checksum(uint8_t *buffer, uint32_t nbytes, uint32_t *checksum)
+/* bytes checksummed between keep_alive() calls */
+#define IMAGE_CRC32_CHUNK	(1024 * 1024)
+
+/* CRC32 as used by GDB and the target side checksum algorithms:
+ * polynomial 0x04c11db7, MSB first, initial value 0xffffffff, no final
+ * xor (CRC-32/MPEG-2). */
+#define CRC32_POLY	0x04c11db7
+
+#ifdef IMAGE_CRC32_CLMUL
+static uint32_t crc32_k192, crc32_k128;
+
+/* x^n mod P, for the folding constants */
+static uint32_t crc32_xpow_mod(unsigned int n)
 {
-	uint32_t crc = 0xffffffff;
-	LOG_DEBUG("Calculating checksum");
+	uint32_t r = 1;
+	while (n--)
+		r = r & 0x80000000 ? (r << 1) ^ CRC32_POLY : (r << 1);
+	return r;
+}
+#endif
+
+static uint32_t crc32_table[8][256];
+static bool crc32_tables_ready;
+
+static void crc32_init_tables(void)
+{
+	for (unsigned int i = 0; i < 256; i++) {
+		/* as per gdb */
+		uint32_t c = i << 24;
+		for (int j = 8; j > 0; --j)
+			c = c & 0x80000000 ? (c << 1) ^ CRC32_POLY : (c << 1);
+		crc32_table[0][i] = c;
+	}
+
+	/* crc32_table[k][i] is the CRC of byte i followed by k zero bytes */
+	for (unsigned int k = 1; k < 8; k++)
+		for (unsigned int i = 0; i < 256; i++) {
+			uint32_t c = crc32_table[k - 1][i];
+			crc32_table[k][i] = (c << 8) ^ crc32_table[0][c >> 24];
+		}
+
+#ifdef IMAGE_CRC32_CLMUL
+	crc32_k192 = crc32_xpow_mod(192);
+	crc32_k128 = crc32_xpow_mod(128);
+#endif
+	crc32_tables_ready = true;
+}
 
-	static uint32_t crc32_table[256];
-
-	static bool first_init;
-	if (!first_init) {
-		/* Initialize the CRC table and the decoding table.  */
-		int i, j;
-		unsigned int c;
-		for (i = 0; i < 256; i++) {
-			/* as per gdb */
-			for (c = i << 24, j = 8; j > 0; --j)
-				c = c & 0x80000000 ? (c << 1) ^ 0x04c11db7 : (c << 1);
-			crc32_table[i] = c;
+static uint32_t crc32_update_bytewise(uint32_t crc, const uint8_t *buffer, size_t nbytes)
+{
+	while (nbytes--) {
+		/* as per gdb */
+		crc = (crc << 8) ^ crc32_table[0][((crc >> 24) ^ *buffer++) & 255];
+	}
+	return crc;
+}
+
+static uint32_t crc32_update_slice8(uint32_t crc, const uint8_t *buffer, size_t nbytes)
+{
+	while (nbytes >= 8) {
+		uint32_t hi = crc ^ ((uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 |
+				(uint32_t)buffer[2] << 8 | buffer[3]);
+		crc = crc32_table[7][hi >> 24] ^ crc32_table[6][(hi >> 16) & 255] ^
+			crc32_table[5][(hi >> 8) & 255] ^ crc32_table[4][hi & 255] ^
+			crc32_table[3][buffer[4]] ^ crc32_table[2][buffer[5]] ^
+			crc32_table[1][buffer[6]] ^ crc32_table[0][buffer[7]];
+		buffer += 8;
+		nbytes -= 8;
+	}
+	return crc32_update_bytewise(crc, buffer, nbytes);
+}
+
+#ifdef IMAGE_CRC32_CLMUL
+static bool crc32_clmul_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
+
+/*
+ * Fold the message 16 bytes at a time with carry-less multiplies: with a
+ * 128-bit block A = H * x^64 + L, A * x^128 is congruent to
+ * H * (x^192 mod P) + L * (x^128 mod P), which is added to the next block.
+ * The remaining 128 bits are reduced by the table code, which multiplies
+ * by x^32 mod P exactly as the CRC definition requires.
+ */
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc32_update_clmul(uint32_t crc, const uint8_t *buffer, size_t nbytes)
+{
+	if (nbytes < 32)
+		return crc32_update_slice8(crc, buffer, nbytes);
+
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+			8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k = _mm_set_epi64x(crc32_k192, crc32_k128);
+
+	/* the running CRC is added to the first 32 message bits */
+	__m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buffer), bswap);
+	x = _mm_xor_si128(x, _mm_set_epi32(crc, 0, 0, 0));
+	buffer += 16;
+	nbytes -= 16;
+
+	while (nbytes >= 16) {
+		__m128i next = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buffer), bswap);
+		__m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+		__m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+		x = _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+		buffer += 16;
+		nbytes -= 16;
+	}
+
+	uint8_t rest[16];
+	_mm_storeu_si128((__m128i *)rest, _mm_shuffle_epi8(x, bswap));
+	crc = crc32_update_slice8(0, rest, sizeof(rest));
+	return crc32_update_slice8(crc, buffer, nbytes);
+}
+#endif
+
+static bool crc32_always_supported(void)
+{
+	return true;
+}
+
+const struct image_crc32_engine image_crc32_engines[] = {
+	{ "bytewise", crc32_always_supported, crc32_update_bytewise },
+	{ "slice-by-8", crc32_always_supported, crc32_update_slice8 },
+#ifdef IMAGE_CRC32_CLMUL
+	{ "clmul", crc32_clmul_supported, crc32_update_clmul },
+#endif
+	{ NULL, NULL, NULL },
+};
+
+int image_crc32_selftest(const struct image_crc32_engine *engine)
+{
+	uint8_t buffer[1024 + 16];
+	uint32_t seed = 1;
+
+	if (!crc32_tables_ready)
+		crc32_init_tables();
+
+	if (!engine->supported())
+		return ERROR_FAIL;
+
+	/* CRC-32/MPEG-2 check value, as computed by the target side algorithms */
+	if (engine->update(0xffffffff, (const uint8_t *)"123456789", 9) != 0x0376e6e7)
+		return ERROR_FAIL;
+
+	for (size_t i = 0; i < sizeof(buffer); i++) {
+		seed = seed * 1103515245 + 12345;
+		buffer[i] = seed >> 16;
+	}
+
+	/* compare against the reference for every length and a few alignments */
+	for (size_t offset = 0; offset < 16; offset += 5) {
+		for (size_t len = 0; len <= sizeof(buffer) - 16; len += 7) {
+			uint32_t crc = 0xffffffff - len;
+			if (engine->update(crc, buffer + offset, len) !=
+					crc32_update_bytewise(crc, buffer + offset, len))
+				return ERROR_FAIL;
 		}
+	}
+
+	return ERROR_OK;
+}
+
+static const struct image_crc32_engine *crc32_engine;
 
-		first_init = true;
+/* The fastest engine the host supports and that passes the self-test */
+const struct image_crc32_engine *image_crc32_engine(void)
+{
+	if (crc32_engine)
+		return crc32_engine;
+
+	crc32_engine = &image_crc32_engines[0];
+	for (const struct image_crc32_engine *e = image_crc32_engines + 1; e->name; e++) {
+		if (!e->supported())
+			continue;
+		if (image_crc32_selftest(e) != ERROR_OK) {
+			LOG_WARNING("%s CRC32 failed its self-test, not using it", e->name);
+			continue;
+		}
+		crc32_engine = e;
 	}
+	if (!crc32_tables_ready)
+		crc32_init_tables();
+
+	LOG_DEBUG("using %s CRC32", crc32_engine->name);
+	return crc32_engine;
+}
+
+int image_calculate_checksum(uint8_t *buffer, uint32_t nbytes, uint32_t *checksum)
+{
+	const struct image_crc32_engine *engine = image_crc32_engine();
+	uint32_t crc = 0xffffffff;
+	LOG_DEBUG("Calculating checksum");
 
 	while (nbytes > 0) {
-		int run = nbytes;
-		if (run > 32768)
-			run = 32768;
+		uint32_t run = nbytes;
+		if (run > IMAGE_CRC32_CHUNK)
+			run = IMAGE_CRC32_CHUNK;
+		crc = engine->update(crc, buffer, run);
+		buffer += run;
 		nbytes -= run;
-		while (run--) {
-			/* as per gdb */
-			crc = (crc << 8) ^ crc32_table[((crc >> 24) ^ *buffer++) & 255];
-		}
 		keep_alive();
 	}
 
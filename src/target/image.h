@@ -36,6 +36,9 @@
 
 #define IMAGE_MEMORY_CACHE_SIZE		(2048)
 
+/* decoded bytes of IHEX/S19 data between two entries of the record index */
+#define IMAGE_RECORD_MARK_STRIDE	(4096)
+
 enum image_type {
 	IMAGE_BINARY,	/* plain binary */
 	IMAGE_IHEX,		/* intel hex-record format */
@@ -65,11 +68,32 @@ struct image {
 
 struct image_binary {
 	struct fileio *fileio;
+	const uint8_t *data;	/* file content if it could be mapped, NULL otherwise */
+};
+
+/* a data record of an IHEX/S19 section, where decoding can start from */
+struct image_record_mark {
+	uint32_t offset;	/* offset of the record's data within the section */
+	size_t position;	/* file position of the record */
+};
+
+/* IHEX/S19 sections are decoded from the file on demand, using this index */
+struct image_record_index {
+	struct image_record_mark *marks;
+	unsigned int num_marks;
+};
+
+/* where the previous read of a record based image stopped */
+struct image_record_cursor {
+	int section;
+	uint32_t offset;
+	size_t position;
 };
 
 struct image_ihex {
 	struct fileio *fileio;
-	uint8_t *buffer;
+	struct image_record_index *index;	/* one entry per section */
+	struct image_record_cursor cursor;
 };
 
 struct image_memory {
@@ -80,6 +104,8 @@ struct image_memory {
 
 struct image_elf {
 	struct fileio *fileio;
+	const uint8_t *data;	/* file content if it could be mapped, NULL otherwise */
+	size_t size;
 	Elf32_Ehdr *header;
 	Elf32_Phdr *segments;
 	uint32_t segment_count;
@@ -88,12 +114,15 @@ struct image_elf {
 
 struct image_mot {
 	struct fileio *fileio;
-	uint8_t *buffer;
+	struct image_record_index *index;	/* one entry per section */
+	struct image_record_cursor cursor;
 };
 
 int image_open(struct image *image, const char *url, const char *type_string);
 int image_read_section(struct image *image, int section, uint32_t offset,
 		uint32_t size, uint8_t *buffer, size_t *size_read);
+int image_get_section_data(struct image *image, int section, uint32_t offset,
+		uint32_t size, const uint8_t **data);
 void image_close(struct image *image);
 
 int image_add_section(struct image *image, uint32_t base, uint32_t size,
@@ -102,6 +131,22 @@ int image_add_section(struct image *image, uint32_t base, uint32_t size,
 int image_calculate_checksum(uint8_t *buffer, uint32_t nbytes,
 		uint32_t *checksum);
 
+/** A host implementation of the CRC32 computed by image_calculate_checksum() */
+struct image_crc32_engine {
+	const char *name;
+	/** false if the host CPU lacks the instructions the engine needs */
+	bool (*supported)(void);
+	uint32_t (*update)(uint32_t crc, const uint8_t *buffer, size_t nbytes);
+};
+
+/** All engines, the bytewise reference first, terminated by a NULL name */
+extern const struct image_crc32_engine image_crc32_engines[];
+
+/** Check an engine against the reference; required before calling it directly */
+int image_crc32_selftest(const struct image_crc32_engine *engine);
+/** The engine image_calculate_checksum() uses */
+const struct image_crc32_engine *image_crc32_engine(void);
+
 #define ERROR_IMAGE_FORMAT_ERROR	(-1400)
 #define ERROR_IMAGE_TYPE_UNKNOWN	(-1401)
 #define ERROR_IMAGE_TEMPORARILY_UNAVAILABLE		(-1402)
@@ -0,0 +1,423 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <helper/log.h>
+#include "target.h"
+#include "memory_cache.h"
+
+#define MEMORY_CACHE_BLOCK_SIZE		64
+#define MEMORY_CACHE_NUM_BLOCKS		1024
+#define MEMORY_CACHE_READ_AHEAD		3
+
+static inline struct memory_cache_block *memory_cache_slot(struct memory_cache *cache,
+		target_addr_t block)
+{
+	return &cache->blocks[(block / cache->block_size) % cache->num_blocks];
+}
+
+static inline uint8_t *memory_cache_slot_data(struct memory_cache *cache,
+		struct memory_cache_block *b)
+{
+	return cache->data + (b - cache->blocks) * cache->block_size;
+}
+
+static bool memory_cache_is_uncached(struct memory_cache *cache,
+		target_addr_t address, uint32_t size)
+{
+	for (struct memory_cache_region *r = cache->uncached; r; r = r->next) {
+		if (address <= r->address + (r->size - 1) && r->address <= address + (size - 1))
+			return true;
+	}
+	return false;
+}
+
+static bool memory_cache_hit(struct memory_cache *cache, target_addr_t block)
+{
+	struct memory_cache_block *b = memory_cache_slot(cache, block);
+	return b->valid && b->address == block;
+}
+
+/* Fetches the blocks from @a first up to the one containing @a end - 1,
+ * plus read-ahead, with a single read from the target. @a start is the
+ * first block of the request, whose blocks must all stay in the cache. */
+static int memory_cache_fill(struct target *target, struct memory_cache *cache,
+		target_addr_t start, target_addr_t first, target_addr_t end,
+		memory_cache_read_fn read)
+{
+	uint32_t bs = cache->block_size;
+	unsigned count = (end - first + bs - 1) / bs;
+	/* more would wrap around onto the slots of the request's blocks */
+	unsigned max = cache->num_blocks - (first - start) / bs;
+
+	/* extend by read-ahead, but stop at blocks we already have, at
+	 * uncached regions and at the end of the address space */
+	for (unsigned i = 0; i < cache->read_ahead && count < max; i++) {
+		target_addr_t next = first + (target_addr_t)count * bs;
+		if (next < first || memory_cache_hit(cache, next)
+				|| memory_cache_is_uncached(cache, next, bs))
+			break;
+		count++;
+	}
+
+	uint8_t *tmp = malloc(count * bs);
+	if (tmp == NULL)
+		return ERROR_FAIL;
+
+	int retval = read(target, first, count * bs, tmp);
+	if (retval != ERROR_OK && count * bs > end - first) {
+		/* read-ahead may run into inaccessible memory, retry without */
+		count = (end - first + bs - 1) / bs;
+		retval = read(target, first, count * bs, tmp);
+	}
+
+	if (retval == ERROR_OK) {
+		cache->fetches++;
+		cache->fetched_bytes += count * bs;
+		for (unsigned i = 0; i < count; i++) {
+			target_addr_t block = first + (target_addr_t)i * bs;
+			struct memory_cache_block *b = memory_cache_slot(cache, block);
+			b->address = block;
+			b->valid = true;
+			memcpy(memory_cache_slot_data(cache, b), tmp + i * bs, bs);
+		}
+	}
+
+	free(tmp);
+	return retval;
+}
+
+int memory_cache_read(struct target *target, target_addr_t address,
+		uint32_t size, uint8_t *buffer, memory_cache_read_fn read)
+{
+	struct memory_cache *cache = target->mem_cache;
+
+	if (cache == NULL)
+		return read(target, address, size, buffer);
+
+	if (target->state != TARGET_HALTED) {
+		memory_cache_invalidate(target);
+		return read(target, address, size, buffer);
+	}
+
+	uint32_t bs = cache->block_size;
+	target_addr_t first = address & ~(target_addr_t)(bs - 1);
+	target_addr_t end = address + size;
+	unsigned count = (end - first + bs - 1) / bs;
+
+	/* large transfers gain nothing from the cache and would only evict
+	 * what is worth keeping, and uncached regions are never touched,
+	 * not even by the rest of a block holding requested bytes */
+	if (end < first || count > cache->num_blocks / 4
+			|| memory_cache_is_uncached(cache, first, count * bs))
+		return read(target, address, size, buffer);
+
+	for (target_addr_t block = first; block < end; block += bs) {
+		if (memory_cache_hit(cache, block)) {
+			cache->hits++;
+			continue;
+		}
+
+		cache->misses++;
+		if (memory_cache_fill(target, cache, first, block, end, read) != ERROR_OK) {
+			/* let the target report the error for the exact range */
+			return read(target, address, size, buffer);
+		}
+	}
+
+	/* all blocks are present now */
+	for (target_addr_t block = first; block < end; block += bs) {
+		struct memory_cache_block *b = memory_cache_slot(cache, block);
+		if (!b->valid || b->address != block) {
+			LOG_DEBUG("memory cache block " TARGET_ADDR_FMT " evicted by its own read",
+					block);
+			return read(target, address, size, buffer);
+		}
+		uint32_t offset = block < address ? address - block : 0;
+		uint32_t len = MIN(bs - offset, end - (block + offset));
+		memcpy(buffer + (block + offset - address), memory_cache_slot_data(cache, b) + offset, len);
+	}
+
+	return ERROR_OK;
+}
+
+void memory_cache_invalidate_range(struct target *target,
+		target_addr_t address, uint32_t size)
+{
+	struct memory_cache *cache = target->mem_cache;
+
+	if (cache == NULL || size == 0)
+		return;
+
+	uint32_t bs = cache->block_size;
+	target_addr_t first = address & ~(target_addr_t)(bs - 1);
+	target_addr_t end = address + size;
+
+	if (end < first || (end - first) / bs >= cache->num_blocks) {
+		memory_cache_invalidate(target);
+		return;
+	}
+
+	for (target_addr_t block = first; block < end; block += bs) {
+		struct memory_cache_block *b = memory_cache_slot(cache, block);
+		if (b->address == block)
+			b->valid = false;
+	}
+}
+
+void memory_cache_invalidate(struct target *target)
+{
+	struct memory_cache *cache = target->mem_cache;
+
+	if (cache == NULL)
+		return;
+
+	for (unsigned i = 0; i < cache->num_blocks; i++)
+		cache->blocks[i].valid = false;
+	cache->invalidations++;
+}
+
+static void memory_cache_free_regions(struct memory_cache *cache)
+{
+	while (cache->uncached) {
+		struct memory_cache_region *r = cache->uncached;
+		cache->uncached = r->next;
+		free(r);
+	}
+}
+
+void memory_cache_free(struct target *target)
+{
+	struct memory_cache *cache = target->mem_cache;
+
+	if (cache == NULL)
+		return;
+
+	memory_cache_free_regions(cache);
+	free(cache->blocks);
+	free(cache->data);
+	free(cache);
+	target->mem_cache = NULL;
+}
+
+static int memory_cache_enable(struct target *target)
+{
+	if (target->mem_cache)
+		return ERROR_OK;
+
+	struct memory_cache *cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return ERROR_FAIL;
+
+	cache->block_size = MEMORY_CACHE_BLOCK_SIZE;
+	cache->num_blocks = MEMORY_CACHE_NUM_BLOCKS;
+	cache->read_ahead = MEMORY_CACHE_READ_AHEAD;
+	cache->blocks = calloc(cache->num_blocks, sizeof(*cache->blocks));
+	cache->data = malloc(cache->num_blocks * cache->block_size);
+	if (cache->blocks == NULL || cache->data == NULL) {
+		free(cache->blocks);
+		free(cache->data);
+		free(cache);
+		return ERROR_FAIL;
+	}
+
+	target->mem_cache = cache;
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(handle_memory_cache_enable_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+
+	if (CMD_ARGC > 0)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	int retval = memory_cache_enable(target);
+	if (retval != ERROR_OK)
+		LOG_ERROR("unable to allocate memory cache");
+	return retval;
+}
+
+COMMAND_HANDLER(handle_memory_cache_disable_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+
+	if (CMD_ARGC > 0)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	memory_cache_free(target);
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(handle_memory_cache_flush_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+
+	if (CMD_ARGC > 0)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	memory_cache_invalidate(target);
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(handle_memory_cache_read_ahead_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	struct memory_cache *cache = target->mem_cache;
+
+	if (CMD_ARGC > 1)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (cache == NULL) {
+		LOG_ERROR("memory cache of target %s is disabled", target_name(target));
+		return ERROR_FAIL;
+	}
+
+	if (CMD_ARGC == 1)
+		COMMAND_PARSE_NUMBER(uint, CMD_ARGV[0], cache->read_ahead);
+
+	command_print(CMD_CTX, "read-ahead: %u blocks of %" PRIu32 " bytes",
+			cache->read_ahead, cache->block_size);
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(handle_memory_cache_exclude_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	struct memory_cache *cache = target->mem_cache;
+
+	if (CMD_ARGC != 0 && CMD_ARGC != 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (cache == NULL) {
+		LOG_ERROR("memory cache of target %s is disabled", target_name(target));
+		return ERROR_FAIL;
+	}
+
+	if (CMD_ARGC == 2) {
+		target_addr_t address;
+		uint32_t size;
+		COMMAND_PARSE_ADDRESS(CMD_ARGV[0], address);
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[1], size);
+		if (size == 0)
+			return ERROR_COMMAND_ARGUMENT_INVALID;
+
+		struct memory_cache_region *r = malloc(sizeof(*r));
+		if (r == NULL)
+			return ERROR_FAIL;
+		r->address = address;
+		r->size = size;
+		r->next = cache->uncached;
+		cache->uncached = r;
+
+		memory_cache_invalidate_range(target, address, size);
+		return ERROR_OK;
+	}
+
+	for (struct memory_cache_region *r = cache->uncached; r; r = r->next)
+		command_print(CMD_CTX, TARGET_ADDR_FMT " size 0x%8.8" PRIx32,
+				r->address, r->size);
+
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(handle_memory_cache_stats_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	struct memory_cache *cache = target->mem_cache;
+
+	if (CMD_ARGC > 0)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (cache == NULL) {
+		command_print(CMD_CTX, "memory cache of target %s is disabled",
+				target_name(target));
+		return ERROR_OK;
+	}
+
+	command_print(CMD_CTX, "%u blocks of %" PRIu32 " bytes, read-ahead %u blocks",
+			cache->num_blocks, cache->block_size, cache->read_ahead);
+	command_print(CMD_CTX, "hits: %" PRIu64 ", misses: %" PRIu64,
+			cache->hits, cache->misses);
+	command_print(CMD_CTX, "target reads: %" PRIu64 " (%" PRIu64 " bytes)",
+			cache->fetches, cache->fetched_bytes);
+	command_print(CMD_CTX, "invalidations: %" PRIu64, cache->invalidations);
+	return ERROR_OK;
+}
+
+static const struct command_registration memory_cache_exec_command_handlers[] = {
+	{
+		.name = "enable",
+		.handler = handle_memory_cache_enable_command,
+		.mode = COMMAND_ANY,
+		.help = "cache memory reads of the current target while it is halted",
+		.usage = "",
+	},
+	{
+		.name = "disable",
+		.handler = handle_memory_cache_disable_command,
+		.mode = COMMAND_ANY,
+		.help = "disable the memory cache of the current target",
+		.usage = "",
+	},
+	{
+		.name = "flush",
+		.handler = handle_memory_cache_flush_command,
+		.mode = COMMAND_EXEC,
+		.help = "drop all cached memory contents",
+		.usage = "",
+	},
+	{
+		.name = "read_ahead",
+		.handler = handle_memory_cache_read_ahead_command,
+		.mode = COMMAND_ANY,
+		.help = "display or set how many additional blocks are read on a miss",
+		.usage = "[blocks]",
+	},
+	{
+		.name = "exclude",
+		.handler = handle_memory_cache_exclude_command,
+		.mode = COMMAND_ANY,
+		.help = "display the regions that are never cached, or add one",
+		.usage = "[address size]",
+	},
+	{
+		.name = "stats",
+		.handler = handle_memory_cache_stats_command,
+		.mode = COMMAND_EXEC,
+		.help = "display memory cache statistics",
+		.usage = "",
+	},
+	COMMAND_REGISTRATION_DONE
+};
+
+static const struct command_registration memory_cache_command_handlers[] = {
+	{
+		.name = "memory_cache",
+		.mode = COMMAND_ANY,
+		.help = "target memory cache command group",
+		.usage = "",
+		.chain = memory_cache_exec_command_handlers,
+	},
+	COMMAND_REGISTRATION_DONE
+};
+
+int memory_cache_register_commands(struct command_context *cmd_ctx)
+{
+	return register_commands(cmd_ctx, NULL, memory_cache_command_handlers);
+}
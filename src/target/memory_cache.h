@@ -0,0 +1,85 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ ***************************************************************************/
+
+#ifndef OPENOCD_TARGET_MEMORY_CACHE_H
+#define OPENOCD_TARGET_MEMORY_CACHE_H
+
+/**
+ * @file
+ * Optional host side cache of target memory, used while a target is halted.
+ *
+ * GDB reads lots of small, overlapping ranges (stack frames, variables)
+ * after every halt. With the cache enabled, target_read_buffer() fetches
+ * whole blocks, plus some read-ahead, and serves the following reads from
+ * the host. Everything is dropped whenever the target state or its memory
+ * may change: resume, step, reset, any target event, running algorithms,
+ * and memory written through the target_write_*() functions.
+ */
+
+struct target;
+struct command_context;
+
+/** A range that is always read from the target, e.g. peripheral registers */
+struct memory_cache_region {
+	target_addr_t address;
+	uint32_t size;
+	struct memory_cache_region *next;
+};
+
+struct memory_cache_block {
+	target_addr_t address;
+	bool valid;
+};
+
+struct memory_cache {
+	/** bytes per block, a power of two */
+	uint32_t block_size;
+	/** number of blocks, the cache is direct mapped */
+	unsigned num_blocks;
+	/** additional blocks fetched on a miss */
+	unsigned read_ahead;
+	struct memory_cache_block *blocks;
+	uint8_t *data;
+	struct memory_cache_region *uncached;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t fetches;
+	uint64_t fetched_bytes;
+	uint64_t invalidations;
+};
+
+typedef int (*memory_cache_read_fn)(struct target *target,
+		target_addr_t address, uint32_t size, uint8_t *buffer);
+
+/**
+ * Reads through the cache of @a target if it is enabled and the target is
+ * halted, otherwise straight through @a read.
+ */
+int memory_cache_read(struct target *target, target_addr_t address,
+		uint32_t size, uint8_t *buffer, memory_cache_read_fn read);
+
+/** Drops cached data overlapping the given range */
+void memory_cache_invalidate_range(struct target *target,
+		target_addr_t address, uint32_t size);
+
+/** Drops all cached data of @a target */
+void memory_cache_invalidate(struct target *target);
+
+void memory_cache_free(struct target *target);
+
+int memory_cache_register_commands(struct command_context *cmd_ctx);
+
+#endif /* OPENOCD_TARGET_MEMORY_CACHE_H */
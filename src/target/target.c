@@ -52,6 +52,7 @@
 #include "register.h"
 #include "trace.h"
 #include "image.h"
+#include "memory_cache.h"
 #include "rtos/rtos.h"
 #include "transport/transport.h"
 
@@ -67,12 +68,13 @@ static int target_array2mem(Jim_Interp *interp, struct target *target,
 static int target_mem2array(Jim_Interp *interp, struct target *target,
 		int argc, Jim_Obj * const *argv);
 static int target_register_user_commands(struct command_context *cmd_ctx);
+static int target_restore_working_area_lazy(struct target *target, bool restore);
+static void target_update_working_area_lazy(struct target *target,
+		target_addr_t address, uint32_t size, const uint8_t *buffer);
 static int target_get_gdb_fileio_info_default(struct target *target,
 		struct gdb_fileio_info *fileio_info);
 static int target_gdb_fileio_end_default(struct target *target, int retcode,
 		int fileio_errno, bool ctrl_c);
-static int target_profiling_default(struct target *target, uint32_t *samples,
-		uint32_t max_num_samples, uint32_t *num_samples, uint32_t seconds);
 
 /* targets */
 extern struct target_type arm7tdmi_target;
@@ -145,6 +147,7 @@ static struct target_type *target_types[] = {
 struct target *all_targets;
 static struct target_event_callback *target_event_callbacks;
 static struct target_timer_callback *target_timer_callbacks;
+static int64_t target_timer_next_event_value;
 LIST_HEAD(target_reset_callback_list);
 LIST_HEAD(target_trace_callback_list);
 static const int polling_interval = 100;
@@ -614,6 +617,15 @@ int target_resume(struct target *target, int current, target_addr_t address,
 
 	target_call_event_callbacks(target, TARGET_EVENT_RESUME_START);
 
+	memory_cache_invalidate(target);
+
+	/* lazily restored working areas must be back before the target runs */
+	if (!debug_execution) {
+		retval = target_restore_working_area_lazy(target, true);
+		if (retval != ERROR_OK)
+			return retval;
+	}
+
 	/* note that resume *must* be asynchronous. The CPU can halt before
 	 * we poll. The CPU can even halt at the current PC as a result of
 	 * a software breakpoint being inserted by (a bug?) the application.
@@ -798,6 +810,8 @@ int target_run_algorithm(struct target *target,
 		goto done;
 	}
 
+	memory_cache_invalidate(target);
+
 	target->running_alg = true;
 	retval = target->type->run_algorithm(target,
 			num_mem_params, mem_params,
@@ -839,6 +853,8 @@ int target_start_algorithm(struct target *target,
 	}
 
 	target->running_alg = true;
+	memory_cache_invalidate(target);
+
 	retval = target->type->start_algorithm(target,
 			num_mem_params, mem_params,
 			num_reg_params, reg_params,
@@ -872,6 +888,8 @@ int target_wait_algorithm(struct target *target,
 		goto done;
 	}
 
+	memory_cache_invalidate(target);
+
 	retval = target->type->wait_algorithm(target,
 			num_mem_params, mem_params,
 			num_reg_params, reg_params,
@@ -1077,6 +1095,9 @@ int target_write_memory(struct target *target,
 		LOG_ERROR("Target %s doesn't support write_memory", target_name(target));
 		return ERROR_FAIL;
 	}
+	memory_cache_invalidate_range(target, address, size * count);
+	target_update_working_area_lazy(target, address, size * count, buffer);
+	rtos_memory_written(target);
 	return target->type->write_memory(target, address, size, count, buffer);
 }
 
@@ -1091,6 +1112,9 @@ int target_write_phys_memory(struct target *target,
 		LOG_ERROR("Target %s doesn't support write_phys_memory", target_name(target));
 		return ERROR_FAIL;
 	}
+	/* the cache holds virtual addresses */
+	memory_cache_invalidate(target);
+	rtos_memory_written(target);
 	return target->type->write_phys_memory(target, address, size, count, buffer);
 }
 
@@ -1101,6 +1125,7 @@ int target_add_breakpoint(struct target *target,
 		LOG_WARNING("target %s is not halted", target_name(target));
 		return ERROR_TARGET_NOT_HALTED;
 	}
+	memory_cache_invalidate(target);
 	return target->type->add_breakpoint(target, breakpoint);
 }
 
@@ -1111,6 +1136,7 @@ int target_add_context_breakpoint(struct target *target,
 		LOG_WARNING("target %s is not halted", target_name(target));
 		return ERROR_TARGET_NOT_HALTED;
 	}
+	memory_cache_invalidate(target);
 	return target->type->add_context_breakpoint(target, breakpoint);
 }
 
@@ -1121,12 +1147,14 @@ int target_add_hybrid_breakpoint(struct target *target,
 		LOG_WARNING("target %s is not halted", target_name(target));
 		return ERROR_TARGET_NOT_HALTED;
 	}
+	memory_cache_invalidate(target);
 	return target->type->add_hybrid_breakpoint(target, breakpoint);
 }
 
 int target_remove_breakpoint(struct target *target,
 		struct breakpoint *breakpoint)
 {
+	memory_cache_invalidate(target);
 	return target->type->remove_breakpoint(target, breakpoint);
 }
 
@@ -1171,6 +1199,12 @@ int target_get_gdb_reg_list(struct target *target,
 int target_step(struct target *target,
 		int current, target_addr_t address, int handle_breakpoints)
 {
+	memory_cache_invalidate(target);
+
+	int retval = target_restore_working_area_lazy(target, true);
+	if (retval != ERROR_OK)
+		return retval;
+
 	return target->type->step(target, current, address, handle_breakpoints);
 }
 
@@ -1428,6 +1462,11 @@ int target_register_timer_callback(int (*callback)(void *priv), int time_ms, int
 	(*callbacks_p)->priv = priv;
 	(*callbacks_p)->next = NULL;
 
+	int64_t when_ms = (int64_t)(*callbacks_p)->when.tv_sec * 1000
+		+ (*callbacks_p)->when.tv_usec / 1000;
+	if (when_ms < target_timer_next_event_value)
+		target_timer_next_event_value = when_ms;
+
 	return ERROR_OK;
 }
 
@@ -1521,6 +1560,9 @@ int target_call_event_callbacks(struct target *target, enum target_event event)
 	LOG_DEBUG("target event %i (%s)", event,
 			Jim_Nvp_value2name_simple(nvp_target_event, event)->name);
 
+	/* whatever happened may have changed the target's memory */
+	memory_cache_invalidate(target);
+
 	target_handle_event(target, event);
 
 	while (callback) {
@@ -1595,6 +1637,11 @@ static int target_call_timer_callbacks_check_time(int checktime)
 	struct timeval now;
 	gettimeofday(&now, NULL);
 
+	/* Initialize to a default value that's a ways into the future.
+	 * The loop below will make it closer to now if there are
+	 * callbacks that want to be called sooner. */
+	target_timer_next_event_value = timeval_ms() + 1000;
+
 	/* Store an address of the place containing a pointer to the
 	 * next item; initially, that's a standalone "root of the
 	 * list" variable. */
@@ -1616,6 +1663,13 @@ static int target_call_timer_callbacks_check_time(int checktime)
 		if (call_it)
 			target_call_timer_callback(*callback, &now);
 
+		if (!(*callback)->removed) {
+			int64_t when_ms = (int64_t)(*callback)->when.tv_sec * 1000
+				+ (*callback)->when.tv_usec / 1000;
+			if (when_ms < target_timer_next_event_value)
+				target_timer_next_event_value = when_ms;
+		}
+
 		callback = &(*callback)->next;
 	}
 
@@ -1634,17 +1688,64 @@ int target_call_timer_callbacks_now(void)
 	return target_call_timer_callbacks_check_time(0);
 }
 
-/* Prints the working area layout for debug purposes */
-static void print_wa_layout(struct target *target)
+/* Returns the time in ms (as returned by timeval_ms()) at which the next
+ * timer callback is due. */
+int64_t target_timer_next_event(void)
+{
+	return target_timer_next_event_value;
+}
+
+static bool target_wa_word_saved(struct target *target, uint32_t word)
+{
+	return target->working_area_saved[word / 32] & (1u << (word % 32));
+}
+
+/* Prints the working area layout for debug purposes, or to a command
+ * context if one is given */
+static void print_wa_layout(struct target *target, struct command_context *cmd_ctx)
 {
 	struct working_area *c = target->working_areas;
+	struct working_area_stats *stats = &target->working_area_stats;
+	uint32_t free_total = 0, free_largest = 0, free_blocks = 0;
 
 	while (c) {
-		LOG_DEBUG("%c%c " TARGET_ADDR_FMT "-" TARGET_ADDR_FMT " (%" PRIu32 " bytes)",
-			c->backup ? 'b' : ' ', c->free ? ' ' : '*',
-			c->address, c->address + c->size - 1, c->size);
+		bool saved = c->backup != NULL;
+		if (target->working_area_saved && c->size) {
+			uint32_t word = (c->address - target->working_area_shadow_base) / 4;
+			saved = target_wa_word_saved(target, word);
+		}
+		if (cmd_ctx)
+			command_print(cmd_ctx, "%c%c " TARGET_ADDR_FMT "-" TARGET_ADDR_FMT " (%" PRIu32 " bytes)",
+				saved ? 'b' : ' ', c->free ? ' ' : '*',
+				c->address, c->address + c->size - 1, c->size);
+		else
+			LOG_DEBUG("%c%c " TARGET_ADDR_FMT "-" TARGET_ADDR_FMT " (%" PRIu32 " bytes)",
+				saved ? 'b' : ' ', c->free ? ' ' : '*',
+				c->address, c->address + c->size - 1, c->size);
+		if (c->free) {
+			free_total += c->size;
+			free_blocks++;
+			if (c->size > free_largest)
+				free_largest = c->size;
+		}
 		c = c->next;
 	}
+
+	if (!cmd_ctx)
+		return;
+
+	/* share of the free space that the largest request can't use */
+	unsigned int fragmentation = free_total ?
+		100 - (unsigned int)((uint64_t)free_largest * 100 / free_total) : 0;
+	command_print(cmd_ctx, "free: %" PRIu32 " bytes in %" PRIu32 " blocks, largest %"
+			PRIu32 " bytes, %u%% fragmented",
+			free_total, free_blocks, free_largest, fragmentation);
+	command_print(cmd_ctx, "allocations: %" PRIu32 " (%" PRIu32 " failed), frees: %"
+			PRIu32 " (%" PRIu32 " with restore deferred)",
+			stats->allocs, stats->alloc_failures, stats->frees, stats->restores_deferred);
+	command_print(cmd_ctx, "backup: %" PRIu64 " bytes read, %" PRIu64
+			" bytes reused, %" PRIu64 " bytes restored",
+			stats->backup_bytes, stats->backup_reused, stats->restore_bytes);
 }
 
 /* Reduce area to size bytes, create a new free area from the remaining bytes, if any. */
@@ -1711,6 +1812,127 @@ static void target_merge_working_areas(struct target *target)
 	}
 }
 
+/* Save the words of [address, address + size) that the lazy backup does
+ * not hold yet; words freed but not restored since keep their backup */
+static int target_backup_working_area_lazy(struct target *target,
+		target_addr_t address, uint32_t size)
+{
+	if (target->working_area_shadow == NULL) {
+		uint32_t total = 0;
+		for (struct working_area *c = target->working_areas; c; c = c->next)
+			total += c->size;
+
+		target->working_area_shadow = malloc(total);
+		target->working_area_saved = calloc((total / 4 + 31) / 32, sizeof(uint32_t));
+		if (target->working_area_shadow == NULL || target->working_area_saved == NULL) {
+			free(target->working_area_shadow);
+			free(target->working_area_saved);
+			target->working_area_shadow = NULL;
+			target->working_area_saved = NULL;
+			return ERROR_FAIL;
+		}
+		target->working_area_shadow_base = target->working_areas->address;
+		target->working_area_shadow_size = total;
+	}
+
+	uint32_t word = (address - target->working_area_shadow_base) / 4;
+	uint32_t end = word + size / 4;
+	while (word < end) {
+		if (target_wa_word_saved(target, word)) {
+			target->working_area_stats.backup_reused += 4;
+			word++;
+			continue;
+		}
+
+		uint32_t run = word;
+		while (run < end && !target_wa_word_saved(target, run))
+			run++;
+
+		int retval = target_read_memory(target,
+				target->working_area_shadow_base + word * 4, 4, run - word,
+				target->working_area_shadow + word * 4);
+		if (retval != ERROR_OK)
+			return retval;
+		target->working_area_stats.backup_bytes += (run - word) * 4;
+
+		for (; word < run; word++)
+			target->working_area_saved[word / 32] |= 1u << (word % 32);
+	}
+
+	return ERROR_OK;
+}
+
+/* Write back the lazy backup of every free working area, or forget it if
+ * the target memory is no longer valid (e.g. after reset) */
+static int target_restore_working_area_lazy(struct target *target, bool restore)
+{
+	int retval = ERROR_OK;
+
+	if (target->working_area_saved == NULL)
+		return ERROR_OK;
+
+	for (struct working_area *c = target->working_areas; c; c = c->next) {
+		if (!c->free)
+			continue;
+
+		uint32_t word = (c->address - target->working_area_shadow_base) / 4;
+		uint32_t end = word + c->size / 4;
+		while (word < end) {
+			if (!target_wa_word_saved(target, word)) {
+				word++;
+				continue;
+			}
+
+			uint32_t run = word;
+			while (run < end && target_wa_word_saved(target, run))
+				run++;
+
+			if (restore) {
+				int r = target_write_memory(target,
+						target->working_area_shadow_base + word * 4, 4, run - word,
+						target->working_area_shadow + word * 4);
+				if (r != ERROR_OK) {
+					LOG_ERROR("failed to restore %" PRIu32 " bytes of working area at address "
+							TARGET_ADDR_FMT, (run - word) * 4,
+							target->working_area_shadow_base + word * 4);
+					retval = r;
+					word = run;
+					continue;
+				}
+				target->working_area_stats.restore_bytes += (run - word) * 4;
+			}
+
+			for (; word < run; word++)
+				target->working_area_saved[word / 32] &= ~(1u << (word % 32));
+		}
+	}
+
+	return retval;
+}
+
+/* Host writes to free working areas whose restore is still pending must
+ * survive it: put the written bytes into the lazy backup as well, so the
+ * restore writes back what the host wrote */
+static void target_update_working_area_lazy(struct target *target,
+		target_addr_t address, uint32_t size, const uint8_t *buffer)
+{
+	if (target->working_area_saved == NULL)
+		return;
+
+	for (struct working_area *c = target->working_areas; c; c = c->next) {
+		if (!c->free)
+			continue;
+
+		target_addr_t start = MAX(address, c->address);
+		target_addr_t end = MIN(address + size, c->address + c->size);
+		for (target_addr_t a = start; a < end; a++) {
+			uint32_t offset = a - target->working_area_shadow_base;
+			if (target_wa_word_saved(target, offset / 4))
+				target->working_area_shadow[offset] = buffer[a - address];
+		}
+	}
+}
+
 int target_alloc_working_area_try(struct target *target, uint32_t size, struct working_area **area)
 {
 	/* Reevaluate working area address based on MMU state*/
@@ -1764,17 +1986,18 @@ int target_alloc_working_area_try(struct target *target, uint32_t size, struct w
 	if (size % 4)
 		size = (size + 3) & (~3UL);
 
-	struct working_area *c = target->working_areas;
-
-	/* Find the first large enough working area */
-	while (c) {
-		if (c->free && c->size >= size)
-			break;
-		c = c->next;
+	/* Find the smallest large enough working area, to keep the big
+	 * blocks for big requests */
+	struct working_area *c = NULL;
+	for (struct working_area *t = target->working_areas; t; t = t->next) {
+		if (t->free && t->size >= size && (c == NULL || t->size < c->size))
+			c = t;
 	}
 
-	if (c == NULL)
+	if (c == NULL) {
+		target->working_area_stats.alloc_failures++;
 		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
 
 	/* Split the working area into the requested size */
 	target_split_working_area(c, size);
@@ -1782,7 +2005,11 @@ int target_alloc_working_area_try(struct target *target, uint32_t size, struct w
 	LOG_DEBUG("allocated new working area of %" PRIu32 " bytes at address " TARGET_ADDR_FMT,
 			  size, c->address);
 
-	if (target->backup_working_area) {
+	if (target->backup_working_area && target->backup_working_area_lazy) {
+		int retval = target_backup_working_area_lazy(target, c->address, c->size);
+		if (retval != ERROR_OK)
+			return retval;
+	} else if (target->backup_working_area) {
 		if (c->backup == NULL) {
 			c->backup = malloc(c->size);
 			if (c->backup == NULL)
@@ -1792,6 +2019,7 @@ int target_alloc_working_area_try(struct target *target, uint32_t size, struct w
 		int retval = target_read_memory(target, c->address, 4, c->size / 4, c->backup);
 		if (retval != ERROR_OK)
 			return retval;
+		target->working_area_stats.backup_bytes += c->size;
 	}
 
 	/* mark as used, and return the new (reused) area */
@@ -1801,7 +2029,8 @@ int target_alloc_working_area_try(struct target *target, uint32_t size, struct w
 	/* user pointer */
 	c->user = area;
 
-	print_wa_layout(target);
+	target->working_area_stats.allocs++;
+	print_wa_layout(target, NULL);
 
 	return ERROR_OK;
 }
@@ -1826,6 +2055,8 @@ static int target_restore_working_area(struct target *target, struct working_are
 		if (retval != ERROR_OK)
 			LOG_ERROR("failed to restore %" PRIu32 " bytes of working area at address " TARGET_ADDR_FMT,
 					area->size, area->address);
+		else
+			target->working_area_stats.restore_bytes += area->size;
 	}
 
 	return retval;
@@ -1839,7 +2070,10 @@ static int target_free_working_area_restore(struct target *target, struct workin
 	if (area->free)
 		return retval;
 
-	if (restore) {
+	if (restore && target->backup_working_area_lazy) {
+		/* written back when the target resumes */
+		target->working_area_stats.restores_deferred++;
+	} else if (restore) {
 		retval = target_restore_working_area(target, area);
 		/* REVISIT: Perhaps the area should be freed even if restoring fails. */
 		if (retval != ERROR_OK)
@@ -1847,6 +2081,7 @@ static int target_free_working_area_restore(struct target *target, struct workin
 	}
 
 	area->free = true;
+	target->working_area_stats.frees++;
 
 	LOG_DEBUG("freed %" PRIu32 " bytes of working area at address " TARGET_ADDR_FMT,
 			area->size, area->address);
@@ -1860,7 +2095,7 @@ static int target_free_working_area_restore(struct target *target, struct workin
 
 	target_merge_working_areas(target);
 
-	print_wa_layout(target);
+	print_wa_layout(target, NULL);
 
 	return retval;
 }
@@ -1872,9 +2107,17 @@ int target_free_working_area(struct target *target, struct working_area *area)
 
 static void target_destroy(struct target *target)
 {
+	/* don't leave algorithm data behind in the target's RAM */
+	if (target_was_examined(target) && target->state == TARGET_HALTED)
+		target_restore_working_area_lazy(target, true);
+
 	if (target->type->deinit_target)
 		target->type->deinit_target(target);
 
+	memory_cache_free(target);
+
+	free(target->working_area_shadow);
+	free(target->working_area_saved);
 	free(target->type);
 	free(target->trace_info);
 	free(target->cmd_name);
@@ -1922,11 +2165,12 @@ static void target_free_all_working_areas_restore(struct target *target, int res
 	/* Loop through all areas, restoring the allocated ones and marking them as free */
 	while (c) {
 		if (!c->free) {
-			if (restore)
+			if (restore && !target->backup_working_area_lazy)
 				target_restore_working_area(target, c);
 			c->free = true;
 			*c->user = NULL; /* Same as above */
 			c->user = NULL;
+			target->working_area_stats.frees++;
 		}
 		c = c->next;
 	}
@@ -1934,7 +2178,9 @@ static void target_free_all_working_areas_restore(struct target *target, int res
 	/* Run a merge pass to combine all areas into one */
 	target_merge_working_areas(target);
 
-	print_wa_layout(target);
+	target_restore_working_area_lazy(target, restore);
+
+	print_wa_layout(target, NULL);
 }
 
 void target_free_all_working_areas(struct target *target)
@@ -1992,7 +2238,7 @@ static int target_gdb_fileio_end_default(struct target *target,
 	return ERROR_OK;
 }
 
-static int target_profiling_default(struct target *target, uint32_t *samples,
+int target_profiling_default(struct target *target, uint32_t *samples,
 		uint32_t max_num_samples, uint32_t *num_samples, uint32_t seconds)
 {
 	struct timeval timeout, now;
@@ -2066,6 +2312,10 @@ int target_write_buffer(struct target *target, target_addr_t address, uint32_t s
 		return ERROR_FAIL;
 	}
 
+	memory_cache_invalidate_range(target, address, size);
+	target_update_working_area_lazy(target, address, size, buffer);
+	rtos_memory_written(target);
+
 	return target->type->write_buffer(target, address, size, buffer);
 }
 
@@ -2128,7 +2378,8 @@ int target_read_buffer(struct target *target, target_addr_t address, uint32_t si
 		return ERROR_FAIL;
 	}
 
-	return target->type->read_buffer(target, address, size, buffer);
+	return memory_cache_read(target, address, size, buffer,
+			target->type->read_buffer);
 }
 
 static int target_read_buffer_default(struct target *target, target_addr_t address, uint32_t count, uint8_t *buffer)
@@ -2821,6 +3072,7 @@ COMMAND_HANDLER(handle_reg_command)
 		str_to_buf(CMD_ARGV[1], strlen(CMD_ARGV[1]), buf, reg->size, 0);
 
 		reg->type->set(reg, buf);
+		rtos_registers_written(target);
 
 		value = buf_to_str(reg->value, reg->size, 16);
 		command_print(CMD_CTX, "%s (/%i): 0x%s", reg->name, (int)(reg->size), value);
@@ -3270,6 +3522,7 @@ static COMMAND_HELPER(parse_load_image_command_CMD_ARGV, struct image *image,
 COMMAND_HANDLER(handle_load_image_command)
 {
 	uint8_t *buffer;
+	const uint8_t *data;
 	size_t buf_cnt;
 	uint32_t image_size;
 	target_addr_t min_address = 0;
@@ -3293,19 +3546,26 @@ COMMAND_HANDLER(handle_load_image_command)
 	image_size = 0x0;
 	retval = ERROR_OK;
 	for (i = 0; i < image.num_sections; i++) {
-		buffer = malloc(image.sections[i].size);
-		if (buffer == NULL) {
-			command_print(CMD_CTX,
-						  "error allocating buffer for section (%d bytes)",
-						  (int)(image.sections[i].size));
-			retval = ERROR_FAIL;
-			break;
-		}
+		/* write straight from the image if its content is in memory already */
+		buffer = NULL;
+		if (image_get_section_data(&image, i, 0x0, image.sections[i].size, &data) == ERROR_OK) {
+			buf_cnt = image.sections[i].size;
+		} else {
+			buffer = malloc(image.sections[i].size);
+			if (buffer == NULL) {
+				command_print(CMD_CTX,
+							  "error allocating buffer for section (%d bytes)",
+							  (int)(image.sections[i].size));
+				retval = ERROR_FAIL;
+				break;
+			}
 
-		retval = image_read_section(&image, i, 0x0, image.sections[i].size, buffer, &buf_cnt);
-		if (retval != ERROR_OK) {
-			free(buffer);
-			break;
+			retval = image_read_section(&image, i, 0x0, image.sections[i].size, buffer, &buf_cnt);
+			if (retval != ERROR_OK) {
+				free(buffer);
+				break;
+			}
+			data = buffer;
 		}
 
 		uint32_t offset = 0;
@@ -3326,7 +3586,7 @@ COMMAND_HANDLER(handle_load_image_command)
 				length -= (image.sections[i].base_address + buf_cnt)-max_address;
 
 			retval = target_write_buffer(target,
-					image.sections[i].base_address + offset, length, buffer + offset);
+					image.sections[i].base_address + offset, length, data + offset);
 			if (retval != ERROR_OK) {
 				free(buffer);
 				break;
@@ -3420,9 +3680,98 @@ enum verify_mode {
 	IMAGE_CHECKSUM_ONLY = 2
 };
 
+/* verify_image stops reporting differences after this many */
+#define VERIFY_MAX_DIFFS	128
+/* A checksum mismatch is narrowed down to ranges of this size before the
+ * memory is read back and compared byte by byte */
+#define VERIFY_BISECT_MIN	1024
+
+/* read back a range of target memory and report every differing byte */
+static COMMAND_HELPER(verify_image_compare, target_addr_t address,
+		const uint8_t *buffer, uint32_t size, int *diffs)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	uint8_t *data;
+	int retval;
+
+	data = malloc(size);
+	if (data == NULL) {
+		command_print(CMD_CTX, "error allocating buffer for compare (%" PRIu32 " bytes)", size);
+		return ERROR_FAIL;
+	}
+
+	/* Can we use 32bit word accesses? */
+	int access_size = 1;
+	uint32_t count = size;
+	if ((count % 4) == 0 && (address % 4) == 0) {
+		access_size *= 4;
+		count /= 4;
+	}
+	retval = target_read_memory(target, address, access_size, count, data);
+	if (retval == ERROR_OK) {
+		for (uint32_t t = 0; t < size; t++) {
+			if (data[t] == buffer[t])
+				continue;
+			command_print(CMD_CTX,
+						  "diff %d address 0x%08x. Was 0x%02x instead of 0x%02x",
+						  *diffs,
+						  (unsigned)(t + address),
+						  data[t],
+						  buffer[t]);
+			if ((*diffs)++ >= VERIFY_MAX_DIFFS - 1) {
+				command_print(CMD_CTX, "More than %d errors, the rest are not printed.",
+						VERIFY_MAX_DIFFS);
+				break;
+			}
+		}
+	}
+
+	free(data);
+	return retval;
+}
+
+/* Narrow a checksum mismatch down by checksumming halves of the range on
+ * the target, so only the ranges that differ are read back */
+static COMMAND_HELPER(verify_image_bisect, target_addr_t address,
+		const uint8_t *buffer, uint32_t size, int *diffs)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	int retval;
+
+	if (size <= VERIFY_BISECT_MIN)
+		return CALL_COMMAND_HANDLER(verify_image_compare, address, buffer, size, diffs);
+
+	uint32_t half = (size / 2) & ~3u;
+	for (int part = 0; part < 2 && *diffs < VERIFY_MAX_DIFFS; part++) {
+		uint32_t offset = part ? half : 0;
+		uint32_t length = part ? size - half : half;
+		uint32_t checksum, mem_checksum;
+
+		retval = image_calculate_checksum((uint8_t *)buffer + offset, length, &checksum);
+		if (retval != ERROR_OK)
+			return retval;
+
+		/* without a target side checksum there is nothing to gain */
+		retval = target->type->checksum_memory(target, address + offset, length, &mem_checksum);
+		if (retval != ERROR_OK)
+			return CALL_COMMAND_HANDLER(verify_image_compare, address + offset,
+					buffer + offset, size - offset, diffs);
+
+		if (checksum != mem_checksum) {
+			retval = CALL_COMMAND_HANDLER(verify_image_bisect, address + offset,
+					buffer + offset, length, diffs);
+			if (retval != ERROR_OK)
+				return retval;
+		}
+	}
+
+	return ERROR_OK;
+}
+
 static COMMAND_HELPER(handle_verify_image_command_internal, enum verify_mode verify)
 {
 	uint8_t *buffer;
+	const uint8_t *data;
 	size_t buf_cnt;
 	uint32_t image_size;
 	int i;
@@ -3465,22 +3814,29 @@ static COMMAND_HELPER(handle_verify_image_command_internal, enum verify_mode ver
 	int diffs = 0;
 	retval = ERROR_OK;
 	for (i = 0; i < image.num_sections; i++) {
-		buffer = malloc(image.sections[i].size);
-		if (buffer == NULL) {
-			command_print(CMD_CTX,
-					"error allocating buffer for section (%d bytes)",
-					(int)(image.sections[i].size));
-			break;
-		}
-		retval = image_read_section(&image, i, 0x0, image.sections[i].size, buffer, &buf_cnt);
-		if (retval != ERROR_OK) {
-			free(buffer);
-			break;
+		/* checksum straight from the image if its content is in memory already */
+		buffer = NULL;
+		if (image_get_section_data(&image, i, 0x0, image.sections[i].size, &data) == ERROR_OK) {
+			buf_cnt = image.sections[i].size;
+		} else {
+			buffer = malloc(image.sections[i].size);
+			if (buffer == NULL) {
+				command_print(CMD_CTX,
+						"error allocating buffer for section (%d bytes)",
+						(int)(image.sections[i].size));
+				break;
+			}
+			retval = image_read_section(&image, i, 0x0, image.sections[i].size, buffer, &buf_cnt);
+			if (retval != ERROR_OK) {
+				free(buffer);
+				break;
+			}
+			data = buffer;
 		}
 
 		if (verify >= IMAGE_VERIFY) {
 			/* calculate checksum of image */
-			retval = image_calculate_checksum(buffer, buf_cnt, &checksum);
+			retval = image_calculate_checksum((uint8_t *)data, buf_cnt, &checksum);
 			if (retval != ERROR_OK) {
 				free(buffer);
 				break;
@@ -3498,43 +3854,16 @@ static COMMAND_HELPER(handle_verify_image_command_internal, enum verify_mode ver
 				goto done;
 			}
 			if (checksum != mem_checksum) {
-				/* failed crc checksum, fall back to a binary compare */
-				uint8_t *data;
-
+				/* failed crc checksum, locate the differences */
 				if (diffs == 0)
-					LOG_ERROR("checksum mismatch - attempting binary compare");
-
-				data = malloc(buf_cnt);
+					LOG_ERROR("checksum mismatch - locating differences");
 
-				/* Can we use 32bit word accesses? */
-				int size = 1;
-				int count = buf_cnt;
-				if ((count % 4) == 0) {
-					size *= 4;
-					count /= 4;
-				}
-				retval = target_read_memory(target, image.sections[i].base_address, size, count, data);
-				if (retval == ERROR_OK) {
-					uint32_t t;
-					for (t = 0; t < buf_cnt; t++) {
-						if (data[t] != buffer[t]) {
-							command_print(CMD_CTX,
-										  "diff %d address 0x%08x. Was 0x%02x instead of 0x%02x",
-										  diffs,
-										  (unsigned)(t + image.sections[i].base_address),
-										  data[t],
-										  buffer[t]);
-							if (diffs++ >= 127) {
-								command_print(CMD_CTX, "More than 128 errors, the rest are not printed.");
-								free(data);
-								free(buffer);
-								goto done;
-							}
-						}
-						keep_alive();
-					}
+				retval = CALL_COMMAND_HANDLER(verify_image_bisect,
+						image.sections[i].base_address, data, buf_cnt, &diffs);
+				if (retval != ERROR_OK || diffs >= VERIFY_MAX_DIFFS) {
+					free(buffer);
+					goto done;
 				}
-				free(data);
 			}
 		} else {
 			command_print(CMD_CTX, "address " TARGET_ADDR_FMT " length 0x%08zx",
@@ -3571,6 +3900,116 @@ COMMAND_HANDLER(handle_verify_image_command)
 	return CALL_COMMAND_HANDLER(handle_verify_image_command_internal, IMAGE_VERIFY);
 }
 
+COMMAND_HANDLER(handle_working_area_layout_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+
+	if (CMD_ARGC > 1)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (CMD_ARGC == 1) {
+		if (strcmp(CMD_ARGV[0], "reset"))
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		memset(&target->working_area_stats, 0, sizeof(target->working_area_stats));
+		return ERROR_OK;
+	}
+
+	if (target->working_areas == NULL) {
+		command_print(CMD_CTX, "working area not allocated yet, %" PRIu32 " bytes configured",
+				target->working_area_size);
+		return ERROR_OK;
+	}
+
+	print_wa_layout(target, CMD_CTX);
+	return ERROR_OK;
+}
+
+/* Benchmark and self-test the host CRC32 engines; with an address, also
+ * compare the host result against the target side checksum algorithm */
+COMMAND_HANDLER(handle_checksum_benchmark_command)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	uint32_t size_kib = 16 * 1024;
+	target_addr_t address = 0;
+	int retval = ERROR_OK;
+
+	if (CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	if (CMD_ARGC >= 1)
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[0], size_kib);
+	if (CMD_ARGC == 2)
+		COMMAND_PARSE_ADDRESS(CMD_ARGV[1], address);
+
+	if (size_kib == 0 || size_kib > 256 * 1024) {
+		LOG_ERROR("size must be between 1 and %d KiB", 256 * 1024);
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+	uint32_t size = size_kib * 1024;
+
+	uint8_t *buffer = malloc(size);
+	if (!buffer) {
+		LOG_ERROR("Out of memory");
+		return ERROR_FAIL;
+	}
+
+	if (CMD_ARGC == 2) {
+		retval = target_read_buffer(target, address, size, buffer);
+		if (retval != ERROR_OK) {
+			free(buffer);
+			return retval;
+		}
+	} else {
+		uint32_t seed = 1;
+		for (uint32_t i = 0; i < size; i++) {
+			seed = seed * 1103515245 + 12345;
+			buffer[i] = seed >> 16;
+		}
+	}
+
+	const struct image_crc32_engine *selected = image_crc32_engine();
+	for (const struct image_crc32_engine *e = image_crc32_engines; e->name; e++) {
+		if (!e->supported()) {
+			command_print(CMD_CTX, "%s: not supported by this CPU", e->name);
+			continue;
+		}
+		if (image_crc32_selftest(e) != ERROR_OK) {
+			command_print(CMD_CTX, "%s: self-test FAILED", e->name);
+			continue;
+		}
+
+		/* run for at least 100ms to get a usable figure */
+		int64_t start = timeval_ms();
+		int64_t elapsed;
+		uint64_t bytes = 0;
+		uint32_t crc;
+		do {
+			crc = e->update(0xffffffff, buffer, size);
+			bytes += size;
+			elapsed = timeval_ms() - start;
+		} while (elapsed < 100);
+		keep_alive();
+
+		command_print(CMD_CTX, "%s%s: %" PRIu64 " MB/s, crc 0x%08" PRIx32,
+				e->name, e == selected ? " (in use)" : "",
+				bytes * 1000 / elapsed / 1000000, crc);
+	}
+
+	if (CMD_ARGC == 2) {
+		uint32_t host_crc, target_crc;
+		image_calculate_checksum(buffer, size, &host_crc);
+		retval = target_checksum_memory(target, address, size, &target_crc);
+		if (retval == ERROR_OK) {
+			command_print(CMD_CTX, "target: crc 0x%08" PRIx32 ", %s", target_crc,
+					target_crc == host_crc ? "matches host" : "MISMATCH");
+			if (target_crc != host_crc)
+				retval = ERROR_IMAGE_CHECKSUM;
+		}
+	}
+
+	free(buffer);
+	return retval;
+}
+
 COMMAND_HANDLER(handle_test_image_command)
 {
 	return CALL_COMMAND_HANDLER(handle_verify_image_command_internal, IMAGE_TEST);
@@ -4660,16 +5099,26 @@ no_params:
 		case TCFG_WORK_AREA_BACKUP:
 			if (goi->isconfigure) {
 				target_free_all_working_areas(target);
-				e = Jim_GetOpt_Wide(goi, &w);
-				if (e != JIM_OK)
-					return e;
-				/* make this exactly 1 or 0 */
-				target->backup_working_area = (!!w);
+				if (goi->argc > 0 && !strcmp(Jim_GetString(goi->argv[0], NULL), "lazy")) {
+					Jim_GetOpt_Obj(goi, NULL);
+					target->backup_working_area = 1;
+					target->backup_working_area_lazy = true;
+				} else {
+					e = Jim_GetOpt_Wide(goi, &w);
+					if (e != JIM_OK)
+						return e;
+					/* make this exactly 1 or 0 */
+					target->backup_working_area = (!!w);
+					target->backup_working_area_lazy = false;
+				}
 			} else {
 				if (goi->argc != 0)
 					goto no_params;
 			}
-			Jim_SetResult(goi->interp, Jim_NewIntObj(goi->interp, target->backup_working_area));
+			if (target->backup_working_area_lazy)
+				Jim_SetResultString(goi->interp, "lazy", -1);
+			else
+				Jim_SetResult(goi->interp, Jim_NewIntObj(goi->interp, target->backup_working_area));
 			/* loop for more e*/
 			break;
 
@@ -5949,6 +6398,10 @@ static const struct command_registration target_command_handlers[] = {
 
 int target_register_commands(struct command_context *cmd_ctx)
 {
+	int retval = memory_cache_register_commands(cmd_ctx);
+	if (retval != ERROR_OK)
+		return retval;
+
 	return register_commands(cmd_ctx, NULL, target_command_handlers);
 }
 
@@ -6387,6 +6840,22 @@ static const struct command_registration target_exec_command_handlers[] = {
 		.mode = COMMAND_EXEC,
 		.usage = "filename [offset [type]]",
 	},
+	{
+		.name = "working_area_layout",
+		.handler = handle_working_area_layout_command,
+		.mode = COMMAND_EXEC,
+		.help = "show the working area blocks and allocator statistics, "
+			"or reset the statistics",
+		.usage = "['reset']",
+	},
+	{
+		.name = "checksum_benchmark",
+		.handler = handle_checksum_benchmark_command,
+		.mode = COMMAND_EXEC,
+		.help = "self-test and benchmark the host CRC32 implementations, "
+			"optionally on target memory compared against the target checksum",
+		.usage = "[size_kib [address]]",
+	},
 	{
 		.name = "mem2array",
 		.mode = COMMAND_EXEC,
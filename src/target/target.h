@@ -101,6 +101,17 @@ struct working_area {
 	struct working_area *next;
 };
 
+/* working area allocator counters, shown by "working_area_layout" */
+struct working_area_stats {
+	uint32_t allocs;
+	uint32_t alloc_failures;
+	uint32_t frees;
+	uint32_t restores_deferred;		/* frees whose restore waits for resume */
+	uint64_t backup_bytes;			/* read from the target to save its content */
+	uint64_t backup_reused;			/* not read again, a lazy backup still held it */
+	uint64_t restore_bytes;			/* written back to the target */
+};
+
 struct gdb_service {
 	struct target *target;
 	/*  field for smp display  */
@@ -161,7 +172,13 @@ struct target {
 	target_addr_t working_area_phys;			/* physical address */
 	uint32_t working_area_size;			/* size in bytes */
 	uint32_t backup_working_area;		/* whether the content of the working area has to be preserved */
+	bool backup_working_area_lazy;		/* restore the content only before the target runs */
 	struct working_area *working_areas;/* list of allocated working areas */
+	uint8_t *working_area_shadow;		/* lazy backup of the whole working area */
+	uint32_t *working_area_saved;		/* words of the shadow that still need restoring */
+	target_addr_t working_area_shadow_base;
+	uint32_t working_area_shadow_size;
+	struct working_area_stats working_area_stats;
 	enum target_debug_reason debug_reason;/* reason why the target entered debug state */
 	enum target_endianness endianness;	/* target endianness */
 	/* also see: target_state_name() */
@@ -170,6 +187,7 @@ struct target {
 	struct breakpoint *breakpoints;		/* list of breakpoints */
 	struct watchpoint *watchpoints;		/* list of watchpoints */
 	struct trace *trace_info;			/* generic trace information */
+	struct memory_cache *mem_cache;		/* host side cache of memory, NULL if disabled */
 	struct debug_msg_receiver *dbgmsg;	/* list of debug message receivers */
 	uint32_t dbg_msg_enabled;			/* debug message status */
 	void *arch_info;					/* architecture specific information */
@@ -378,6 +396,12 @@ int target_call_timer_callbacks(void);
  * a synchronous command completes.
  */
 int target_call_timer_callbacks_now(void);
+/**
+ * Returns when the next registered timer callback is due, as a
+ * timeval_ms() timestamp. server_loop() uses this to bound how long it
+ * may sleep waiting for socket activity.
+ */
+int64_t target_timer_next_event(void);
 
 struct target *get_target_by_num(int num);
 struct target *get_current_target(struct command_context *cmd_ctx);
@@ -605,6 +629,15 @@ int target_get_gdb_fileio_info(struct target *target, struct gdb_fileio_info *fi
  */
 int target_gdb_fileio_end(struct target *target, int retcode, int fileio_errno, bool ctrl_c);
 
+/**
+ * Sample the PC by repeatedly halting and resuming the target.
+ *
+ * Used for targets without a dedicated profiling hook, and as a fallback
+ * by those whose non-intrusive sampling hardware turns out to be absent.
+ */
+int target_profiling_default(struct target *target, uint32_t *samples,
+		uint32_t max_num_samples, uint32_t *num_samples, uint32_t seconds);
+
 
 
 /** Return the *name* of this targets current state */
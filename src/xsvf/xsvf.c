@@ -40,6 +40,7 @@
 
 #include "xsvf.h"
 #include <jtag/jtag.h>
+#include <jtag/commands.h>
 #include <svf/svf.h>
 
 /* XSVF commands, from appendix B of xapp503.pdf  */
@@ -119,8 +120,20 @@ TDO  (1);
 
 #define XSTATE_MAX_PATH 12
 
+/* number of XSDR scans without retries queued before the queue is run */
+#define XSVF_MAX_PENDING_SCANS 256
+
 static int xsvf_fd;
 
+/* the file is read through a buffer, xsvf_pos is the offset of its next byte */
+#define XSVF_READ_BUFFER_SIZE (64 * 1024)
+static uint8_t xsvf_read_buf[XSVF_READ_BUFFER_SIZE];
+static size_t xsvf_read_buf_pos, xsvf_read_buf_len;
+static long xsvf_pos;
+
+/* offset of the first queued XSDR scan that failed its TDO check */
+static long xsvf_mismatch_offset;
+
 /* map xsvf tap state to an openocd "tap_state_t" */
 static tap_state_t xsvf_to_tap(int xsvf_state)
 {
@@ -183,19 +196,108 @@ static tap_state_t xsvf_to_tap(int xsvf_state)
 	return ret;
 }
 
-static int xsvf_read_buffer(int num_bits, int fd, uint8_t *buf)
+/* Read count bytes from the file. Returns count, or -1 if the file
+ * ends early or can't be read. */
+static int xsvf_read(void *buf, size_t count)
+{
+	uint8_t *dst = buf;
+	size_t done = 0;
+
+	while (done < count) {
+		if (xsvf_read_buf_pos == xsvf_read_buf_len) {
+			ssize_t len = read(xsvf_fd, xsvf_read_buf, sizeof(xsvf_read_buf));
+			if (len <= 0)
+				return -1;
+			xsvf_read_buf_pos = 0;
+			xsvf_read_buf_len = len;
+		}
+
+		size_t this_count = MIN(count - done, xsvf_read_buf_len - xsvf_read_buf_pos);
+		memcpy(dst + done, xsvf_read_buf + xsvf_read_buf_pos, this_count);
+		xsvf_read_buf_pos += this_count;
+		done += this_count;
+	}
+
+	xsvf_pos += count;
+	return count;
+}
+
+static int xsvf_read_buffer(int num_bits, uint8_t *buf)
 {
-	int num_bytes;
+	int num_bytes = (num_bits + 7) / 8;
 
-	for (num_bytes = (num_bits + 7) / 8; num_bytes > 0; num_bytes--) {
-		/* reverse the order of bytes as they are read sequentially from file */
-		if (read(fd, buf + num_bytes - 1, 1) < 0)
-			return ERROR_XSVF_EOF;
+	if (xsvf_read(buf, num_bytes) < 0)
+		return ERROR_XSVF_EOF;
+
+	/* reverse the order of bytes as they are read sequentially from file */
+	for (int i = 0; i < num_bytes / 2; i++) {
+		uint8_t t = buf[i];
+		buf[i] = buf[num_bytes - 1 - i];
+		buf[num_bytes - 1 - i] = t;
 	}
 
 	return ERROR_OK;
 }
 
+/* TDO check of an XSDR scan whose result is only looked at when the queue runs */
+struct xsvf_dr_check {
+	const char *op_name;
+	long offset;
+	int num_bits;
+	uint8_t *in_value;
+	uint8_t *expected;
+	uint8_t *mask;
+};
+
+static int xsvf_dr_check_callback(jtag_callback_data_t data0,
+	jtag_callback_data_t data1,
+	jtag_callback_data_t data2,
+	jtag_callback_data_t data3)
+{
+	struct xsvf_dr_check *check = (struct xsvf_dr_check *)data0;
+
+	if (buf_cmp_mask(check->in_value, check->expected, check->mask, check->num_bits)) {
+		LOG_USER("%s mismatch", check->op_name);
+		xsvf_mismatch_offset = check->offset;
+		return ERROR_JTAG_QUEUE_FAILED;
+	}
+	return ERROR_OK;
+}
+
+/* Queue an XSDR scan that won't be retried, without running the queue.
+ * The buffers are reused by the next XSDR, so the scan gets its own copies. */
+static void xsvf_queue_dr_scan(struct jtag_tap *tap, const char *op_name, long offset,
+	int num_bits, const uint8_t *out, const uint8_t *expected, const uint8_t *mask)
+{
+	int num_bytes = DIV_ROUND_UP(num_bits, 8);
+	struct xsvf_dr_check *check = cmd_queue_alloc(sizeof(*check));
+	struct scan_field field;
+
+	check->op_name = op_name;
+	check->offset = offset;
+	check->num_bits = num_bits;
+	check->in_value = cmd_queue_alloc(num_bytes);
+	check->expected = cmd_queue_alloc(num_bytes);
+	check->mask = cmd_queue_alloc(num_bytes);
+	memcpy(check->expected, expected, num_bytes);
+	memcpy(check->mask, mask, num_bytes);
+
+	field.num_bits = num_bits;
+	field.out_value = cmd_queue_alloc(num_bytes);
+	memcpy((uint8_t *)field.out_value, out, num_bytes);
+	field.in_value = check->in_value;
+
+	if (tap == NULL)
+		jtag_add_plain_dr_scan(field.num_bits,
+				field.out_value,
+				field.in_value,
+				TAP_DRPAUSE);
+	else
+		jtag_add_dr_scan(tap, 1, &field, TAP_DRPAUSE);
+
+	jtag_add_callback4(xsvf_dr_check_callback, (jtag_callback_data_t)check, 0, 0, 0);
+}
+
 COMMAND_HANDLER(handle_xsvf_command)
 {
 	uint8_t *dr_out_buf = NULL;				/* from host to device (TDI) */
@@ -222,6 +324,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 	int do_abort = 0;
 	int unsupported = 0;
 	int tdo_mismatch = 0;
+	int pending_scans = 0;
 	int result;
 	int verbose = 1;
 
@@ -259,6 +362,9 @@ COMMAND_HANDLER(handle_xsvf_command)
 		command_print(CMD_CTX, "file \"%s\" not found", filename);
 		return ERROR_FAIL;
 	}
+	xsvf_read_buf_pos = 0;
+	xsvf_read_buf_len = 0;
+	xsvf_pos = 0;
 
 	/* if this argument is present, then interpret xruntest counts as TCK cycles rather than as
 	 *usecs */
@@ -274,9 +380,27 @@ COMMAND_HANDLER(handle_xsvf_command)
 	LOG_WARNING("XSVF support in OpenOCD is limited. Consider using SVF instead");
 	LOG_USER("xsvf processing file: \"%s\"", filename);
 
-	while (read(xsvf_fd, &opcode, 1) > 0) {
+	while (1) {
+		bool eof = xsvf_read(&opcode, 1) < 0;
+
+		/* Run the XSDR scans queued without retries before anything that
+		 * isn't such a scan, so errors keep getting reported in order. */
+		if (pending_scans && (eof || pending_scans >= XSVF_MAX_PENDING_SCANS
+				|| !((opcode == XSDR || opcode == XSDRTDO) && xrepeat == 0))) {
+			pending_scans = 0;
+			result = jtag_execute_queue();
+			if (result != ERROR_OK) {
+				file_offset = xsvf_mismatch_offset;
+				tdo_mismatch = 1;
+				goto check_error;
+			}
+		}
+
+		if (eof)
+			break;
+
 		/* record the position of this opcode within the file */
-		file_offset = lseek(xsvf_fd, 0, SEEK_CUR) - 1;
+		file_offset = xsvf_pos - 1;
 
 		/* maybe collect another state for a pathmove();
 		 * or terminate a path.
@@ -296,7 +420,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 						break;
 					}
 
-					if (read(xsvf_fd, &uc, 1) < 0) {
+					if (xsvf_read(&uc, 1) < 0) {
 						do_abort = 1;
 						break;
 					}
@@ -368,7 +492,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 			case XTDOMASK:
 				LOG_DEBUG("XTDOMASK");
 				if (dr_in_mask &&
-						(xsvf_read_buffer(xsdrsize, xsvf_fd, dr_in_mask) != ERROR_OK))
+						(xsvf_read_buffer(xsdrsize, dr_in_mask) != ERROR_OK))
 					do_abort = 1;
 				break;
 
@@ -376,7 +500,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 			{
 				uint8_t xruntest_buf[4];
 
-				if (read(xsvf_fd, xruntest_buf, 4) < 0) {
+				if (xsvf_read(xruntest_buf, 4) < 0) {
 					do_abort = 1;
 					break;
 				}
@@ -390,7 +514,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 			{
 				uint8_t myrepeat;
 
-				if (read(xsvf_fd, &myrepeat, 1) < 0)
+				if (xsvf_read(&myrepeat, 1) < 0)
 					do_abort = 1;
 				else {
 					xrepeat = myrepeat;
@@ -403,7 +527,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 			{
 				uint8_t xsdrsize_buf[4];
 
-				if (read(xsvf_fd, xsdrsize_buf, 4) < 0) {
+				if (xsvf_read(xsdrsize_buf, 4) < 0) {
 					do_abort = 1;
 					break;
 				}
@@ -433,14 +557,13 @@ COMMAND_HANDLER(handle_xsvf_command)
 
 				const char *op_name = (opcode == XSDR ? "XSDR" : "XSDRTDO");
 
-				if (xsvf_read_buffer(xsdrsize, xsvf_fd, dr_out_buf) != ERROR_OK) {
+				if (xsvf_read_buffer(xsdrsize, dr_out_buf) != ERROR_OK) {
 					do_abort = 1;
 					break;
 				}
 
 				if (opcode == XSDRTDO) {
-					if (xsvf_read_buffer(xsdrsize, xsvf_fd,
-						dr_in_buf)  != ERROR_OK) {
+					if (xsvf_read_buffer(xsdrsize, dr_in_buf)  != ERROR_OK) {
 						do_abort = 1;
 						break;
 					}
@@ -451,6 +574,20 @@ COMMAND_HANDLER(handle_xsvf_command)
 
 				LOG_DEBUG("%s %d", op_name, xsdrsize);
 
+				/* without retries, nothing depends on the outcome: just queue
+				 * the scan and check it when the queue runs */
+				if (xrepeat == 0 && dr_in_buf) {
+					/* blame the first scan of the batch if the queue fails
+					 * for other reasons than a TDO check */
+					if (pending_scans == 0)
+						xsvf_mismatch_offset = file_offset;
+					xsvf_queue_dr_scan(tap, op_name, file_offset, xsdrsize,
+							dr_out_buf, dr_in_buf, dr_in_mask);
+					pending_scans++;
+					matched = 1;
+					limit = 0;
+				}
+
 				for (attempt = 0; attempt < limit; ++attempt) {
 					struct scan_field field;
 
@@ -578,7 +715,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 			{
 				tap_state_t mystate;
 
-				if (read(xsvf_fd, &uc, 1) < 0) {
+				if (xsvf_read(&uc, 1) < 0) {
 					do_abort = 1;
 					break;
 				}
@@ -621,7 +758,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 
 			case XENDIR:
 
-				if (read(xsvf_fd, &uc, 1) < 0) {
+				if (xsvf_read(&uc, 1) < 0) {
 					do_abort = 1;
 					break;
 				}
@@ -642,7 +779,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 
 			case XENDDR:
 
-				if (read(xsvf_fd, &uc, 1) < 0) {
+				if (xsvf_read(&uc, 1) < 0) {
 					do_abort = 1;
 					break;
 				}
@@ -671,14 +808,14 @@ COMMAND_HANDLER(handle_xsvf_command)
 
 				if (opcode == XSIR) {
 					/* one byte bitcount */
-					if (read(xsvf_fd, short_buf, 1) < 0) {
+					if (xsvf_read(short_buf, 1) < 0) {
 						do_abort = 1;
 						break;
 					}
 					bitcount = short_buf[0];
 					LOG_DEBUG("XSIR %d", bitcount);
 				} else {
-					if (read(xsvf_fd, short_buf, 2) < 0) {
+					if (xsvf_read(short_buf, 2) < 0) {
 						do_abort = 1;
 						break;
 					}
@@ -688,7 +825,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 
 				ir_buf = malloc((bitcount + 7) / 8);
 
-				if (xsvf_read_buffer(bitcount, xsvf_fd, ir_buf) != ERROR_OK)
+				if (xsvf_read_buffer(bitcount, ir_buf) != ERROR_OK)
 					do_abort = 1;
 				else {
 					struct scan_field field;
@@ -731,7 +868,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 				char comment[128];
 
 				do {
-					if (read(xsvf_fd, &uc, 1) < 0) {
+					if (xsvf_read(&uc, 1) < 0) {
 						do_abort = 1;
 						break;
 					}
@@ -761,9 +898,9 @@ COMMAND_HANDLER(handle_xsvf_command)
 				tap_state_t end_state;
 				int delay;
 
-				if (read(xsvf_fd, &wait_local, 1) < 0
-					|| read(xsvf_fd, &end, 1) < 0
-					|| read(xsvf_fd, delay_buf, 4) < 0) {
+				if (xsvf_read(&wait_local, 1) < 0
+					|| xsvf_read(&end, 1) < 0
+					|| xsvf_read(delay_buf, 4) < 0) {
 						do_abort = 1;
 						break;
 				}
@@ -806,10 +943,10 @@ COMMAND_HANDLER(handle_xsvf_command)
 				int clock_count;
 				int usecs;
 
-				if (read(xsvf_fd, &wait_local, 1) < 0
-						||  read(xsvf_fd, &end, 1) < 0
-						||  read(xsvf_fd, clock_buf, 4) < 0
-						||  read(xsvf_fd, usecs_buf, 4) < 0) {
+				if (xsvf_read(&wait_local, 1) < 0
+						||  xsvf_read(&end, 1) < 0
+						||  xsvf_read(clock_buf, 4) < 0
+						||  xsvf_read(usecs_buf, 4) < 0) {
 					do_abort = 1;
 					break;
 				}
@@ -858,7 +995,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 				*/
 				uint8_t count_buf[4];
 
-				if (read(xsvf_fd, count_buf, 4) < 0) {
+				if (xsvf_read(count_buf, 4) < 0) {
 					do_abort = 1;
 					break;
 				}
@@ -877,9 +1014,9 @@ COMMAND_HANDLER(handle_xsvf_command)
 				uint8_t clock_buf[4];
 				uint8_t usecs_buf[4];
 
-				if (read(xsvf_fd, &state, 1) < 0
-						|| read(xsvf_fd, clock_buf, 4) < 0
-						|| read(xsvf_fd, usecs_buf, 4) < 0) {
+				if (xsvf_read(&state, 1) < 0
+						|| xsvf_read(clock_buf, 4) < 0
+						|| xsvf_read(usecs_buf, 4) < 0) {
 					do_abort = 1;
 					break;
 				}
@@ -905,8 +1042,8 @@ COMMAND_HANDLER(handle_xsvf_command)
 
 				LOG_DEBUG("LSDR");
 
-				if (xsvf_read_buffer(xsdrsize, xsvf_fd, dr_out_buf) != ERROR_OK
-						|| xsvf_read_buffer(xsdrsize, xsvf_fd, dr_in_buf) != ERROR_OK) {
+				if (xsvf_read_buffer(xsdrsize, dr_out_buf) != ERROR_OK
+						|| xsvf_read_buffer(xsdrsize, dr_in_buf) != ERROR_OK) {
 					do_abort = 1;
 					break;
 				}
@@ -963,7 +1100,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 			{
 				uint8_t trst_mode;
 
-				if (read(xsvf_fd, &trst_mode, 1) < 0) {
+				if (xsvf_read(&trst_mode, 1) < 0) {
 					do_abort = 1;
 					break;
 				}
@@ -990,6 +1127,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 				unsupported = 1;
 		}
 
+check_error:
 		if (do_abort || unsupported || tdo_mismatch) {
 			LOG_DEBUG("xsvf failed, setting taps to reasonable state");
 
@@ -1013,7 +1151,7 @@ COMMAND_HANDLER(handle_xsvf_command)
 	}
 
 	if (unsupported) {
-		off_t offset = lseek(xsvf_fd, 0, SEEK_CUR) - 1;
+		off_t offset = xsvf_pos - 1;
 		command_print(CMD_CTX,
 			"unsupported xsvf command (0x%02X) at offset %jd, aborting",
 			uc, (intmax_t)offset);